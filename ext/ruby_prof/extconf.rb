@@ -19,4 +19,19 @@ if CONFIG['warnflags']
   CONFIG['warnflags'].gsub!('-Wdeclaration-after-statement', '')
 end
 
+# Ruby 3.2 no longer stores a singleton class's attached object in the __attached__ instance variable
+have_func('rb_class_attached_object', 'ruby.h')
+
+# Fiber schedulers were added in Ruby 3.0
+have_func('rb_fiber_scheduler_current', 'ruby/fiber/scheduler.h')
+
+# Call trees are post processed on native threads when pthreads are available
+have_header('pthread.h')
+
+# Reports can be compressed as they are written with zlib and zstd when they are available.
+# zstd can be located with --with-zstd-dir
+have_header('zlib.h') && have_library('z', 'deflate')
+dir_config('zstd')
+have_header('zstd.h') && have_library('zstd', 'ZSTD_compressStream2')
+
 create_makefile("ruby_prof")
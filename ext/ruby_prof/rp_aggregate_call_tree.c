@@ -15,7 +15,9 @@ void prof_aggregate_call_tree_mark(void* data)
     if (call_tree->source_file != Qnil)
         rb_gc_mark(call_tree->source_file);
 
-    prof_measurement_mark(call_tree->measurement);
+    // Keeps the profile, and so the parent and target of the aggregate, alive
+    prof_method_mark(call_tree->method);
+    prof_measurement_mark(&call_tree->measurement);
 }
 
 static void prof_aggregate_call_tree_ruby_gc_free(void* data)
@@ -43,6 +43,22 @@ prof_allocation_t* prof_allocation_create(void)
     return result;
 }
 
+/* Creates an allocation with the same class, location and totals as other */
+prof_allocation_t* prof_allocation_copy(prof_allocation_t* other)
+{
+    prof_allocation_t* result = prof_allocation_create();
+    result->key = other->key;
+    result->klass_flags = other->klass_flags;
+    result->klass = other->klass;
+    result->klass_name = other->klass_name;
+    result->source_file = other->source_file;
+    result->source_line = other->source_line;
+    result->count = other->count;
+    result->memory = other->memory;
+
+    return result;
+}
+
 prof_allocation_t* prof_get_allocation(VALUE self)
 {
     /* Can't use Data_Get_Struct because that triggers the event hook
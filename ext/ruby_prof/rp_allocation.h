@@ -22,6 +22,7 @@ typedef struct prof_allocation_t
 
 void rp_init_allocation(void);
 void prof_allocation_free(prof_allocation_t* allocation);
+prof_allocation_t* prof_allocation_copy(prof_allocation_t* other);
 void prof_allocation_mark(void* data);
 VALUE prof_allocation_wrap(prof_allocation_t* allocation);
 prof_allocation_t* prof_allocation_get(VALUE self);
@@ -2,9 +2,30 @@
    Please see the LICENSE file for copyright and distribution information */
 
 #include "rp_call_tree.h"
+#include "rp_call_trees.h"
+#include "rp_profile.h"
 
 VALUE cRpCallTree;
 
+/* Returns the call tree version of the profile the call tree belongs to, see prof_profile_call_tree_version */
+unsigned int prof_call_tree_version(prof_call_tree_t* call_tree)
+{
+    return call_tree->method ? prof_profile_call_tree_version(call_tree->method->profile) : 0;
+}
+
+void prof_call_tree_invalidate(prof_call_tree_t* call_tree)
+{
+    if (call_tree->method)
+        prof_profile_invalidate_call_trees(call_tree->method->profile);
+}
+
+/* Raises if the profile the call tree belongs to is being post processed, see prof_profile_check_post_processed */
+void prof_call_tree_check_post_processed(prof_call_tree_t* call_tree)
+{
+    if (call_tree->method)
+        prof_profile_check_post_processed(call_tree->method->profile);
+}
+
 /* =======  prof_call_tree_t   ========*/
 prof_call_tree_t* prof_call_tree_create(prof_method_t* method, prof_call_tree_t* parent, VALUE source_file, int source_line)
 {
@@ -13,14 +34,65 @@ prof_call_tree_t* prof_call_tree_create(prof_method_t* method, prof_call_tree_t*
     result->parent = parent;
     result->object = Qnil;
     result->visits = 0;
+    result->depth = parent ? prof_call_figure_depth(parent) + 1 : 0;
     result->source_line = source_line;
     result->source_file = source_file;
     result->children = rb_st_init_numtable();
-    result->measurement = prof_measurement_create();
+    prof_measurement_init(&result->measurement);
+    result->waits = NULL;
 
     return result;
 }
 
+/* =======  Fiber scheduler waits   ========*/
+static prof_measurement_t* prof_call_tree_wait(prof_call_tree_t* self, ID reason)
+{
+    if (!self->waits)
+        self->waits = rb_st_init_numtable();
+
+    st_data_t value;
+    if (rb_st_lookup(self->waits, (st_data_t)reason, &value))
+        return (prof_measurement_t*)value;
+
+    prof_measurement_t* result = prof_measurement_create();
+    rb_st_insert(self->waits, (st_data_t)reason, (st_data_t)result);
+    return result;
+}
+
+/* Records that the method this call tree represents blocked in a fiber scheduler hook */
+void prof_call_tree_add_wait(prof_call_tree_t* self, ID reason, double wait_time)
+{
+    prof_measurement_t* measurement = prof_call_tree_wait(self, reason);
+    measurement->called++;
+    measurement->total_time += wait_time;
+    measurement->wait_time += wait_time;
+}
+
+static int prof_call_tree_merge_wait(st_data_t key, st_data_t value, st_data_t data)
+{
+    prof_call_tree_t* self = (prof_call_tree_t*)data;
+    prof_measurement_merge_internal(prof_call_tree_wait(self, (ID)key), (prof_measurement_t*)value);
+    return ST_CONTINUE;
+}
+
+static void prof_call_tree_merge_waits(prof_call_tree_t* self, prof_call_tree_t* other)
+{
+    if (other->waits)
+        rb_st_foreach(other->waits, prof_call_tree_merge_wait, (st_data_t)self);
+}
+
+static int prof_call_tree_mark_wait(st_data_t key, st_data_t value, st_data_t data)
+{
+    prof_measurement_mark((prof_measurement_t*)value);
+    return ST_CONTINUE;
+}
+
+static int prof_call_tree_free_wait(st_data_t key, st_data_t value, st_data_t data)
+{
+    prof_measurement_free((prof_measurement_t*)value);
+    return ST_CONTINUE;
+}
+
 prof_call_tree_t* prof_call_tree_copy(prof_call_tree_t* other)
 {
     prof_call_tree_t* result = ALLOC(prof_call_tree_t);
@@ -30,15 +102,15 @@ prof_call_tree_t* prof_call_tree_copy(prof_call_tree_t* other)
 
     result->method = other->method;
     result->parent = other->parent;
+    result->depth = other->depth;
     result->source_line = other->source_line;
     result->source_file = other->source_file;
 
-    result->measurement = prof_measurement_create();
-    result->measurement->called = other->measurement->called;
-    result->measurement->total_time = other->measurement->total_time;
-    result->measurement->self_time = other->measurement->self_time;
-    result->measurement->wait_time = other->measurement->wait_time;
-    result->measurement->object = Qnil;
+    prof_measurement_init(&result->measurement);
+    prof_measurement_merge_internal(&result->measurement, &other->measurement);
+
+    result->waits = NULL;
+    prof_call_tree_merge_waits(result, other);
 
     return result;
 }
@@ -73,7 +145,10 @@ void prof_call_tree_mark(void* data)
         rb_gc_mark(call_tree->source_file);
 
     prof_method_mark(call_tree->method);
-    prof_measurement_mark(call_tree->measurement);
+    prof_measurement_mark(&call_tree->measurement);
+
+    if (call_tree->waits)
+        rb_st_foreach(call_tree->waits, prof_call_tree_mark_wait, 0);
 
     // Recurse down through the whole call tree but only from the top node
     // to avoid calling mark over and over and over.
@@ -111,8 +186,14 @@ void prof_call_tree_free(prof_call_tree_t* call_tree_data)
     rb_st_foreach(call_tree_data->children, prof_call_tree_free_children, 0);
     rb_st_free_table(call_tree_data->children);
 
-    // Free measurement
-    prof_measurement_free(call_tree_data->measurement);
+    // Release measurement
+    prof_measurement_release(&call_tree_data->measurement);
+
+    if (call_tree_data->waits)
+    {
+        rb_st_foreach(call_tree_data->waits, prof_call_tree_free_wait, 0);
+        rb_st_free_table(call_tree_data->waits);
+    }
 
     // Finally free self
     xfree(call_tree_data);
@@ -183,17 +264,32 @@ prof_call_tree_t* call_tree_table_lookup(st_table* table, st_data_t key)
     }
 }
 
+/* Returns the depth of the call tree. Depths are cached on each call tree and kept up to date as
+   call trees are attached to new parents, so this is usually a field read. */
 uint32_t prof_call_figure_depth(prof_call_tree_t* call_tree_data)
 {
-    uint32_t result = 0;
+    if (call_tree_data->depth == PROF_CALL_TREE_DEPTH_UNKNOWN)
+        call_tree_data->depth = call_tree_data->parent ? prof_call_figure_depth(call_tree_data->parent) + 1 : 0;
 
-    while (call_tree_data->parent)
-    {
-        result++;
-        call_tree_data = call_tree_data->parent;
-    }
+    return call_tree_data->depth;
+}
 
-    return result;
+static void prof_call_tree_set_depth(prof_call_tree_t* call_tree_data, unsigned int depth);
+
+static int prof_call_tree_set_depth_children(st_data_t key, st_data_t value, st_data_t data)
+{
+    prof_call_tree_set_depth((prof_call_tree_t*)value, (unsigned int)data + 1);
+    return ST_CONTINUE;
+}
+
+static void prof_call_tree_set_depth(prof_call_tree_t* call_tree_data, unsigned int depth)
+{
+    // If the depth is unchanged then so are the depths of the children
+    if (call_tree_data->depth == depth)
+        return;
+
+    call_tree_data->depth = depth;
+    rb_st_foreach(call_tree_data->children, prof_call_tree_set_depth_children, (st_data_t)depth);
 }
 
 void prof_call_tree_add_parent(prof_call_tree_t* self, prof_call_tree_t* parent)
@@ -205,6 +301,10 @@ void prof_call_tree_add_parent(prof_call_tree_t* self, prof_call_tree_t* parent)
 void prof_call_tree_add_child(prof_call_tree_t* self, prof_call_tree_t* child)
 {
     call_tree_table_insert(self->children, child->method->key, child);
+    prof_call_tree_set_depth(child, prof_call_figure_depth(self) + 1);
+    // The trees may belong to different profiles, for example when built from Ruby
+    prof_call_tree_invalidate(self);
+    prof_call_tree_invalidate(child);
 }
 
 /* =======  RubyProf::CallTree   ========*/
@@ -258,6 +358,8 @@ static VALUE prof_call_tree_add_child_ruby(VALUE self, VALUE child)
 {
   prof_call_tree_t* parent_ptr = prof_get_call_tree(self);
   prof_call_tree_t* child_ptr = prof_get_call_tree(child);
+  prof_call_tree_check_post_processed(parent_ptr);
+  prof_call_tree_check_post_processed(child_ptr);
 
   prof_call_tree_t* existing_ptr = call_tree_table_lookup(parent_ptr->children, child_ptr->method->key);
   if (existing_ptr)
@@ -287,7 +389,35 @@ Returns the measurement associated with this call_tree. */
 static VALUE prof_call_tree_measurement(VALUE self)
 {
     prof_call_tree_t* call_tree = prof_get_call_tree(self);
-    return prof_measurement_wrap(call_tree->measurement);
+    return prof_measurement_wrap_owned(&call_tree->measurement, call_tree->method ? call_tree->method->profile : Qnil);
+}
+
+static int prof_call_tree_collect_waits(st_data_t key, st_data_t value, st_data_t data)
+{
+    void** args = (void**)data;
+    VALUE result = (VALUE)args[0];
+    prof_call_tree_t* call_tree = (prof_call_tree_t*)args[1];
+    VALUE measurement = prof_measurement_wrap_owned((prof_measurement_t*)value, call_tree->method ? call_tree->method->profile : Qnil);
+    rb_hash_aset(result, ID2SYM((ID)key), measurement);
+    return ST_CONTINUE;
+}
+
+/* call-seq:
+   waits -> hash
+
+Returns a hash of the times this method blocked in a fiber scheduler. The keys are the
+scheduler hooks that were called (:io_wait, :kernel_sleep or :block) and the values are
+Measurement objects, where +called+ is the number of waits and +wait_time+ is the time spent waiting. */
+static VALUE prof_call_tree_waits(VALUE self)
+{
+    prof_call_tree_t* call_tree = prof_get_call_tree(self);
+    VALUE result = rb_hash_new();
+    if (call_tree->waits)
+    {
+        void* args[] = {(void*)result, call_tree};
+        rb_st_foreach(call_tree->waits, prof_call_tree_collect_waits, (st_data_t)args);
+    }
+    return result;
 }
 
 /* call-seq:
@@ -322,6 +452,167 @@ static VALUE prof_call_tree_line(VALUE self)
     return INT2FIX(result->source_line);
 }
 
+/* =======  Call tree walking   ========*/
+typedef struct prof_call_tree_walk_frame_t
+{
+    prof_call_tree_t* call_tree;
+    unsigned int depth;
+    size_t first_child; /* Index in the walk's children of this call tree's first child */
+    size_t next_child;  /* Index of the next child to visit */
+    size_t end_child;   /* Index one past the last child of this call tree */
+} prof_call_tree_walk_frame_t;
+
+/* Walks a call tree with an explicit stack so deep trees do not overflow the C or Ruby stack. The children
+   of every call tree on the stack are kept in a single array, which shrinks again as call trees are exited. */
+typedef struct prof_call_tree_walk_t
+{
+    prof_call_tree_t* root;
+    double threshold;
+    unsigned int max_depth;
+    bool events;
+
+    prof_call_tree_walk_frame_t* frames;
+    size_t frames_count;
+    size_t frames_capacity;
+
+    prof_call_tree_t** children;
+    size_t children_count;
+    size_t children_capacity;
+} prof_call_tree_walk_t;
+
+static int prof_call_tree_walk_collect_children(st_data_t key, st_data_t value, st_data_t data)
+{
+    prof_call_tree_walk_t* walk = (prof_call_tree_walk_t*)data;
+    prof_call_tree_t* call_tree = (prof_call_tree_t*)value;
+
+    // Skip cold subtrees without ever wrapping them
+    if (call_tree->measurement.total_time < walk->threshold)
+        return ST_CONTINUE;
+
+    if (walk->children_count == walk->children_capacity)
+    {
+        walk->children_capacity *= 2;
+        REALLOC_N(walk->children, prof_call_tree_t*, walk->children_capacity);
+    }
+    walk->children[walk->children_count++] = call_tree;
+    return ST_CONTINUE;
+}
+
+static void prof_call_tree_walk_enter(prof_call_tree_walk_t* walk, prof_call_tree_t* call_tree, unsigned int depth)
+{
+    if (walk->events)
+        rb_yield_values(2, prof_call_tree_wrap(call_tree), ID2SYM(rb_intern("enter")));
+    else
+        rb_yield(prof_call_tree_wrap(call_tree));
+
+    if (walk->frames_count == walk->frames_capacity)
+    {
+        walk->frames_capacity *= 2;
+        REALLOC_N(walk->frames, prof_call_tree_walk_frame_t, walk->frames_capacity);
+    }
+
+    prof_call_tree_walk_frame_t* frame = &walk->frames[walk->frames_count++];
+    frame->call_tree = call_tree;
+    frame->depth = depth;
+    frame->first_child = walk->children_count;
+    frame->next_child = walk->children_count;
+
+    if (depth < walk->max_depth)
+        rb_st_foreach(call_tree->children, prof_call_tree_walk_collect_children, (st_data_t)walk);
+
+    frame->end_child = walk->children_count;
+}
+
+static VALUE prof_call_tree_walk_run(VALUE data)
+{
+    prof_call_tree_walk_t* walk = (prof_call_tree_walk_t*)data;
+    prof_call_tree_walk_enter(walk, walk->root, 0);
+
+    while (walk->frames_count > 0)
+    {
+        prof_call_tree_walk_frame_t* frame = &walk->frames[walk->frames_count - 1];
+        if (frame->next_child < frame->end_child)
+        {
+            prof_call_tree_t* child = walk->children[frame->next_child++];
+            prof_call_tree_walk_enter(walk, child, frame->depth + 1);
+        }
+        else
+        {
+            walk->frames_count--;
+            walk->children_count = frame->first_child;
+            if (walk->events)
+                rb_yield_values(2, prof_call_tree_wrap(frame->call_tree), ID2SYM(rb_intern("exit")));
+        }
+    }
+    return Qnil;
+}
+
+static VALUE prof_call_tree_walk_free(VALUE data)
+{
+    prof_call_tree_walk_t* walk = (prof_call_tree_walk_t*)data;
+    xfree(walk->frames);
+    xfree(walk->children);
+    return Qnil;
+}
+
+static VALUE prof_call_tree_walk_internal(int argc, VALUE* argv, VALUE self, bool events)
+{
+    VALUE options = Qnil;
+    rb_scan_args(argc, argv, "01", &options);
+
+    prof_call_tree_walk_t walk;
+    walk.root = prof_get_call_tree(self);
+    walk.threshold = 0;
+    walk.max_depth = UINT_MAX;
+    walk.events = events;
+
+    if (options != Qnil)
+    {
+        Check_Type(options, T_HASH);
+        VALUE threshold = rb_hash_aref(options, ID2SYM(rb_intern("threshold")));
+        VALUE max_depth = rb_hash_aref(options, ID2SYM(rb_intern("max_depth")));
+        if (threshold != Qnil)
+            walk.threshold = NUM2DBL(threshold);
+        if (max_depth != Qnil)
+            walk.max_depth = NUM2UINT(max_depth);
+    }
+
+    walk.frames_count = 0;
+    walk.frames_capacity = 64;
+    walk.frames = ALLOC_N(prof_call_tree_walk_frame_t, walk.frames_capacity);
+    walk.children_count = 0;
+    walk.children_capacity = 256;
+    walk.children = ALLOC_N(prof_call_tree_t*, walk.children_capacity);
+
+    rb_ensure(prof_call_tree_walk_run, (VALUE)&walk, prof_call_tree_walk_free, (VALUE)&walk);
+    return self;
+}
+
+/* call-seq:
+   walk(options = {}) {|call_tree, event| ...} -> call_tree
+
+Walks this call tree and its descendants depth first. The block is called twice for each
+call tree, once with the event :enter before its children are visited and once with the
+event :exit afterwards. Options are:
+
+  :threshold - Call trees whose total time is less than this value are skipped, along with their children.
+  :max_depth - Call trees deeper than this, relative to this call tree, are skipped. */
+static VALUE prof_call_tree_walk(int argc, VALUE* argv, VALUE self)
+{
+    RETURN_ENUMERATOR(self, argc, argv);
+    return prof_call_tree_walk_internal(argc, argv, self, true);
+}
+
+/* call-seq:
+   each_preorder(options = {}) {|call_tree| ...} -> call_tree
+
+Yields this call tree and then its descendants depth first. Supports the same options as #walk. */
+static VALUE prof_call_tree_each_preorder(int argc, VALUE* argv, VALUE self)
+{
+    RETURN_ENUMERATOR(self, argc, argv);
+    return prof_call_tree_walk_internal(argc, argv, self, false);
+}
+
 static int prof_call_tree_merge_children(st_data_t key, st_data_t value, st_data_t data)
 {
   prof_call_tree_t* other_child = (prof_call_tree_t*)value;
@@ -359,16 +650,57 @@ void prof_call_tree_merge_internal(prof_call_tree_t* self, prof_call_tree_t* oth
     return;
   }
 
-  prof_measurement_merge_internal(self->measurement, other->measurement);
-  prof_measurement_merge_internal(self->method->measurement, other->method->measurement);
+  prof_measurement_merge_internal(&self->measurement, &other->measurement);
+  prof_measurement_merge_internal(&self->method->measurement, &other->method->measurement);
+  prof_call_tree_merge_waits(self, other);
+  prof_call_tree_invalidate(self);
 
   rb_st_foreach(other->children, prof_call_tree_merge_children, (st_data_t)self);
 }
 
+static int prof_call_tree_merge_thread_children(st_data_t key, st_data_t value, st_data_t data)
+{
+    prof_call_tree_t* other_child = (prof_call_tree_t*)value;
+    void** args = (void**)data;
+    prof_call_tree_merge_child((prof_call_tree_t*)args[0], other_child, (st_table*)args[1]);
+    return ST_CONTINUE;
+}
+
+/* Merges other, and its children, into self. Unlike prof_call_tree_merge_internal, other may come
+   from a different thread - its methods are looked up in method_table so that the merged call trees
+   reference the methods of the thread that self belongs to. */
+void prof_call_tree_merge_thread(prof_call_tree_t* self, prof_call_tree_t* other, st_table* method_table)
+{
+    prof_measurement_merge_internal(&self->measurement, &other->measurement);
+    prof_call_tree_merge_waits(self, other);
+    prof_call_tree_invalidate(self);
+
+    void* args[] = { self, method_table };
+    rb_st_foreach(other->children, prof_call_tree_merge_thread_children, (st_data_t)args);
+}
+
+/* Merges other, and its children, into the children of parent. See prof_call_tree_merge_thread. */
+void prof_call_tree_merge_child(prof_call_tree_t* parent, prof_call_tree_t* other, st_table* method_table)
+{
+    prof_method_t* method = method_table_lookup(method_table, other->method->key);
+    prof_call_tree_t* self = call_tree_table_lookup(parent->children, method->key);
+
+    if (!self)
+    {
+        self = prof_call_tree_create(method, parent, other->source_file, other->source_line);
+        prof_add_call_tree(method->call_trees, self);
+        prof_call_tree_add_child(parent, self);
+    }
+
+    prof_call_tree_merge_thread(self, other, method_table);
+}
+
 VALUE prof_call_tree_merge(VALUE self, VALUE other)
 {
   prof_call_tree_t* source = prof_get_call_tree(self);
   prof_call_tree_t* destination = prof_get_call_tree(other);
+  prof_call_tree_check_post_processed(source);
+  prof_call_tree_check_post_processed(destination);
   prof_call_tree_merge_internal(source, destination);
   return other;
 }
@@ -379,7 +711,8 @@ static VALUE prof_call_tree_dump(VALUE self)
     prof_call_tree_t* call_tree_data = prof_get_call_tree(self);
     VALUE result = rb_hash_new();
 
-    rb_hash_aset(result, ID2SYM(rb_intern("measurement")), prof_measurement_wrap(call_tree_data->measurement));
+    rb_hash_aset(result, ID2SYM(rb_intern("measurement")), prof_measurement_wrap(&call_tree_data->measurement));
+    rb_hash_aset(result, ID2SYM(rb_intern("waits")), prof_call_tree_waits(self));
 
     rb_hash_aset(result, ID2SYM(rb_intern("source_file")), call_tree_data->source_file);
     rb_hash_aset(result, ID2SYM(rb_intern("source_line")), INT2FIX(call_tree_data->source_line));
@@ -400,11 +733,26 @@ static VALUE prof_call_tree_load(VALUE self, VALUE data)
     call_tree->object = self;
 
     VALUE measurement = rb_hash_aref(data, ID2SYM(rb_intern("measurement")));
-    call_tree->measurement = prof_get_measurement(measurement);
+    prof_measurement_merge_internal(&call_tree->measurement, prof_get_measurement(measurement));
+
+    VALUE waits = rb_hash_aref(data, ID2SYM(rb_intern("waits")));
+    if (waits != Qnil)
+    {
+        VALUE reasons = rb_funcall(waits, rb_intern("keys"), 0);
+        for (int i = 0; i < rb_array_len(reasons); i++)
+        {
+            VALUE reason = rb_ary_entry(reasons, i);
+            prof_measurement_t* wait = prof_get_measurement(rb_hash_aref(waits, reason));
+            prof_measurement_merge_internal(prof_call_tree_wait(call_tree, SYM2ID(reason)), wait);
+        }
+    }
 
     call_tree->source_file = rb_hash_aref(data, ID2SYM(rb_intern("source_file")));
     call_tree->source_line = FIX2INT(rb_hash_aref(data, ID2SYM(rb_intern("source_line"))));
 
+    // The parent may not have been loaded yet so the depth is worked out when first needed
+    call_tree->depth = PROF_CALL_TREE_DEPTH_UNKNOWN;
+
     parent = rb_hash_aref(data, ID2SYM(rb_intern("parent")));
     if (parent != Qnil)
         call_tree->parent = prof_get_call_tree(parent);
@@ -437,7 +785,10 @@ void rp_init_call_tree()
     rb_define_method(cRpCallTree, "parent", prof_call_tree_parent, 0);
     rb_define_method(cRpCallTree, "children", prof_call_tree_children, 0);
     rb_define_method(cRpCallTree, "add_child", prof_call_tree_add_child_ruby, 1);
+    rb_define_method(cRpCallTree, "walk", prof_call_tree_walk, -1);
+    rb_define_method(cRpCallTree, "each_preorder", prof_call_tree_each_preorder, -1);
 
+    rb_define_method(cRpCallTree, "waits", prof_call_tree_waits, 0);
     rb_define_method(cRpCallTree, "depth", prof_call_tree_depth, 0);
     rb_define_method(cRpCallTree, "source_file", prof_call_tree_source_file, 0);
     rb_define_method(cRpCallTree, "line", prof_call_tree_line, 0);
@@ -10,16 +10,21 @@
 
 extern VALUE cRpCallTree;
 
+/* Depth of call trees whose parents are not known yet, for example while being loaded */
+#define PROF_CALL_TREE_DEPTH_UNKNOWN UINT_MAX
+
 /* Callers and callee information for a method. */
 typedef struct prof_call_tree_t
 {
     prof_method_t* method;
     struct prof_call_tree_t* parent;
     st_table* children;             /* Call infos that this call info calls */
-    prof_measurement_t* measurement;
+    prof_measurement_t measurement;   /* Stored inline to avoid a separate allocation per call tree */
+    st_table* waits;                /* Fiber scheduler waits by reason, created on first wait */
     VALUE object;
 
     int visits;                             /* Current visits on the stack */
+    unsigned int depth;                     /* Distance from the root, see prof_call_figure_depth */
 
     unsigned int source_line;
     VALUE source_file;
@@ -28,13 +33,19 @@ typedef struct prof_call_tree_t
 prof_call_tree_t* prof_call_tree_create(prof_method_t* method, prof_call_tree_t* parent, VALUE source_file, int source_line);
 prof_call_tree_t* prof_call_tree_copy(prof_call_tree_t* other);
 void prof_call_tree_merge_internal(prof_call_tree_t* destination, prof_call_tree_t* other);
+void prof_call_tree_merge_thread(prof_call_tree_t* self, prof_call_tree_t* other, st_table* method_table);
+void prof_call_tree_merge_child(prof_call_tree_t* parent, prof_call_tree_t* other, st_table* method_table);
 void prof_call_tree_mark(void* data);
 prof_call_tree_t* call_tree_table_lookup(st_table* table, st_data_t key);
 
 void prof_call_tree_add_parent(prof_call_tree_t* self, prof_call_tree_t* parent);
 void prof_call_tree_add_child(prof_call_tree_t* self, prof_call_tree_t* child);
+void prof_call_tree_add_wait(prof_call_tree_t* self, ID reason, double wait_time);
 
 uint32_t prof_call_figure_depth(prof_call_tree_t* call_tree_data);
+unsigned int prof_call_tree_version(prof_call_tree_t* call_tree);
+void prof_call_tree_invalidate(prof_call_tree_t* call_tree);
+void prof_call_tree_check_post_processed(prof_call_tree_t* call_tree);
 prof_call_tree_t* prof_get_call_tree(VALUE self);
 VALUE prof_call_tree_wrap(prof_call_tree_t* call_tree);
 void prof_call_tree_free(prof_call_tree_t* call_tree);
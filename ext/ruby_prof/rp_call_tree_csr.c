@@ -0,0 +1,222 @@
+/* Copyright (C) 2005-2019 Shugo Maeda <shugo@ruby-lang.org> and Charlie Savage <cfis@savagexi.com>
+   Please see the LICENSE file for copyright and distribution information */
+
+#include "rp_call_tree_csr.h"
+#include "rp_call_trees.h"
+
+/* A csr is built when profiling stops without holding the GVL, so building one only reads the
+   call trees and writes plain C memory. Its arrays are allocated with malloc instead of the Ruby
+   allocator, which may start a garbage collection, and the trees are walked with an explicit stack
+   so deep trees cannot overflow the small stacks of worker threads. */
+
+prof_call_tree_csr_t* prof_call_tree_csr_create(void)
+{
+    prof_call_tree_csr_t* result = ALLOC(prof_call_tree_csr_t);
+    result->count = 0;
+    result->nodes = NULL;
+    result->subtree_end = NULL;
+    result->version = 0;
+    return result;
+}
+
+void prof_call_tree_csr_free(prof_call_tree_csr_t* csr)
+{
+    free(csr->nodes);
+    free(csr->subtree_end);
+    xfree(csr);
+}
+
+/* Call trees waiting to be visited, with the index of their parent in the csr */
+typedef struct csr_stack_t
+{
+    prof_call_tree_t** call_trees;
+    size_t* parents;
+    size_t size;
+    size_t capacity;
+    bool failed;
+} csr_stack_t;
+
+static bool csr_stack_push(csr_stack_t* stack, prof_call_tree_t* call_tree, size_t parent)
+{
+    if (stack->size == stack->capacity)
+    {
+        size_t capacity = stack->capacity ? stack->capacity * 2 : 64;
+        prof_call_tree_t** call_trees = realloc(stack->call_trees, capacity * sizeof(prof_call_tree_t*));
+        if (call_trees)
+            stack->call_trees = call_trees;
+        size_t* parents = realloc(stack->parents, capacity * sizeof(size_t));
+        if (parents)
+            stack->parents = parents;
+        if (!call_trees || !parents)
+            return false;
+        stack->capacity = capacity;
+    }
+
+    stack->call_trees[stack->size] = call_tree;
+    stack->parents[stack->size] = parent;
+    stack->size++;
+    return true;
+}
+
+typedef struct csr_push_children_t
+{
+    csr_stack_t* stack;
+    size_t parent;
+} csr_push_children_t;
+
+static int csr_push_children(st_data_t key, st_data_t value, st_data_t data)
+{
+    csr_push_children_t* push = (csr_push_children_t*)data;
+    if (!csr_stack_push(push->stack, (prof_call_tree_t*)value, push->parent))
+    {
+        push->stack->failed = true;
+        return ST_STOP;
+    }
+    return ST_CONTINUE;
+}
+
+static bool csr_reserve(prof_call_tree_csr_t* csr, size_t* capacity, size_t count)
+{
+    if (count <= *capacity)
+        return true;
+
+    size_t new_capacity = *capacity ? *capacity * 2 : 64;
+    prof_call_tree_t** nodes = realloc(csr->nodes, new_capacity * sizeof(prof_call_tree_t*));
+    if (nodes)
+        csr->nodes = nodes;
+    size_t* subtree_end = realloc(csr->subtree_end, new_capacity * sizeof(size_t));
+    if (subtree_end)
+        csr->subtree_end = subtree_end;
+    if (!nodes || !subtree_end)
+        return false;
+
+    *capacity = new_capacity;
+    return true;
+}
+
+/* Records the minimum depth of each method in the csr for version. The depth of a node is the
+   number of enclosing subtrees, which a single scan finds by keeping the ends of the open ones. */
+static bool csr_update_min_depths(prof_call_tree_csr_t* csr, unsigned int version)
+{
+    size_t* open = malloc((csr->count > 0 ? csr->count : 1) * sizeof(size_t));
+    if (!open)
+        return false;
+
+    size_t depth = 0;
+    for (size_t i = 0; i < csr->count; i++)
+    {
+        while (depth > 0 && open[depth - 1] <= i)
+            depth--;
+
+        prof_call_trees_t* call_trees = csr->nodes[i]->method->call_trees;
+        if (call_trees->min_depth_version != version || depth < call_trees->min_depth)
+        {
+            call_trees->min_depth = (unsigned int)depth;
+            call_trees->min_depth_version = version;
+        }
+
+        open[depth++] = csr->subtree_end[i];
+    }
+
+    free(open);
+    return true;
+}
+
+/* Flattens the call tree under root, which may be NULL, and updates the minimum depths of its
+   methods. Does not need the GVL. Returns false if memory ran out, the caller should then raise
+   NoMemoryError once it holds the GVL. */
+bool prof_call_tree_csr_build(prof_call_tree_csr_t* csr, prof_call_tree_t* root, unsigned int version)
+{
+    size_t capacity = 0;
+    csr_stack_t stack = { NULL, NULL, 0, 0, false };
+
+    free(csr->nodes);
+    free(csr->subtree_end);
+    csr->nodes = NULL;
+    csr->subtree_end = NULL;
+    csr->count = 0;
+    csr->version = 0;
+
+    if (root && !csr_stack_push(&stack, root, 0))
+        stack.failed = true;
+
+    /* Visiting the most recently pushed call tree first lays out each subtree contiguously. Children
+       are pushed in reverse so they are visited in the order they were called in. */
+    while (stack.size > 0 && !stack.failed)
+    {
+        stack.size--;
+        prof_call_tree_t* call_tree = stack.call_trees[stack.size];
+        size_t parent = stack.parents[stack.size];
+
+        if (!csr_reserve(csr, &capacity, csr->count + 1))
+        {
+            stack.failed = true;
+            break;
+        }
+
+        size_t index = csr->count++;
+        csr->nodes[index] = call_tree;
+        // Parent index for now, replaced by the end of the subtree below
+        csr->subtree_end[index] = parent;
+
+        size_t first_child = stack.size;
+        csr_push_children_t push = { &stack, index };
+        rb_st_foreach(call_tree->children, csr_push_children, (st_data_t)&push);
+
+        for (size_t i = first_child, j = stack.size; !stack.failed && j > i + 1; i++, j--)
+        {
+            prof_call_tree_t* child = stack.call_trees[i];
+            stack.call_trees[i] = stack.call_trees[j - 1];
+            stack.call_trees[j - 1] = child;
+        }
+    }
+
+    free(stack.call_trees);
+    free(stack.parents);
+
+    if (stack.failed)
+    {
+        csr->count = 0;
+        return false;
+    }
+
+    /* Children come after their parent, so a backwards scan sees every descendant of a node before
+       the node itself and can extend the parent's subtree to cover the node's. */
+    size_t* parents = malloc((csr->count > 0 ? csr->count : 1) * sizeof(size_t));
+    if (!parents)
+    {
+        csr->count = 0;
+        return false;
+    }
+    memcpy(parents, csr->subtree_end, csr->count * sizeof(size_t));
+
+    for (size_t i = 0; i < csr->count; i++)
+        csr->subtree_end[i] = i + 1;
+
+    for (size_t i = csr->count; i > 1; i--)
+    {
+        size_t parent = parents[i - 1];
+        if (csr->subtree_end[i - 1] > csr->subtree_end[parent])
+            csr->subtree_end[parent] = csr->subtree_end[i - 1];
+    }
+    free(parents);
+
+    if (!csr_update_min_depths(csr, version))
+    {
+        csr->count = 0;
+        return false;
+    }
+
+    csr->version = version;
+    return true;
+}
+
+/* Returns whether the csr still matches the shape of the call tree under root. Call trees without a
+   profile, version 0, are always rebuilt. */
+bool prof_call_tree_csr_is_current(prof_call_tree_csr_t* csr, prof_call_tree_t* root, unsigned int version)
+{
+    if (!root)
+        return csr->count == 0;
+
+    return version != 0 && csr->count > 0 && csr->nodes[0] == root && csr->version == version;
+}
@@ -0,0 +1,31 @@
+/* Copyright (C) 2005-2019 Shugo Maeda <shugo@ruby-lang.org> and Charlie Savage <cfis@savagexi.com>
+   Please see the LICENSE file for copyright and distribution information */
+
+#ifndef __RP_CALL_TREE_CSR_H__
+#define __RP_CALL_TREE_CSR_H__
+
+#include "ruby_prof.h"
+#include "rp_call_tree.h"
+
+/* A read only, flattened copy of the shape of a call tree. Nodes are stored in preorder, so the
+   children of node i start at i + 1 and each following sibling starts at the subtree_end of the
+   previous one. Walking it is a linear scan instead of a series of hash table iterations.
+
+   Method keys and measurements are read through nodes instead of being copied into arrays of
+   their own. Measurements are stored inline in the call trees, so the node is already the one
+   place to load them from, and copies would double their memory and go stale when a
+   Measurement is changed from Ruby. */
+typedef struct prof_call_tree_csr_t
+{
+    size_t count;
+    prof_call_tree_t** nodes;       /* Call trees in preorder, the root is first */
+    size_t* subtree_end;            /* Index one past the last descendant of each node */
+    unsigned int version;           /* Call tree version this was built at, see prof_call_tree_version */
+} prof_call_tree_csr_t;
+
+prof_call_tree_csr_t* prof_call_tree_csr_create(void);
+void prof_call_tree_csr_free(prof_call_tree_csr_t* csr);
+bool prof_call_tree_csr_build(prof_call_tree_csr_t* csr, prof_call_tree_t* root, unsigned int version);
+bool prof_call_tree_csr_is_current(prof_call_tree_csr_t* csr, prof_call_tree_t* root, unsigned int version);
+
+#endif //__RP_CALL_TREE_CSR_H__
@@ -28,10 +28,38 @@ prof_call_trees_t* prof_call_trees_create()
     result->start = ALLOC_N(prof_call_tree_t*, INITIAL_CALL_TREES_SIZE);
     result->end = result->start + INITIAL_CALL_TREES_SIZE;
     result->ptr = result->start;
+    result->min_depth = INT_MAX;
+    result->min_depth_version = 0;
+    result->callers = NULL;
+    result->callers_count = 0;
+    result->callees = NULL;
+    result->callees_count = 0;
+    result->aggregates_version = 0;
     result->object = Qnil;
     return result;
 }
 
+static void prof_call_trees_mark_aggregates(prof_call_tree_t** aggregates, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (aggregates[i]->object != Qnil)
+            rb_gc_mark(aggregates[i]->object);
+        prof_measurement_mark(&aggregates[i]->measurement);
+    }
+}
+
+/* Marks the Ruby objects that wrap this object and its cached aggregates. Called by the owning
+   method so that cached aggregates are not freed by the garbage collector while they are cached. */
+void prof_call_trees_mark_cached(prof_call_trees_t* call_trees)
+{
+    if (call_trees->object != Qnil)
+        rb_gc_mark(call_trees->object);
+
+    prof_call_trees_mark_aggregates(call_trees->callers, call_trees->callers_count);
+    prof_call_trees_mark_aggregates(call_trees->callees, call_trees->callees_count);
+}
+
 void prof_call_trees_mark(void* data)
 {
     if (!data) return;
@@ -44,6 +72,19 @@ void prof_call_trees_mark(void* data)
     }
 }
 
+/* Forgets the cached aggregates. They belong to their Ruby objects, which the garbage collector
+   frees once nothing else refers to them. */
+static void prof_call_trees_free_aggregates(prof_call_trees_t* call_trees)
+{
+    xfree(call_trees->callers);
+    call_trees->callers = NULL;
+    call_trees->callers_count = 0;
+
+    xfree(call_trees->callees);
+    call_trees->callees = NULL;
+    call_trees->callees_count = 0;
+}
+
 void prof_call_trees_free(prof_call_trees_t* call_trees)
 {
     /* Has this method object been accessed by Ruby?  If
@@ -54,6 +95,8 @@ void prof_call_trees_free(prof_call_trees_t* call_trees)
         call_trees->object = Qnil;
     }
 
+    prof_call_trees_free_aggregates(call_trees);
+
     // Note we do not free our call_tree structures - since they have no parents they will free themselves
     xfree(call_trees);
 }
@@ -70,11 +113,9 @@ void prof_call_trees_ruby_gc_free(void* data)
 
 static int prof_call_trees_collect_aggregates(st_data_t key, st_data_t value, st_data_t data)
 {
-    VALUE result = (VALUE)data;
-    prof_call_tree_t* call_tree_data = (prof_call_tree_t*)value;
-    VALUE aggregate_call_tree = prof_aggregate_call_tree_wrap(call_tree_data);
-    rb_ary_push(result, aggregate_call_tree);
-
+    prof_call_tree_t*** aggregates = (prof_call_tree_t***)data;
+    **aggregates = (prof_call_tree_t*)value;
+    (*aggregates)++;
     return ST_CONTINUE;
 }
 
@@ -87,7 +128,7 @@ static int prof_call_trees_collect_callees(st_data_t key, st_data_t value, st_da
 
     if (rb_st_lookup(callers, call_tree_data->method->key, (st_data_t*)&aggregate_call_tree_data))
     {
-      prof_measurement_merge_internal(aggregate_call_tree_data->measurement, call_tree_data->measurement);
+      prof_measurement_merge_internal(&aggregate_call_tree_data->measurement, &call_tree_data->measurement);
     }
     else
     {
@@ -139,6 +180,11 @@ void prof_add_call_tree(prof_call_trees_t* call_trees, prof_call_tree_t* call_tr
     call_trees->ptr++;
 }
 
+void prof_call_trees_clear(prof_call_trees_t* call_trees)
+{
+    call_trees->ptr = call_trees->start;
+}
+
 /* ================  Call Infos   =================*/
 /* Document-class: RubyProf::CallTrees
 The RubyProf::MethodInfo class stores profiling data for a method.
@@ -155,23 +201,45 @@ VALUE prof_call_trees_allocate(VALUE klass)
 }
 
 
+/* Returns the call tree version of the profile these call trees belong to. Cached values are only
+   valid when this is not 0, see prof_profile_call_tree_version. */
+static unsigned int prof_call_trees_version(prof_call_trees_t* call_trees)
+{
+    return call_trees->start < call_trees->ptr ? prof_call_tree_version(*call_trees->start) : 0;
+}
+
+static void prof_call_trees_check_post_processed(prof_call_trees_t* call_trees)
+{
+    if (call_trees->start < call_trees->ptr)
+        prof_call_tree_check_post_processed(*call_trees->start);
+}
+
 /* call-seq:
    min_depth -> Integer
 
 Returns the minimum depth of this method in any call tree */
 VALUE prof_call_trees_min_depth(VALUE self)
 {
-    unsigned int depth = INT_MAX;
-
     prof_call_trees_t* call_trees = prof_get_call_trees(self);
-    for (prof_call_tree_t** p_call_tree = call_trees->start; p_call_tree < call_trees->ptr; p_call_tree++)
+    prof_call_trees_check_post_processed(call_trees);
+
+    // Usually calculated when the profile stops, but call trees can be changed afterwards
+    unsigned int version = prof_call_trees_version(call_trees);
+    if (version == 0 || call_trees->min_depth_version != version)
     {
-        unsigned int call_tree_depth = prof_call_figure_depth(*p_call_tree);
-        if (call_tree_depth < depth)
-            depth = call_tree_depth;
+        unsigned int depth = INT_MAX;
+        for (prof_call_tree_t** p_call_tree = call_trees->start; p_call_tree < call_trees->ptr; p_call_tree++)
+        {
+            unsigned int call_tree_depth = prof_call_figure_depth(*p_call_tree);
+            if (call_tree_depth < depth)
+                depth = call_tree_depth;
+        }
+
+        call_trees->min_depth = depth;
+        call_trees->min_depth_version = version;
     }
 
-    return UINT2NUM(depth);
+    return UINT2NUM(call_trees->min_depth);
 }
 
 /* call-seq:
@@ -191,15 +259,27 @@ VALUE prof_call_trees_call_trees(VALUE self)
     return result;
 }
 
-/* call-seq:
-   callers -> array
+static prof_call_tree_t** prof_call_trees_aggregates_array(st_table* aggregates)
+{
+    prof_call_tree_t** result = ALLOC_N(prof_call_tree_t*, aggregates->num_entries);
+    prof_call_tree_t** end = result;
+    rb_st_foreach(aggregates, prof_call_trees_collect_aggregates, (st_data_t)&end);
+    return result;
+}
 
-Returns an array of aggregated CallTree objects that called this method (ie, parents).*/
-VALUE prof_call_trees_callers(VALUE self)
+/* Aggregates the call trees of this method by the method that called them, and by the methods they
+   called. The results are cached until the call trees change, since printers ask for them repeatedly. */
+void prof_call_trees_build_aggregates(prof_call_trees_t* call_trees)
 {
-    st_table* callers = rb_st_init_numtable();
+    prof_call_trees_check_post_processed(call_trees);
 
-    prof_call_trees_t* call_trees = prof_get_call_trees(self);
+    unsigned int version = prof_call_trees_version(call_trees);
+    if (version != 0 && call_trees->aggregates_version == version)
+        return;
+
+    prof_call_trees_free_aggregates(call_trees);
+
+    st_table* callers = rb_st_init_numtable();
     for (prof_call_tree_t** p_call_tree = call_trees->start; p_call_tree < call_trees->ptr; p_call_tree++)
     {
         prof_call_tree_t* parent = (*p_call_tree)->parent;
@@ -210,7 +290,7 @@ VALUE prof_call_trees_callers(VALUE self)
 
         if (rb_st_lookup(callers, parent->method->key, (st_data_t*)&aggregate_call_tree_data))
         {
-          prof_measurement_merge_internal(aggregate_call_tree_data->measurement, (*p_call_tree)->measurement);
+          prof_measurement_merge_internal(&aggregate_call_tree_data->measurement, &(*p_call_tree)->measurement);
         }
         else
         {
@@ -219,30 +299,58 @@ VALUE prof_call_trees_callers(VALUE self)
         }
     }
 
-    VALUE result = rb_ary_new_capa((long)callers->num_entries);
-    rb_st_foreach(callers, prof_call_trees_collect_aggregates, result);
+    call_trees->callers_count = callers->num_entries;
+    call_trees->callers = prof_call_trees_aggregates_array(callers);
     rb_st_free_table(callers);
+
+    st_table* callees = rb_st_init_numtable();
+    for (prof_call_tree_t** call_tree = call_trees->start; call_tree < call_trees->ptr; call_tree++)
+    {
+        rb_st_foreach((*call_tree)->children, prof_call_trees_collect_callees, (st_data_t)callees);
+    }
+
+    call_trees->callees_count = callees->num_entries;
+    call_trees->callees = prof_call_trees_aggregates_array(callees);
+    rb_st_free_table(callees);
+
+    // Wrap the aggregates so the garbage collector owns them. They are already cached, which
+    // marks the ones wrapped so far if wrapping triggers a collection.
+    for (size_t i = 0; i < call_trees->callers_count; i++)
+        prof_aggregate_call_tree_wrap(call_trees->callers[i]);
+    for (size_t i = 0; i < call_trees->callees_count; i++)
+        prof_aggregate_call_tree_wrap(call_trees->callees[i]);
+
+    call_trees->aggregates_version = version;
+}
+
+static VALUE prof_call_trees_wrap_aggregates(prof_call_tree_t** aggregates, size_t count)
+{
+    VALUE result = rb_ary_new_capa((long)count);
+    for (size_t i = 0; i < count; i++)
+        rb_ary_push(result, prof_aggregate_call_tree_wrap(aggregates[i]));
     return result;
 }
 
+/* call-seq:
+   callers -> array
+
+Returns an array of aggregated CallTree objects that called this method (ie, parents).*/
+VALUE prof_call_trees_callers(VALUE self)
+{
+    prof_call_trees_t* call_trees = prof_get_call_trees(self);
+    prof_call_trees_build_aggregates(call_trees);
+    return prof_call_trees_wrap_aggregates(call_trees->callers, call_trees->callers_count);
+}
+
 /* call-seq:
    callees -> array
 
 Returns an array of aggregated CallTree objects that this method called (ie, children).*/
 VALUE prof_call_trees_callees(VALUE self)
 {
-    st_table* callees = rb_st_init_numtable();
-
     prof_call_trees_t* call_trees = prof_get_call_trees(self);
-    for (prof_call_tree_t** call_tree = call_trees->start; call_tree < call_trees->ptr; call_tree++)
-    {
-        rb_st_foreach((*call_tree)->children, prof_call_trees_collect_callees, (st_data_t)callees);
-    }
-
-    VALUE result = rb_ary_new_capa((long)callees->num_entries);
-    rb_st_foreach(callees, prof_call_trees_collect_aggregates, result);
-    rb_st_free_table(callees);
-    return result;
+    prof_call_trees_build_aggregates(call_trees);
+    return prof_call_trees_wrap_aggregates(call_trees->callees, call_trees->callees_count);
 }
 
 /* :nodoc: */
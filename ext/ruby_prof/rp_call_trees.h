@@ -14,6 +14,16 @@ typedef struct prof_call_trees_t
     prof_call_tree_t** end;
     prof_call_tree_t** ptr;
 
+    unsigned int min_depth;           /* Cached minimum depth of the call trees */
+    unsigned int min_depth_version;   /* Call tree version min_depth was computed at, see prof_call_tree_version */
+
+    /* Aggregated callers and callees, built on first use */
+    prof_call_tree_t** callers;
+    size_t callers_count;
+    prof_call_tree_t** callees;
+    size_t callees_count;
+    unsigned int aggregates_version;
+
     VALUE object;
 } prof_call_trees_t;
 
@@ -21,8 +31,11 @@ typedef struct prof_call_trees_t
 void rp_init_call_trees();
 prof_call_trees_t* prof_call_trees_create();
 void prof_call_trees_free(prof_call_trees_t* call_trees);
+void prof_call_trees_mark_cached(prof_call_trees_t* call_trees);
 prof_call_trees_t* prof_get_call_trees(VALUE self);
 void prof_add_call_tree(prof_call_trees_t* call_trees, prof_call_tree_t* call_tree);
+void prof_call_trees_clear(prof_call_trees_t* call_trees);
+void prof_call_trees_build_aggregates(prof_call_trees_t* call_trees);
 VALUE prof_call_trees_wrap(prof_call_trees_t* call_trees);
 
 #endif //__RP_CALL_TREES_H__
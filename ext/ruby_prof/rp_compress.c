@@ -0,0 +1,354 @@
+/* Copyright (C) 2005-2019 Shugo Maeda <shugo@ruby-lang.org> and Charlie Savage <cfis@savagexi.com>
+   Please see the LICENSE file for copyright and distribution information */
+
+#include "rp_compress.h"
+
+#include <ruby/io.h>
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+#endif
+
+VALUE cRpCompressedWriter;
+
+/* Compressed data is handed to the output in chunks of this size */
+#define COMPRESS_BUFFER_SIZE 65536
+
+typedef enum
+{
+    COMPRESS_GZIP,
+    COMPRESS_ZSTD
+} prof_compress_format_t;
+
+typedef struct prof_compressed_writer_t
+{
+    VALUE output;
+    prof_compress_format_t format;
+    bool initialized;
+    bool finished;
+#ifdef HAVE_ZLIB_H
+    z_stream zstream;
+#endif
+#ifdef HAVE_ZSTD_H
+    ZSTD_CStream* zstd;
+#endif
+    char* buffer;
+} prof_compressed_writer_t;
+
+static void prof_compressed_writer_mark(void* data)
+{
+    prof_compressed_writer_t* writer = (prof_compressed_writer_t*)data;
+    rb_gc_mark(writer->output);
+}
+
+static void prof_compressed_writer_release(prof_compressed_writer_t* writer)
+{
+    if (writer->initialized)
+    {
+        switch (writer->format)
+        {
+            case COMPRESS_GZIP:
+#ifdef HAVE_ZLIB_H
+                deflateEnd(&writer->zstream);
+#endif
+                break;
+            case COMPRESS_ZSTD:
+#ifdef HAVE_ZSTD_H
+                ZSTD_freeCStream(writer->zstd);
+#endif
+                break;
+        }
+        writer->initialized = false;
+    }
+
+    xfree(writer->buffer);
+    writer->buffer = NULL;
+}
+
+static void prof_compressed_writer_free(void* data)
+{
+    prof_compressed_writer_t* writer = (prof_compressed_writer_t*)data;
+    prof_compressed_writer_release(writer);
+    xfree(writer);
+}
+
+static size_t prof_compressed_writer_size(const void* data)
+{
+    return sizeof(prof_compressed_writer_t) + (((prof_compressed_writer_t*)data)->buffer ? COMPRESS_BUFFER_SIZE : 0);
+}
+
+static const rb_data_type_t compressed_writer_type =
+{
+    .wrap_struct_name = "CompressedWriter",
+    .function =
+    {
+        .dmark = prof_compressed_writer_mark,
+        .dfree = prof_compressed_writer_free,
+        .dsize = prof_compressed_writer_size,
+    },
+    .data = NULL,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE prof_compressed_writer_allocate(VALUE klass)
+{
+    prof_compressed_writer_t* writer = ALLOC(prof_compressed_writer_t);
+    MEMZERO(writer, prof_compressed_writer_t, 1);
+    writer->output = Qnil;
+    return TypedData_Wrap_Struct(klass, &compressed_writer_type, writer);
+}
+
+static prof_compressed_writer_t* prof_get_compressed_writer(VALUE self)
+{
+    prof_compressed_writer_t* result = RTYPEDDATA_DATA(self);
+    // Finishing releases the stream, so check it first
+    if (result->finished)
+        rb_raise(rb_eIOError, "compressed stream is finished");
+    if (!result->initialized)
+        rb_raise(rb_eIOError, "compressed stream is not initialized");
+    return result;
+}
+
+/* Hands the compressed bytes in the buffer to the output */
+static void prof_compressed_writer_output(prof_compressed_writer_t* writer, size_t length)
+{
+    if (length > 0)
+        rb_funcall(writer->output, rb_intern("<<"), 1, rb_str_new(writer->buffer, length));
+}
+
+#ifdef HAVE_ZLIB_H
+static void prof_gzip_compress(prof_compressed_writer_t* writer, const char* data, size_t length, int flush)
+{
+    z_stream* zstream = &writer->zstream;
+    zstream->next_in = (Bytef*)data;
+    zstream->avail_in = (uInt)length;
+
+    int status;
+    do
+    {
+        zstream->next_out = (Bytef*)writer->buffer;
+        zstream->avail_out = COMPRESS_BUFFER_SIZE;
+        status = deflate(zstream, flush);
+        if (status == Z_STREAM_ERROR)
+            rb_raise(rb_eIOError, "gzip compression failed");
+        prof_compressed_writer_output(writer, COMPRESS_BUFFER_SIZE - zstream->avail_out);
+    } while (zstream->avail_in > 0 || zstream->avail_out == 0 || (flush == Z_FINISH && status != Z_STREAM_END));
+}
+#endif
+
+#ifdef HAVE_ZSTD_H
+static void prof_zstd_compress(prof_compressed_writer_t* writer, const char* data, size_t length, ZSTD_EndDirective directive)
+{
+    ZSTD_inBuffer input = { data, length, 0 };
+    size_t remaining;
+    do
+    {
+        ZSTD_outBuffer output = { writer->buffer, COMPRESS_BUFFER_SIZE, 0 };
+        remaining = ZSTD_compressStream2(writer->zstd, &output, &input, directive);
+        if (ZSTD_isError(remaining))
+            rb_raise(rb_eIOError, "zstd compression failed: %s", ZSTD_getErrorName(remaining));
+        prof_compressed_writer_output(writer, output.pos);
+    } while (directive == ZSTD_e_end ? remaining > 0 : input.pos < input.size);
+}
+#endif
+
+static void prof_compressed_writer_compress(prof_compressed_writer_t* writer, VALUE string, bool finish)
+{
+    const char* data = string == Qnil ? NULL : RSTRING_PTR(string);
+    size_t length = string == Qnil ? 0 : RSTRING_LEN(string);
+
+    switch (writer->format)
+    {
+        case COMPRESS_GZIP:
+#ifdef HAVE_ZLIB_H
+            prof_gzip_compress(writer, data, length, finish ? Z_FINISH : Z_NO_FLUSH);
+#endif
+            break;
+        case COMPRESS_ZSTD:
+#ifdef HAVE_ZSTD_H
+            prof_zstd_compress(writer, data, length, finish ? ZSTD_e_end : ZSTD_e_continue);
+#endif
+            break;
+    }
+    RB_GC_GUARD(string);
+}
+
+/* call-seq:
+   new(output, format, level = nil) -> compressed_writer
+
+Returns a writer that compresses everything written to it and appends the
+compressed bytes to output with <<, in chunks of at most 64KB. Format is
+:gzip or :zstd, and level is the compression level of that format. gzip
+and zstd are only available when ruby-prof was built with zlib and libzstd. */
+static VALUE prof_compressed_writer_initialize(int argc, VALUE* argv, VALUE self)
+{
+    prof_compressed_writer_t* writer = RTYPEDDATA_DATA(self);
+    VALUE output, format, level;
+    rb_scan_args(argc, argv, "21", &output, &format, &level);
+
+    if (writer->initialized)
+        rb_raise(rb_eRuntimeError, "compressed stream is already initialized");
+
+    writer->output = output;
+    writer->buffer = ALLOC_N(char, COMPRESS_BUFFER_SIZE);
+
+    if (format == ID2SYM(rb_intern("gzip")))
+    {
+#ifdef HAVE_ZLIB_H
+        writer->format = COMPRESS_GZIP;
+        int gzip_level = NIL_P(level) ? Z_DEFAULT_COMPRESSION : NUM2INT(level);
+        // A window of 15 bits plus 16 writes a gzip header and trailer
+        if (deflateInit2(&writer->zstream, gzip_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            rb_raise(rb_eArgError, "Invalid gzip compression level: %d", gzip_level);
+#else
+        rb_raise(rb_eNotImpError, "ruby-prof was built without zlib support");
+#endif
+    }
+    else if (format == ID2SYM(rb_intern("zstd")))
+    {
+#ifdef HAVE_ZSTD_H
+        writer->format = COMPRESS_ZSTD;
+        writer->zstd = ZSTD_createCStream();
+        if (!writer->zstd)
+            rb_raise(rb_eNoMemError, "failed to create zstd stream");
+        if (!NIL_P(level))
+        {
+            int zstd_level = NUM2INT(level);
+            if (ZSTD_isError(ZSTD_CCtx_setParameter(writer->zstd, ZSTD_c_compressionLevel, zstd_level)))
+            {
+                ZSTD_freeCStream(writer->zstd);
+                writer->zstd = NULL;
+                rb_raise(rb_eArgError, "Invalid zstd compression level: %d", zstd_level);
+            }
+        }
+#else
+        rb_raise(rb_eNotImpError, "ruby-prof was built without zstd support");
+#endif
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "Unsupported compression format: %" PRIsVALUE, rb_inspect(format));
+    }
+
+    writer->initialized = true;
+    return self;
+}
+
+/* call-seq:
+   write(*strings) -> integer
+
+Compresses the strings and returns the number of uncompressed bytes written. */
+static VALUE prof_compressed_writer_write(int argc, VALUE* argv, VALUE self)
+{
+    prof_compressed_writer_t* writer = prof_get_compressed_writer(self);
+
+    long result = 0;
+    for (int i = 0; i < argc; i++)
+    {
+        VALUE string = rb_obj_as_string(argv[i]);
+        prof_compressed_writer_compress(writer, string, false);
+        result += RSTRING_LEN(string);
+    }
+    return LONG2NUM(result);
+}
+
+/* call-seq:
+   << string -> compressed_writer
+
+Compresses the string. */
+static VALUE prof_compressed_writer_append(VALUE self, VALUE string)
+{
+    prof_compressed_writer_write(1, &string, self);
+    return self;
+}
+
+/* call-seq:
+   finish -> output
+
+Writes the remaining compressed data and the end of the stream to the output and
+returns it. The output is not closed. Finishing again only returns the output. */
+static VALUE prof_compressed_writer_finish(VALUE self)
+{
+    prof_compressed_writer_t* writer = RTYPEDDATA_DATA(self);
+    if (writer->finished)
+        return writer->output;
+
+    writer = prof_get_compressed_writer(self);
+    writer->finished = true;
+    prof_compressed_writer_compress(writer, Qnil, true);
+    prof_compressed_writer_release(writer);
+    return writer->output;
+}
+
+/* call-seq:
+   finished? -> boolean
+
+Returns whether the end of the stream was written. */
+static VALUE prof_compressed_writer_finished(VALUE self)
+{
+    prof_compressed_writer_t* writer = RTYPEDDATA_DATA(self);
+    return writer->finished ? Qtrue : Qfalse;
+}
+
+static VALUE prof_compressed_writer_puts(int argc, VALUE* argv, VALUE self)
+{
+    return rb_io_puts(argc, argv, self);
+}
+
+static VALUE prof_compressed_writer_print(int argc, VALUE* argv, VALUE self)
+{
+    return rb_io_print(argc, argv, self);
+}
+
+static VALUE prof_compressed_writer_printf(int argc, VALUE* argv, VALUE self)
+{
+    return rb_io_printf(argc, argv, self);
+}
+
+/* call-seq:
+   formats -> array
+
+Returns the compression formats supported by this build. */
+static VALUE prof_compressed_writer_formats(VALUE klass)
+{
+    VALUE result = rb_ary_new();
+#ifdef HAVE_ZLIB_H
+    rb_ary_push(result, ID2SYM(rb_intern("gzip")));
+#endif
+#ifdef HAVE_ZSTD_H
+    rb_ary_push(result, ID2SYM(rb_intern("zstd")));
+#endif
+    return result;
+}
+
+/* Document-class: RubyProf::CompressedWriter
+Compresses reports as they are written, so large reports never have to be
+written uncompressed first. Printers use it when the :compress option is set:
+
+  printer.print(file, :compress => :gzip)
+*/
+void rp_init_compress()
+{
+    cRpCompressedWriter = rb_define_class_under(mProf, "CompressedWriter", rb_cObject);
+    rb_define_alloc_func(cRpCompressedWriter, prof_compressed_writer_allocate);
+    rb_define_singleton_method(cRpCompressedWriter, "formats", prof_compressed_writer_formats, 0);
+
+    /* File name extensions of the compression formats */
+    VALUE extensions = rb_hash_new();
+    rb_hash_aset(extensions, ID2SYM(rb_intern("gzip")), rb_str_freeze(rb_str_new_cstr(".gz")));
+    rb_hash_aset(extensions, ID2SYM(rb_intern("zstd")), rb_str_freeze(rb_str_new_cstr(".zst")));
+    rb_define_const(cRpCompressedWriter, "EXTENSIONS", rb_hash_freeze(extensions));
+
+    rb_define_method(cRpCompressedWriter, "initialize", prof_compressed_writer_initialize, -1);
+    rb_define_method(cRpCompressedWriter, "write", prof_compressed_writer_write, -1);
+    rb_define_method(cRpCompressedWriter, "<<", prof_compressed_writer_append, 1);
+    rb_define_method(cRpCompressedWriter, "puts", prof_compressed_writer_puts, -1);
+    rb_define_method(cRpCompressedWriter, "print", prof_compressed_writer_print, -1);
+    rb_define_method(cRpCompressedWriter, "printf", prof_compressed_writer_printf, -1);
+    rb_define_method(cRpCompressedWriter, "finish", prof_compressed_writer_finish, 0);
+    rb_define_method(cRpCompressedWriter, "finished?", prof_compressed_writer_finished, 0);
+}
@@ -2,6 +2,7 @@
    Please see the LICENSE file for copyright and distribution information */
 
 #include "rp_measurement.h"
+#include "rp_profile.h"
 
 VALUE mMeasure;
 VALUE cRpMeasurement;
@@ -43,14 +44,21 @@ double prof_measure(prof_measurer_t* measurer, rb_trace_arg_t* trace_arg)
 prof_measurement_t* prof_measurement_create(void)
 {
     prof_measurement_t* result = ALLOC(prof_measurement_t);
-    result->total_time = 0;
-    result->self_time = 0;
-    result->wait_time = 0;
-    result->called = 0;
-    result->object = Qnil;
+    prof_measurement_init(result);
     return result;
 }
 
+/* Initializes a measurement that is stored inside another structure, such as a call tree or method */
+void prof_measurement_init(prof_measurement_t* measurement)
+{
+    measurement->total_time = 0;
+    measurement->self_time = 0;
+    measurement->wait_time = 0;
+    measurement->called = 0;
+    measurement->object = Qnil;
+    measurement->profile = Qnil;
+}
+
 /* call-seq:
      new(total_time, self_time, wait_time, called) -> Measurement
 
@@ -87,7 +95,9 @@ static void prof_measurement_ruby_gc_free(void* data)
     }
 }
 
-void prof_measurement_free(prof_measurement_t* measurement)
+/* Detaches a measurement from its Ruby object. Used directly for measurements stored inside
+   another structure, their memory belongs to the owner. */
+void prof_measurement_release(prof_measurement_t* measurement)
 {
     /* Has this measurement object been accessed by Ruby?  If
        yes clean it up so to avoid a segmentation fault. */
@@ -96,7 +106,11 @@ void prof_measurement_free(prof_measurement_t* measurement)
         RTYPEDDATA(measurement->object)->data = NULL;
         measurement->object = Qnil;
     }
+}
 
+void prof_measurement_free(prof_measurement_t* measurement)
+{
+    prof_measurement_release(measurement);
     xfree(measurement);
 }
 
@@ -127,6 +141,14 @@ VALUE prof_measurement_wrap(prof_measurement_t* measurement)
     return measurement->object;
 }
 
+/* Wraps a measurement that belongs to a method or call tree of profile. Changing it from Ruby
+   invalidates the values the profile derived from its call trees. */
+VALUE prof_measurement_wrap_owned(prof_measurement_t* measurement, VALUE profile)
+{
+    measurement->profile = profile;
+    return prof_measurement_wrap(measurement);
+}
+
 static VALUE prof_measurement_allocate(VALUE klass)
 {
     prof_measurement_t* measurement = prof_measurement_create();
@@ -163,7 +185,9 @@ Sets the call count to n. */
 static VALUE prof_measurement_set_total_time(VALUE self, VALUE value)
 {
   prof_measurement_t* result = prof_get_measurement(self);
+  prof_profile_check_post_processed(result->profile);
   result->total_time = NUM2DBL(value);
+  prof_profile_invalidate_call_trees(result->profile);
   return value;
 }
 
@@ -186,7 +210,9 @@ Sets the call count to value. */
 static VALUE prof_measurement_set_self_time(VALUE self, VALUE value)
 {
   prof_measurement_t* result = prof_get_measurement(self);
+  prof_profile_check_post_processed(result->profile);
   result->self_time = NUM2DBL(value);
+  prof_profile_invalidate_call_trees(result->profile);
   return value;
 }
 
@@ -208,7 +234,9 @@ Sets the wait time to value. */
 static VALUE prof_measurement_set_wait_time(VALUE self, VALUE value)
 {
   prof_measurement_t* result = prof_get_measurement(self);
+  prof_profile_check_post_processed(result->profile);
   result->wait_time = NUM2DBL(value);
+  prof_profile_invalidate_call_trees(result->profile);
   return value;
 }
 
@@ -229,7 +257,9 @@ Sets the call count to value. */
 static VALUE prof_measurement_set_called(VALUE self, VALUE value)
 {
   prof_measurement_t* result = prof_get_measurement(self);
+  prof_profile_check_post_processed(result->profile);
   result->called = NUM2INT(value);
+  prof_profile_invalidate_call_trees(result->profile);
   return value;
 }
 
@@ -250,7 +280,9 @@ VALUE prof_measurement_merge(VALUE self, VALUE other)
 {
   prof_measurement_t* self_ptr = prof_get_measurement(self);
   prof_measurement_t* other_ptr = prof_get_measurement(other);
+  prof_profile_check_post_processed(self_ptr->profile);
   prof_measurement_merge_internal(self_ptr, other_ptr);
+  prof_profile_invalidate_call_trees(self_ptr->profile);
   return self;
 }
 
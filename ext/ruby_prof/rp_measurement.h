@@ -34,14 +34,18 @@ typedef struct prof_measurement_t
     double wait_time;
     int called;
     VALUE object;
+    VALUE profile;   /* Not marked, the object is detached before the profile is freed */
 } prof_measurement_t;
 
 prof_measurer_t* prof_measurer_create(prof_measure_mode_t measure, bool track_allocations);
 double prof_measure(prof_measurer_t* measurer, rb_trace_arg_t* trace_arg);
 
 prof_measurement_t* prof_measurement_create(void);
+void prof_measurement_init(prof_measurement_t* measurement);
+void prof_measurement_release(prof_measurement_t* measurement);
 void prof_measurement_free(prof_measurement_t* measurement);
 VALUE prof_measurement_wrap(prof_measurement_t* measurement);
+VALUE prof_measurement_wrap_owned(prof_measurement_t* measurement, VALUE profile);
 prof_measurement_t* prof_get_measurement(VALUE self);
 void prof_measurement_mark(void* data);
 void prof_measurement_merge_internal(prof_measurement_t* destination, prof_measurement_t* other);
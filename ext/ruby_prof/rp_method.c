@@ -20,7 +20,11 @@ VALUE resolve_klass(VALUE klass, unsigned int* klass_flags)
     {
         /* We have come across a singleton object. First
            figure out what it is attached to.*/
+#ifdef HAVE_RB_CLASS_ATTACHED_OBJECT
+        VALUE attached = rb_class_attached_object(klass);
+#else
         VALUE attached = rb_iv_get(klass, "__attached__");
+#endif
 
         /* Is this a singleton class acting as a metaclass? */
         if (BUILTIN_TYPE(attached) == T_CLASS)
@@ -164,7 +168,7 @@ prof_method_t* prof_method_create(VALUE profile, VALUE klass, VALUE msym, VALUE
     result->klass = resolve_klass(klass, &result->klass_flags);
     result->klass_name = Qnil;
     result->method_name = msym;
-    result->measurement = prof_measurement_create();
+    prof_measurement_init(&result->measurement);
 
     result->call_trees = prof_call_trees_create();
     result->allocations_table = allocations_table_create();
@@ -180,6 +184,18 @@ prof_method_t* prof_method_create(VALUE profile, VALUE klass, VALUE msym, VALUE
     return result;
 }
 
+/* Creates a method for profile with the same identity as other, but no measurements or allocations.
+   Used to copy methods between profiles, which is why the already resolved class is not resolved again. */
+prof_method_t* prof_method_copy(VALUE profile, prof_method_t* other)
+{
+    prof_method_t* result = prof_method_create(profile, other->klass, other->method_name, other->source_file, other->source_line);
+    result->key = other->key;
+    result->klass = other->klass;
+    result->klass_flags = other->klass_flags;
+    result->klass_name = other->klass_name;
+    return result;
+}
+
 /* The underlying c structures are freed when the parent profile is freed.
    However, on shutdown the Ruby GC frees objects in any will-nilly order.
    That means the ruby thread object wrapping the c thread struct may
@@ -207,10 +223,37 @@ static void prof_method_free(prof_method_t* method)
 
     allocations_table_free(method->allocations_table);
     prof_call_trees_free(method->call_trees);
-    prof_measurement_free(method->measurement);
+    prof_measurement_release(&method->measurement);
     xfree(method);
 }
 
+static int prof_method_merge_allocations(st_data_t key, st_data_t value, st_data_t data)
+{
+    prof_allocation_t* other_allocation = (prof_allocation_t*)value;
+    prof_method_t* self = (prof_method_t*)data;
+
+    st_data_t self_allocation;
+    if (rb_st_lookup(self->allocations_table, key, &self_allocation))
+    {
+        ((prof_allocation_t*)self_allocation)->count += other_allocation->count;
+        ((prof_allocation_t*)self_allocation)->memory += other_allocation->memory;
+        return ST_CONTINUE;
+    }
+    else
+    {
+        rb_st_insert(self->allocations_table, key, (st_data_t)prof_allocation_copy(other_allocation));
+        return ST_CONTINUE;
+    }
+}
+
+/* Adds the measurement and allocations of other to this method. Other is not changed. */
+void prof_method_merge_internal(prof_method_t* self, prof_method_t* other)
+{
+    prof_measurement_merge_internal(&self->measurement, &other->measurement);
+    self->recursive = self->recursive || other->recursive;
+    rb_st_foreach(other->allocations_table, prof_method_merge_allocations, (st_data_t)self);
+}
+
 size_t prof_method_size(const void* data)
 {
     return sizeof(prof_method_t);
@@ -235,7 +278,10 @@ void prof_method_mark(void* data)
     if (method->klass != Qnil)
         rb_gc_mark(method->klass);
 
-    prof_measurement_mark(method->measurement);
+    prof_measurement_mark(&method->measurement);
+
+    if (method->call_trees)
+        prof_call_trees_mark_cached(method->call_trees);
 
     rb_st_foreach(method->allocations_table, prof_method_mark_allocations, 0);
 }
@@ -372,7 +418,7 @@ Returns the measurement associated with this method. */
 static VALUE prof_method_measurement(VALUE self)
 {
     prof_method_t* method = prof_get_method(self);
-    return prof_measurement_wrap(method->measurement);
+    return prof_measurement_wrap_owned(&method->measurement, method->profile);
 }
 
 /* call-seq:
@@ -470,7 +516,7 @@ static VALUE prof_method_dump(VALUE self)
     rb_hash_aset(result, ID2SYM(rb_intern("source_line")), INT2FIX(method_data->source_line));
 
     rb_hash_aset(result, ID2SYM(rb_intern("call_trees")), prof_call_trees_wrap(method_data->call_trees));
-    rb_hash_aset(result, ID2SYM(rb_intern("measurement")), prof_measurement_wrap(method_data->measurement));
+    rb_hash_aset(result, ID2SYM(rb_intern("measurement")), prof_measurement_wrap(&method_data->measurement));
     rb_hash_aset(result, ID2SYM(rb_intern("allocations")), prof_method_allocations(self));
 
     return result;
@@ -496,7 +542,7 @@ static VALUE prof_method_load(VALUE self, VALUE data)
     method_data->call_trees = prof_get_call_trees(call_trees);
 
     VALUE measurement = rb_hash_aref(data, ID2SYM(rb_intern("measurement")));
-    method_data->measurement = prof_get_measurement(measurement);
+    prof_measurement_merge_internal(&method_data->measurement, prof_get_measurement(measurement));
 
     VALUE allocations = rb_hash_aref(data, ID2SYM(rb_intern("allocations")));
     for (int i = 0; i < rb_array_len(allocations); i++)
@@ -39,7 +39,7 @@ typedef struct prof_method_t
     VALUE source_file;                      // Source file
     int source_line;                        // Line number
 
-    prof_measurement_t* measurement;        // Stores measurement data for this method
+    prof_measurement_t measurement;         // Stores measurement data for this method
 } prof_method_t;
 
 void rp_init_method_info(void);
@@ -51,7 +51,9 @@ prof_method_t* method_table_lookup(st_table* table, st_data_t key);
 size_t method_table_insert(st_table* table, st_data_t key, prof_method_t* val);
 void method_table_free(st_table* table);
 prof_method_t* prof_method_create(VALUE profile, VALUE klass, VALUE msym, VALUE source_file, int source_line);
+prof_method_t* prof_method_copy(VALUE profile, prof_method_t* other);
 prof_method_t* prof_get_method(VALUE self);
+void prof_method_merge_internal(prof_method_t* self, prof_method_t* other);
 
 VALUE prof_method_wrap(prof_method_t* result);
 void prof_method_mark(void* data);
@@ -20,6 +20,9 @@
    */
 
 #include <assert.h>
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+#include <ruby/fiber/scheduler.h>
+#endif
 
 #include "rp_allocation.h"
 #include "rp_call_trees.h"
@@ -83,12 +86,23 @@ thread_data_t* check_fiber(prof_profile_t* profile, double measurement)
      we don't merge fibers and the fiber ids differ, or the thread ids differ. */
     if (profile->last_thread_data->fiber != fiber)
     {
+        thread_data_t* previous = profile->last_thread_data;
+
         result = threads_table_lookup(profile, fiber);
         if (!result)
         {
             result = threads_table_insert(profile, fiber);
         }
         switch_thread(profile, result, measurement);
+
+        /* Has the fiber we switched away from finished? Only fibers of the thread that is running now are
+           checked. A thread's root fiber finishes with the thread, so those are never reclaimed and each
+           thread keeps its own results. */
+        if (previous->stack && previous->thread_id == result->thread_id &&
+            !RTEST(rb_fiber_alive_p(previous->fiber)))
+        {
+            reclaim_fiber(profile, previous, measurement);
+        }
     }
     else
     {
@@ -195,6 +209,30 @@ static void prof_trace(prof_profile_t* profile, rb_trace_arg_t* trace_arg, doubl
     last_fiber = fiber;
 }
 
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+static ID id_io_wait;
+static ID id_kernel_sleep;
+static ID id_block;
+
+/* Returns the reason a fiber is about to block if the called method is one of the current fiber
+   scheduler's blocking hooks, otherwise 0. */
+static ID scheduler_wait_reason(rb_trace_arg_t* trace_arg, VALUE self)
+{
+    VALUE msym = rb_tracearg_callee_id(trace_arg);
+    if (msym == Qnil)
+        return 0;
+
+    ID mid = SYM2ID(msym);
+    if (mid != id_io_wait && mid != id_kernel_sleep && mid != id_block)
+        return 0;
+
+    if (self != rb_fiber_scheduler_current())
+        return 0;
+
+    return mid;
+}
+#endif
+
 static void prof_event_hook(VALUE trace_point, void* data)
 {
     VALUE profile = (VALUE)data;
@@ -304,6 +342,17 @@ static void prof_event_hook(VALUE trace_point, void* data)
             prof_frame_t* next_frame = prof_frame_push(thread_data->stack, call_tree, measurement, RTEST(profile_t->paused));
             next_frame->source_file = method->source_file;
             next_frame->source_line = method->source_line;
+            prof_thread_record_event(thread_data, method, true, measurement);
+
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+            /* Schedulers often implement one hook with another (kernel_sleep calling block), possibly through
+               helper methods and blocks, so only the outermost hook of the fiber is counted */
+            if (event == RUBY_EVENT_CALL && !thread_data->in_wait_hook)
+            {
+                next_frame->wait_reason = scheduler_wait_reason(trace_arg, self);
+                thread_data->in_wait_hook = (next_frame->wait_reason != 0);
+            }
+#endif
             break;
         }
         case RUBY_EVENT_RETURN:
@@ -315,7 +364,19 @@ static void prof_event_hook(VALUE trace_point, void* data)
             if (!method)
                 break;
 
-            prof_frame_pop(thread_data->stack, measurement);
+            prof_frame_t* frame = prof_frame_pop(thread_data->stack, measurement);
+            if (frame)
+                prof_thread_record_event(thread_data, frame->call_tree->method, false, measurement);
+
+            /* Attribute the time spent in a fiber scheduler hook to the method that blocked */
+            if (frame && frame->wait_reason)
+            {
+                thread_data->in_wait_hook = false;
+                prof_frame_t* blocked_frame = prof_frame_current(thread_data->stack);
+                if (blocked_frame)
+                    prof_call_tree_add_wait(blocked_frame->call_tree, frame->wait_reason,
+                                            measurement - frame->start_time - frame->dead_time);
+            }
             break;
         }
         case RUBY_INTERNAL_EVENT_NEWOBJ:
@@ -375,6 +436,36 @@ prof_profile_t* prof_get_profile(VALUE self)
     return RTYPEDDATA_DATA(self);
 }
 
+/* Methods, and so their call trees, keep the profile they belong to. Its call tree version is
+   incremented every time its call trees are attached to a parent or merged, when one of their
+   Measurements is changed from Ruby, and when profiling stops. Values derived from the call trees,
+   such as the minimum depth of a method or its aggregated callers, are only valid for the version
+   they were calculated at. Call trees that do not belong to a profile, for example because they were
+   created from Ruby, have version 0 and values derived from them are not cached. */
+unsigned int prof_profile_call_tree_version(VALUE self)
+{
+    return self == Qnil ? 0 : prof_get_profile(self)->call_tree_version;
+}
+
+void prof_profile_invalidate_call_trees(VALUE self)
+{
+    if (self == Qnil)
+        return;
+
+    prof_profile_t* profile = prof_get_profile(self);
+    // 0 is reserved for call trees without a profile
+    if (++profile->call_tree_version == 0)
+        profile->call_tree_version = 1;
+}
+
+/* Raises if stop is still post processing the profile. Its csrs and minimum depths are then written by
+   native threads without the GVL, so other Ruby threads must not read them or change the call trees. */
+void prof_profile_check_post_processed(VALUE self)
+{
+    if (self != Qnil && prof_get_profile(self)->post_processing)
+        rb_raise(rb_eRuntimeError, "RubyProf.stop has not finished");
+}
+
 static int collect_threads(st_data_t key, st_data_t value, st_data_t result)
 {
     thread_data_t* thread_data = (thread_data_t*)value;
@@ -427,6 +518,10 @@ static void prof_profile_ruby_gc_free(void* data)
     threads_table_free(profile->threads_tbl);
     profile->threads_tbl = NULL;
 
+    /* This table does not own its threads, they are freed with the threads table */
+    rb_st_free_table(profile->dead_fibers_tbl);
+    profile->dead_fibers_tbl = NULL;
+
     if (profile->exclude_threads_tbl)
     {
         rb_st_free_table(profile->exclude_threads_tbl);
@@ -476,7 +571,13 @@ static VALUE prof_allocate(VALUE klass)
     profile->exclude_threads_tbl = NULL;
     profile->include_threads_tbl = NULL;
     profile->running = Qfalse;
+    profile->post_processing = false;
     profile->allow_exceptions = false;
+    profile->merge_fibers = false;
+    profile->merge_dead_fibers = false;
+    profile->record_events = false;
+    profile->dead_fibers_tbl = rb_st_init_numtable();
+    profile->call_tree_version = 1;
     profile->exclude_methods_tbl = method_table_create();
     profile->running = Qfalse;
     profile->tracepoints = rb_ary_new();
@@ -494,10 +595,14 @@ static int pop_frames(VALUE key, st_data_t value, st_data_t data)
     prof_profile_t* profile = (prof_profile_t*)data;
     double measurement = prof_measure(profile->measurer, NULL);
 
+    // Finished fibers have already popped their frames
+    if (!thread_data->stack)
+        return ST_CONTINUE;
+
     if (profile->last_thread_data->fiber != thread_data->fiber)
         switch_thread(profile, thread_data, measurement);
 
-    while (prof_frame_pop(thread_data->stack, measurement));
+    prof_thread_pop_frames(thread_data, measurement);
 
     return ST_CONTINUE;
 }
@@ -506,6 +611,23 @@ static void
 prof_stop_threads(prof_profile_t* profile)
 {
     rb_st_foreach(profile->threads_tbl, pop_frames, (st_data_t)profile);
+
+    if (profile->merge_fibers)
+        merge_fibers(profile);
+}
+
+static VALUE prof_post_process(VALUE self)
+{
+    // Measurements were updated while profiling without changing the version
+    prof_profile_invalidate_call_trees(self);
+    post_process_threads(prof_get_profile(self));
+    return Qnil;
+}
+
+static VALUE prof_post_processed(VALUE self)
+{
+    prof_get_profile(self)->post_processing = false;
+    return Qnil;
 }
 
 /* call-seq:
@@ -522,7 +644,15 @@ prof_stop_threads(prof_profile_t* profile)
    exclude_common:    Exclude common methods from the profile. True or false.
    exclude_threads:   Threads to exclude from the profiling results.
    include_threads:   Focus profiling on only the given threads. This will ignore
-                      all other threads. */
+                      all other threads.
+   merge_fibers:      Whether to merge the results of fibers into the fiber that resumed them,
+                      instead of reporting each fiber as its own thread. True or false.
+   merge_dead_fibers: Whether to merge fibers that have finished running into one result per root
+                      method as soon as they finish. This keeps memory use flat when profiling
+                      programs that create many short lived fibers. True or false.
+   record_events:     Whether to record every method entry and exit in order, so reports can show
+                      when methods ran and not just how long they took in total. This uses memory
+                      for every call. Events of fibers that are merged are discarded. True or false. */
 static VALUE prof_initialize(int argc, VALUE* argv, VALUE self)
 {
     prof_profile_t* profile = prof_get_profile(self);
@@ -533,6 +663,9 @@ static VALUE prof_initialize(int argc, VALUE* argv, VALUE self)
     VALUE exclude_common = Qnil;
     VALUE allow_exceptions = Qfalse;
     VALUE track_allocations = Qfalse;
+    VALUE merge_fibers = Qfalse;
+    VALUE merge_dead_fibers = Qfalse;
+    VALUE record_events = Qfalse;
 
     int i;
 
@@ -554,6 +687,9 @@ static VALUE prof_initialize(int argc, VALUE* argv, VALUE self)
             exclude_common = rb_hash_aref(mode_or_options, ID2SYM(rb_intern("exclude_common")));
             exclude_threads = rb_hash_aref(mode_or_options, ID2SYM(rb_intern("exclude_threads")));
             include_threads = rb_hash_aref(mode_or_options, ID2SYM(rb_intern("include_threads")));
+            merge_fibers = rb_hash_aref(mode_or_options, ID2SYM(rb_intern("merge_fibers")));
+            merge_dead_fibers = rb_hash_aref(mode_or_options, ID2SYM(rb_intern("merge_dead_fibers")));
+            record_events = rb_hash_aref(mode_or_options, ID2SYM(rb_intern("record_events")));
         }
         break;
     case 2:
@@ -571,6 +707,9 @@ static VALUE prof_initialize(int argc, VALUE* argv, VALUE self)
     }
     profile->measurer = prof_measurer_create(NUM2INT(mode), track_allocations == Qtrue);
     profile->allow_exceptions = (allow_exceptions == Qtrue);
+    profile->merge_fibers = RTEST(merge_fibers);
+    profile->merge_dead_fibers = RTEST(merge_dead_fibers);
+    profile->record_events = RTEST(record_events);
 
     if (exclude_threads != Qnil)
     {
@@ -635,6 +774,16 @@ static VALUE prof_profile_measure_mode(VALUE self)
     return INT2NUM(profile->measurer->mode);
 }
 
+/* call-seq:
+   record_events? -> boolean
+
+   Returns if method entries and exits were recorded in this profile.*/
+static VALUE prof_profile_record_events(VALUE self)
+{
+    prof_profile_t* profile = prof_get_profile(self);
+    return profile->record_events ? Qtrue : Qfalse;
+}
+
 /* call-seq:
    track_allocations -> boolean
 
@@ -660,6 +809,11 @@ static VALUE prof_start(VALUE self)
         rb_raise(rb_eRuntimeError, "RubyProf.start was already called");
     }
 
+    if (profile->post_processing)
+    {
+        rb_raise(rb_eRuntimeError, "RubyProf.stop has not finished");
+    }
+
     profile->running = Qtrue;
     profile->paused = Qfalse;
     profile->last_thread_data = threads_table_insert(profile, rb_fiber_current());
@@ -764,6 +918,12 @@ static VALUE prof_stop(VALUE self)
     profile->running = profile->paused = Qfalse;
     profile->last_thread_data = NULL;
 
+    /* Post processing releases the GVL, so other threads keep running meanwhile. The profile has stopped,
+       but until post processing is done it cannot be started or merged, and reading values derived from
+       its call trees or changing them raises, see prof_profile_check_post_processed. */
+    profile->post_processing = true;
+    rb_ensure(prof_post_process, self, prof_post_processed, self);
+
     return self;
 }
 
@@ -805,6 +965,113 @@ static VALUE prof_remove_thread(VALUE self, VALUE thread)
   return thread;
 }
 
+typedef struct prof_profile_merge_t
+{
+    VALUE self;
+    prof_profile_t* profile;
+    thread_data_t* target;
+} prof_profile_merge_t;
+
+static int merge_profile_find_thread(st_data_t key, st_data_t value, st_data_t data)
+{
+    thread_data_t* thread_data = (thread_data_t*)value;
+    thread_data_t** args = (thread_data_t**)data;
+
+    if (thread_data->call_tree && thread_data->call_tree->method->key == args[0]->call_tree->method->key)
+    {
+        args[1] = thread_data;
+        return ST_STOP;
+    }
+    return ST_CONTINUE;
+}
+
+/* Returns the thread other is merged into, which is the first thread with the same root method. If there
+   is none a new thread is added, with a fiber id that is not used yet. */
+static thread_data_t* merge_profile_target(prof_profile_t* profile, thread_data_t* other)
+{
+    thread_data_t* args[] = { other, NULL };
+    rb_st_foreach(profile->threads_tbl, merge_profile_find_thread, (st_data_t)args);
+    if (args[1])
+        return args[1];
+
+    thread_data_t* result = thread_data_create();
+    result->thread_id = other->thread_id;
+    result->fiber_id = other->fiber_id;
+    while (rb_st_lookup(profile->threads_tbl, (st_data_t)result->fiber_id, NULL))
+        result->fiber_id = rb_funcall(result->fiber_id, '+', 1, INT2FIX(1));
+    rb_st_insert(profile->threads_tbl, (st_data_t)result->fiber_id, (st_data_t)result);
+    return result;
+}
+
+static int merge_profile_methods(st_data_t key, st_data_t value, st_data_t data)
+{
+    prof_method_t* method = (prof_method_t*)value;
+    prof_profile_merge_t* merge = (prof_profile_merge_t*)data;
+
+    prof_method_t* target_method = method_table_lookup(merge->target->method_table, key);
+    if (!target_method)
+    {
+        target_method = prof_method_copy(merge->self, method);
+        method_table_insert(merge->target->method_table, key, target_method);
+    }
+    prof_method_merge_internal(target_method, method);
+    return ST_CONTINUE;
+}
+
+static int merge_profile_threads(st_data_t key, st_data_t value, st_data_t data)
+{
+    thread_data_t* other = (thread_data_t*)value;
+    prof_profile_merge_t* merge = (prof_profile_merge_t*)data;
+
+    if (!other->call_tree)
+        return ST_CONTINUE;
+
+    thread_data_t* target = merge_profile_target(merge->profile, other);
+    merge->target = target;
+
+    // First merge methods so the merged call trees reference the target's methods
+    rb_st_foreach(other->method_table, merge_profile_methods, data);
+
+    if (!target->call_tree)
+    {
+        prof_method_t* method = method_table_lookup(target->method_table, other->call_tree->method->key);
+        target->call_tree = prof_call_tree_create(method, NULL, other->call_tree->source_file, other->call_tree->source_line);
+        prof_add_call_tree(method->call_trees, target->call_tree);
+    }
+    prof_call_tree_merge_thread(target->call_tree, other->call_tree, target->method_table);
+
+    // The thread's methods have changed
+    target->methods = Qnil;
+    return ST_CONTINUE;
+}
+
+/* call-seq:
+   merge_profile(other) -> self
+
+Adds the results of other to this profile, for example to combine the profiles of many
+requests to the same page. Each thread of other is merged into the thread that has the
+same root method, or is added as a new thread if there is none. Measurements of the same
+call paths are added together. Both profiles must have stopped and use the same measure
+mode. Other is not modified. */
+static VALUE prof_profile_merge(VALUE self, VALUE other)
+{
+    prof_profile_t* profile = prof_get_profile(self);
+    prof_profile_t* other_profile = prof_get_profile(other);
+
+    if (profile == other_profile)
+        rb_raise(rb_eArgError, "A profile cannot be merged into itself");
+    if (profile->running == Qtrue || other_profile->running == Qtrue ||
+        profile->post_processing || other_profile->post_processing)
+        rb_raise(rb_eRuntimeError, "Profiles must be stopped before they are merged");
+    if (profile->measurer->mode != other_profile->measurer->mode)
+        rb_raise(rb_eArgError, "Profiles with different measure modes cannot be merged");
+
+    prof_profile_merge_t merge = { self, profile, NULL };
+    rb_st_foreach(other_profile->threads_tbl, merge_profile_threads, (st_data_t)&merge);
+
+    return self;
+}
+
 /* Document-method: RubyProf::Profile#Profile
    call-seq:
    profile(&block) -> self
@@ -921,6 +1188,12 @@ void rp_init_profile(void)
     cProfile = rb_define_class_under(mProf, "Profile", rb_cObject);
     rb_define_alloc_func(cProfile, prof_allocate);
 
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+    id_io_wait = rb_intern("io_wait");
+    id_kernel_sleep = rb_intern("kernel_sleep");
+    id_block = rb_intern("block");
+#endif
+
     rb_define_singleton_method(cProfile, "profile", prof_profile_class, -1);
     rb_define_method(cProfile, "initialize", prof_initialize, -1);
     rb_define_method(cProfile, "profile", prof_profile_object, 0);
@@ -934,10 +1207,12 @@ void rp_init_profile(void)
     rb_define_method(cProfile, "exclude_method!", prof_exclude_method, 2);
     rb_define_method(cProfile, "measure_mode", prof_profile_measure_mode, 0);
     rb_define_method(cProfile, "track_allocations?", prof_profile_track_allocations, 0);
+    rb_define_method(cProfile, "record_events?", prof_profile_record_events, 0);
 
     rb_define_method(cProfile, "threads", prof_threads, 0);
     rb_define_method(cProfile, "add_thread", prof_add_thread, 1);
     rb_define_method(cProfile, "remove_thread", prof_remove_thread, 1);
+    rb_define_method(cProfile, "merge_profile", prof_profile_merge, 1);
 
     rb_define_method(cProfile, "_dump_data", prof_profile_dump, 0);
     rb_define_method(cProfile, "_load_data", prof_profile_load, 1);
@@ -14,6 +14,7 @@ typedef struct prof_profile_t
 {
     VALUE running;
     VALUE paused;
+    bool post_processing;             /* Is stop still processing the call trees without the GVL */
 
     prof_measurer_t* measurer;
 
@@ -26,10 +27,18 @@ typedef struct prof_profile_t
     thread_data_t* last_thread_data;
     double measurement_at_pause_resume;
     bool allow_exceptions;
+    bool merge_fibers;
+    bool merge_dead_fibers;
+    bool record_events;
+    st_table* dead_fibers_tbl;
+    unsigned int call_tree_version;   /* See prof_profile_call_tree_version */
 } prof_profile_t;
 
 void rp_init_profile(void);
 prof_profile_t* prof_get_profile(VALUE self);
+unsigned int prof_profile_call_tree_version(VALUE self);
+void prof_profile_invalidate_call_trees(VALUE self);
+void prof_profile_check_post_processed(VALUE self);
 
 
 #endif //__RP_PROFILE_H__
@@ -0,0 +1,2378 @@
+/* Copyright (C) 2005-2019 Shugo Maeda <shugo@ruby-lang.org> and Charlie Savage <cfis@savagexi.com>
+   Please see the LICENSE file for copyright and distribution information */
+
+/* Document-module: RubyProf::Report
+The RubyProf::Report module formats the flat, graph, callgrind, flame graph, dot, call stack,
+speedscope, Chrome trace, pprof and columnar reports directly from a thread's method table, call
+tree and recorded events. Rows are filtered, sorted and written to an output without wrapping
+them as MethodInfo objects, which makes printing large profiles much faster. It is used by
+RubyProf::FlatPrinter, RubyProf::GraphPrinter, RubyProf::CallTreePrinter,
+RubyProf::FlameGraphPrinter, RubyProf::DotPrinter, RubyProf::CallStackPrinter,
+RubyProf::SpeedscopePrinter, RubyProf::ChromeTracePrinter, RubyProf::PprofPrinter and
+RubyProf::ColumnarPrinter. */
+
+#include <math.h>
+#include "rp_report.h"
+#include "rp_allocation.h"
+#include "rp_call_trees.h"
+#include "rp_thread.h"
+
+VALUE mRpReport;
+
+/* Output is collected into a buffer that is written once it reaches this size */
+#define REPORT_FLUSH_SIZE 65536
+#define GRAPH_PERCENTAGE_WIDTH 8
+#define GRAPH_TIME_WIDTH 11
+#define GRAPH_CALL_WIDTH 17
+
+static ID id_append;
+static ID id_total_time;
+static ID id_self_time;
+static ID id_wait_time;
+static ID id_children_time;
+static ID id_called;
+
+typedef enum
+{
+    REPORT_TOTAL_TIME,
+    REPORT_SELF_TIME,
+    REPORT_WAIT_TIME,
+    REPORT_CHILDREN_TIME,
+    REPORT_CALLED
+} prof_report_field_t;
+
+typedef struct prof_report_row_t
+{
+    prof_method_t* method;
+    double value;                   // Value of the sort field
+    VALUE full_name;
+} prof_report_row_t;
+
+typedef struct prof_report_t
+{
+    VALUE output;
+    VALUE buffer;
+    VALUE names;                    // Keeps the full names alive while the report is written
+    st_table* names_table;          // Full names by method key
+    prof_report_row_t* rows;
+    size_t rows_count;
+} prof_report_t;
+
+/* ======  Fields  ====== */
+static prof_report_field_t prof_report_field(VALUE value, prof_report_field_t default_field)
+{
+    if (value == Qnil)
+        return default_field;
+
+    ID id = SYMBOL_P(value) ? SYM2ID(value) : 0;
+    if (id == id_total_time)
+        return REPORT_TOTAL_TIME;
+    else if (id == id_self_time)
+        return REPORT_SELF_TIME;
+    else if (id == id_wait_time)
+        return REPORT_WAIT_TIME;
+    else if (id == id_children_time)
+        return REPORT_CHILDREN_TIME;
+    else if (id == id_called)
+        return REPORT_CALLED;
+
+    rb_raise(rb_eArgError, "Unsupported report field: %" PRIsVALUE, rb_inspect(value));
+}
+
+static double prof_report_value(prof_measurement_t* measurement, prof_report_field_t field)
+{
+    switch (field)
+    {
+    case REPORT_TOTAL_TIME:
+        return measurement->total_time;
+    case REPORT_SELF_TIME:
+        return measurement->self_time;
+    case REPORT_WAIT_TIME:
+        return measurement->wait_time;
+    case REPORT_CHILDREN_TIME:
+        return measurement->total_time - measurement->self_time - measurement->wait_time;
+    default:
+        return measurement->called;
+    }
+}
+
+static double prof_report_children_time(prof_measurement_t* measurement)
+{
+    return prof_report_value(measurement, REPORT_CHILDREN_TIME);
+}
+
+/* ======  Output  ====== */
+static void prof_report_init(prof_report_t* report, VALUE output)
+{
+    report->output = output;
+    report->buffer = rb_str_buf_new(REPORT_FLUSH_SIZE);
+    report->names = rb_ary_new();
+    report->names_table = rb_st_init_numtable();
+    report->rows = NULL;
+    report->rows_count = 0;
+}
+
+static void prof_report_release(prof_report_t* report)
+{
+    xfree(report->rows);
+    rb_st_free_table(report->names_table);
+}
+
+static void prof_report_flush(prof_report_t* report)
+{
+    if (RSTRING_LEN(report->buffer) == 0)
+        return;
+
+    // Give the output its own string since it may keep a reference to it
+    rb_funcall(report->output, id_append, 1, report->buffer);
+    report->buffer = rb_str_buf_new(REPORT_FLUSH_SIZE);
+}
+
+static void prof_report_check_flush(prof_report_t* report)
+{
+    if (RSTRING_LEN(report->buffer) >= REPORT_FLUSH_SIZE)
+        prof_report_flush(report);
+}
+
+static void prof_report_cat(prof_report_t* report, const char* text)
+{
+    rb_str_cat_cstr(report->buffer, text);
+}
+
+PRINTF_ARGS(static void prof_report_printf(prof_report_t* report, const char* format, ...), 2, 3);
+
+static void prof_report_printf(prof_report_t* report, const char* format, ...)
+{
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+
+    if (length < (int)sizeof(text))
+    {
+        rb_str_cat(report->buffer, text, length);
+    }
+    else
+    {
+        char* long_text = ALLOC_N(char, length + 1);
+        va_start(args, format);
+        vsnprintf(long_text, length + 1, format, args);
+        va_end(args);
+        rb_str_cat(report->buffer, long_text, length);
+        xfree(long_text);
+    }
+}
+
+/* Formats a float the same way Ruby's sprintf does, including NaN and Infinity */
+static void prof_report_float(prof_report_t* report, int width, int precision, double value)
+{
+    if (isnan(value))
+        prof_report_printf(report, "%*s", width, "NaN");
+    else if (isinf(value))
+        prof_report_printf(report, "%*s", width, value > 0 ? "Inf" : "-Inf");
+    else
+        prof_report_printf(report, "%*.*f", width, precision, value);
+}
+
+/* Appends a string left justified to the given width in characters, like Ruby's %-30s */
+static void prof_report_string(prof_report_t* report, VALUE string, long width)
+{
+    rb_str_buf_append(report->buffer, string);
+    for (long padding = width - rb_str_strlen(string); padding > 0; padding--)
+        rb_str_cat(report->buffer, " ", 1);
+}
+
+/* Appends a string as a JSON string literal. '<' is escaped too so the JSON can be embedded in a
+   HTML script element. */
+static void prof_report_json(prof_report_t* report, VALUE string)
+{
+    const char* text = RSTRING_PTR(string);
+    long length = RSTRING_LEN(string);
+    long start = 0;
+
+    rb_str_cat(report->buffer, "\"", 1);
+    for (long i = 0; i < length; i++)
+    {
+        unsigned char c = (unsigned char)text[i];
+        if (c >= 0x20 && c != '"' && c != '\\' && c != '<')
+            continue;
+
+        rb_str_cat(report->buffer, text + start, i - start);
+        start = i + 1;
+
+        if (c == '"')
+            prof_report_cat(report, "\\\"");
+        else if (c == '\\')
+            prof_report_cat(report, "\\\\");
+        else if (c == '\n')
+            prof_report_cat(report, "\\n");
+        else
+            prof_report_printf(report, "\\u%04x", c);
+    }
+    rb_str_cat(report->buffer, text + start, length - start);
+    rb_str_cat(report->buffer, "\"", 1);
+    RB_GC_GUARD(string);
+}
+
+static void prof_report_location(prof_report_t* report, prof_method_t* method)
+{
+    if (method->source_file != Qnil)
+    {
+        rb_str_buf_append(report->buffer, rb_obj_as_string(method->source_file));
+        prof_report_printf(report, ":%d", method->source_line);
+    }
+}
+
+/* ======  Methods  ====== */
+/* Returns the same name as MethodInfo#full_name. Names are cached since methods are printed
+   repeatedly as the callers and callees of other methods. */
+static VALUE prof_report_full_name(prof_report_t* report, prof_method_t* method)
+{
+    st_data_t value;
+    if (rb_st_lookup(report->names_table, method->key, &value))
+        return (VALUE)value;
+
+    if (method->klass_name == Qnil)
+        method->klass_name = resolve_klass_name(method->klass, &method->klass_flags);
+
+    VALUE result;
+    switch (method->klass_flags)
+    {
+    case kClassSingleton:
+        result = rb_sprintf("<Class::%" PRIsVALUE ">#%" PRIsVALUE, method->klass_name, method->method_name);
+        break;
+    case kModuleSingleton:
+        result = rb_sprintf("<Module::%" PRIsVALUE ">#%" PRIsVALUE, method->klass_name, method->method_name);
+        break;
+    case kObjectSingleton:
+        result = rb_sprintf("<Object::%" PRIsVALUE ">#%" PRIsVALUE, method->klass_name, method->method_name);
+        break;
+    default:
+        result = rb_sprintf("%" PRIsVALUE "#%" PRIsVALUE, method->klass_name, method->method_name);
+        break;
+    }
+
+    rb_ary_push(report->names, result);
+    rb_st_insert(report->names_table, method->key, (st_data_t)result);
+    return result;
+}
+
+static int prof_report_collect_rows(st_data_t key, st_data_t value, st_data_t data)
+{
+    prof_report_t* report = (prof_report_t*)data;
+    prof_report_row_t* row = &report->rows[report->rows_count++];
+    row->method = (prof_method_t*)value;
+    row->full_name = Qnil;
+    return ST_CONTINUE;
+}
+
+/* Sorts from largest to smallest value, with ties ordered by name so reports are repeatable */
+static int prof_report_compare_rows(const void* a, const void* b)
+{
+    const prof_report_row_t* row_a = (const prof_report_row_t*)a;
+    const prof_report_row_t* row_b = (const prof_report_row_t*)b;
+
+    if (row_a->value > row_b->value)
+        return -1;
+    else if (row_a->value < row_b->value)
+        return 1;
+    else
+        return rb_str_cmp(row_a->full_name, row_b->full_name);
+}
+
+/* Collects the methods of a thread whose filter value, as a percentage of the thread's total
+   time, is between min_percent and max_percent and sorts them by the sort field */
+static void prof_report_rows(prof_report_t* report, thread_data_t* thread_data, prof_report_field_t sort_field,
+                             prof_report_field_t filter_field, double min_percent, double max_percent)
+{
+    double total_time = thread_data->call_tree ? thread_data->call_tree->measurement.total_time : 0;
+
+    report->rows = ALLOC_N(prof_report_row_t, thread_data->method_table->num_entries);
+    report->rows_count = 0;
+    rb_st_foreach(thread_data->method_table, prof_report_collect_rows, (st_data_t)report);
+
+    size_t count = 0;
+    for (size_t i = 0; i < report->rows_count; i++)
+    {
+        prof_report_row_t row = report->rows[i];
+        double percent = (prof_report_value(&row.method->measurement, filter_field) / total_time) * 100;
+        if (percent < min_percent || percent > max_percent)
+            continue;
+
+        row.value = prof_report_value(&row.method->measurement, sort_field);
+        row.full_name = prof_report_full_name(report, row.method);
+        report->rows[count++] = row;
+    }
+    report->rows_count = count;
+
+    qsort(report->rows, report->rows_count, sizeof(prof_report_row_t), prof_report_compare_rows);
+}
+
+/* ======  Flat report  ====== */
+static void prof_report_flat_row(prof_report_t* report, prof_report_row_t* row, double total_time)
+{
+    prof_measurement_t* measurement = &row->method->measurement;
+
+    prof_report_float(report, 6, 2, measurement->self_time / total_time * 100);
+    prof_report_cat(report, "  ");
+    prof_report_float(report, 9, 3, measurement->total_time);
+    prof_report_cat(report, " ");
+    prof_report_float(report, 9, 3, measurement->self_time);
+    prof_report_cat(report, " ");
+    prof_report_float(report, 9, 3, measurement->wait_time);
+    prof_report_cat(report, " ");
+    prof_report_float(report, 9, 3, prof_report_children_time(measurement));
+    prof_report_printf(report, " %8d  %s", measurement->called, row->method->recursive ? "*" : " ");
+    prof_report_string(report, row->full_name, 30);
+    prof_report_cat(report, " ");
+    prof_report_location(report, row->method);
+    prof_report_cat(report, "\n");
+}
+
+/* ======  Graph report  ====== */
+static void prof_report_graph_times(prof_report_t* report, prof_measurement_t* measurement)
+{
+    prof_report_float(report, GRAPH_TIME_WIDTH, 3, measurement->total_time);
+    prof_report_float(report, GRAPH_TIME_WIDTH, 3, measurement->self_time);
+    prof_report_float(report, GRAPH_TIME_WIDTH, 3, measurement->wait_time);
+    prof_report_float(report, GRAPH_TIME_WIDTH, 3, prof_report_children_time(measurement));
+}
+
+static void prof_report_graph_relative(prof_report_t* report, prof_call_tree_t* call_tree, int called, prof_method_t* method)
+{
+    prof_report_printf(report, "%*s", 2 * GRAPH_PERCENTAGE_WIDTH, "");
+    prof_report_graph_times(report, &call_tree->measurement);
+
+    char call_called[64];
+    snprintf(call_called, sizeof(call_called), "%d/%d", call_tree->measurement.called, called);
+    prof_report_printf(report, "%*s     ", GRAPH_CALL_WIDTH, call_called);
+
+    rb_str_buf_append(report->buffer, prof_report_full_name(report, method));
+    prof_report_cat(report, "\n");
+}
+
+static int prof_report_compare_total_time(const void* a, const void* b)
+{
+    double total_time_a = (*(prof_call_tree_t* const*)a)->measurement.total_time;
+    double total_time_b = (*(prof_call_tree_t* const*)b)->measurement.total_time;
+    return (total_time_a > total_time_b) - (total_time_a < total_time_b);
+}
+
+/* Returns a copy of the call trees sorted by increasing total time */
+static prof_call_tree_t** prof_report_sort_call_trees(prof_call_tree_t** call_trees, size_t count)
+{
+    prof_call_tree_t** result = ALLOC_N(prof_call_tree_t*, count);
+    if (count > 0)
+    {
+        memcpy(result, call_trees, count * sizeof(prof_call_tree_t*));
+        qsort(result, count, sizeof(prof_call_tree_t*), prof_report_compare_total_time);
+    }
+    return result;
+}
+
+static void prof_report_graph_row(prof_report_t* report, prof_report_row_t* row, double total_time)
+{
+    prof_method_t* method = row->method;
+    prof_measurement_t* measurement = &method->measurement;
+    prof_call_trees_t* call_trees = method->call_trees;
+
+    prof_call_trees_build_aggregates(call_trees);
+
+    for (int i = 0; i < 150; i++)
+        rb_str_cat(report->buffer, "-", 1);
+    prof_report_cat(report, "\n");
+
+    // Callers, from least to most expensive
+    prof_call_tree_t** callers = prof_report_sort_call_trees(call_trees->callers, call_trees->callers_count);
+    for (size_t i = 0; i < call_trees->callers_count; i++)
+        prof_report_graph_relative(report, callers[i], measurement->called, callers[i]->parent->method);
+    xfree(callers);
+
+    prof_report_float(report, GRAPH_PERCENTAGE_WIDTH - 1, 2, (measurement->total_time / total_time) * 100);
+    prof_report_cat(report, "%");
+    prof_report_float(report, GRAPH_PERCENTAGE_WIDTH - 1, 2, (measurement->self_time / total_time) * 100);
+    prof_report_cat(report, "%");
+    prof_report_graph_times(report, measurement);
+    prof_report_printf(report, "%*d    %s", GRAPH_CALL_WIDTH, measurement->called, method->recursive ? "*" : " ");
+    prof_report_string(report, row->full_name, 30);
+    prof_report_cat(report, " ");
+    prof_report_location(report, method);
+    prof_report_cat(report, "\n");
+
+    // Callees, from most to least expensive
+    prof_call_tree_t** callees = prof_report_sort_call_trees(call_trees->callees, call_trees->callees_count);
+    for (size_t i = call_trees->callees_count; i > 0; i--)
+    {
+        prof_call_tree_t* callee = callees[i - 1];
+        prof_report_graph_relative(report, callee, callee->method->measurement.called, callee->method);
+    }
+    xfree(callees);
+}
+
+/* ======  Callgrind  ====== */
+/* File and function names are written once, after which they are referred to by id. Cost lines
+   use positions relative to the previous cost line of the same function. */
+typedef struct prof_callgrind_t
+{
+    prof_report_t* report;
+    thread_data_t* thread_data;
+    double value_scale;
+    VALUE files;                    // Ids of the files written so far, by expanded path
+    st_table* method_files;         // File id of each method written so far, by method key
+    st_table* functions;            // Ids of the functions written so far, by method key
+    int last_line;                  // Line of the previous cost line in the current function
+    bool has_last_line;
+} prof_callgrind_t;
+
+static void prof_callgrind_file(prof_callgrind_t* callgrind, const char* key, prof_method_t* method)
+{
+    prof_report_t* report = callgrind->report;
+
+    st_data_t id;
+    if (rb_st_lookup(callgrind->method_files, method->key, &id))
+    {
+        prof_report_printf(report, "%s=(%d)\n", key, (int)id);
+        return;
+    }
+
+    VALUE path = method->source_file == Qnil ? rb_str_new_cstr("") : rb_file_expand_path(method->source_file, Qnil);
+    VALUE existing = rb_hash_aref(callgrind->files, path);
+    if (existing != Qnil)
+    {
+        id = (st_data_t)FIX2INT(existing);
+        rb_st_insert(callgrind->method_files, method->key, id);
+        prof_report_printf(report, "%s=(%d)\n", key, (int)id);
+        return;
+    }
+
+    id = (st_data_t)(RHASH_SIZE(callgrind->files) + 1);
+    rb_hash_aset(callgrind->files, path, INT2FIX((int)id));
+    rb_st_insert(callgrind->method_files, method->key, id);
+
+    prof_report_printf(report, "%s=(%d) ", key, (int)id);
+    rb_str_buf_append(report->buffer, path);
+    prof_report_cat(report, "\n");
+}
+
+/* Returns the same name as CallTreePrinter#calltree_name */
+static VALUE prof_callgrind_function_name(prof_method_t* method)
+{
+    if (method->klass_name == Qnil)
+        method->klass_name = resolve_klass_name(method->klass, &method->klass_flags);
+
+    VALUE klass_path = rb_funcall(rb_obj_as_string(method->klass_name), rb_intern("gsub"), 2,
+                                  rb_str_new_cstr("::"), rb_str_new_cstr("/"));
+
+    const char* suffix = "";
+    if (method->klass_flags == kClassSingleton || method->klass_flags == kModuleSingleton)
+        suffix = "^";
+    else if (method->klass_flags == kObjectSingleton)
+        suffix = "*";
+
+    return rb_sprintf("%" PRIsVALUE "::%" PRIsVALUE "%s", klass_path, method->method_name, suffix);
+}
+
+static void prof_callgrind_function(prof_callgrind_t* callgrind, const char* key, prof_method_t* method)
+{
+    prof_report_t* report = callgrind->report;
+
+    st_data_t id;
+    if (rb_st_lookup(callgrind->functions, method->key, &id))
+    {
+        prof_report_printf(report, "%s=(%d)\n", key, (int)id);
+        return;
+    }
+
+    id = (st_data_t)(callgrind->functions->num_entries + 1);
+    rb_st_insert(callgrind->functions, method->key, id);
+
+    prof_report_printf(report, "%s=(%d) ", key, (int)id);
+    rb_str_buf_append(report->buffer, prof_callgrind_function_name(method));
+    prof_report_cat(report, "\n");
+}
+
+static void prof_callgrind_cost(prof_callgrind_t* callgrind, int line, double value)
+{
+    prof_report_t* report = callgrind->report;
+
+    if (!callgrind->has_last_line)
+        prof_report_printf(report, "%d", line);
+    else if (line == callgrind->last_line)
+        prof_report_cat(report, "*");
+    else
+        prof_report_printf(report, "%+d", line - callgrind->last_line);
+
+    prof_report_printf(report, " %lld\n", llround(value * callgrind->value_scale));
+
+    callgrind->last_line = line;
+    callgrind->has_last_line = true;
+}
+
+static void prof_callgrind_method(prof_callgrind_t* callgrind, prof_method_t* method)
+{
+    prof_callgrind_file(callgrind, "fl", method);
+    prof_callgrind_function(callgrind, "fn", method);
+
+    callgrind->has_last_line = false;
+    prof_callgrind_cost(callgrind, method->source_line, method->measurement.self_time);
+
+    prof_call_trees_t* call_trees = method->call_trees;
+    prof_call_trees_build_aggregates(call_trees);
+
+    for (size_t i = 0; i < call_trees->callees_count; i++)
+    {
+        prof_call_tree_t* callee = call_trees->callees[i];
+        prof_callgrind_file(callgrind, "cfl", callee->method);
+        prof_callgrind_function(callgrind, "cfn", callee->method);
+        prof_report_printf(callgrind->report, "calls=%d %d\n", callee->measurement.called, callee->source_line);
+        prof_callgrind_cost(callgrind, callee->source_line, callee->measurement.total_time);
+    }
+    prof_report_cat(callgrind->report, "\n");
+}
+
+static int prof_callgrind_collect_methods(st_data_t key, st_data_t value, st_data_t data)
+{
+    prof_report_t* report = (prof_report_t*)data;
+    report->rows[report->rows_count++].method = (prof_method_t*)value;
+    return ST_CONTINUE;
+}
+
+static VALUE prof_callgrind_write(VALUE data)
+{
+    prof_callgrind_t* callgrind = (prof_callgrind_t*)data;
+    prof_report_t* report = callgrind->report;
+    st_table* method_table = callgrind->thread_data->method_table;
+
+    report->rows = ALLOC_N(prof_report_row_t, method_table->num_entries);
+    rb_st_foreach(method_table, prof_callgrind_collect_methods, (st_data_t)report);
+
+    // Methods are written in the reverse order they were called, same as the Ruby printer did
+    for (size_t i = report->rows_count; i > 0; i--)
+    {
+        prof_callgrind_method(callgrind, report->rows[i - 1].method);
+        prof_report_check_flush(report);
+    }
+    prof_report_flush(report);
+    return Qnil;
+}
+
+static VALUE prof_callgrind_free(VALUE data)
+{
+    prof_callgrind_t* callgrind = (prof_callgrind_t*)data;
+    prof_report_release(callgrind->report);
+    rb_st_free_table(callgrind->method_files);
+    rb_st_free_table(callgrind->functions);
+    return Qnil;
+}
+
+/* ======  Flame graph  ====== */
+typedef struct prof_flame_graph_frame_t
+{
+    size_t subtree_end;             // Index in the csr one past the last descendant of the frame
+    long path_length;               // Length of the path including the frame
+} prof_flame_graph_frame_t;
+
+typedef struct prof_flame_graph_t
+{
+    prof_report_t* report;
+    prof_call_tree_csr_t* csr;
+    double value_scale;
+    VALUE path;                     // Reused for the stack of every call tree
+    prof_flame_graph_frame_t* frames;
+} prof_flame_graph_t;
+
+/* Walks the flattened call tree in preorder. The path of each call tree is its parent's path
+   plus its own name, so the path buffer only ever needs to be truncated and appended to. */
+static VALUE prof_flame_graph_write(VALUE data)
+{
+    prof_flame_graph_t* flame_graph = (prof_flame_graph_t*)data;
+    prof_report_t* report = flame_graph->report;
+    prof_call_tree_csr_t* csr = flame_graph->csr;
+    size_t depth = 0;
+
+    for (size_t i = 0; i < csr->count; i++)
+    {
+        while (depth > 0 && flame_graph->frames[depth - 1].subtree_end <= i)
+            depth--;
+
+        long path_length = depth > 0 ? flame_graph->frames[depth - 1].path_length : 0;
+        rb_str_set_len(flame_graph->path, path_length);
+        if (depth > 0)
+            rb_str_cat(flame_graph->path, ";", 1);
+
+        prof_call_tree_t* call_tree = csr->nodes[i];
+        rb_str_buf_append(flame_graph->path, prof_report_full_name(report, call_tree->method));
+
+        prof_flame_graph_frame_t* frame = &flame_graph->frames[depth++];
+        frame->subtree_end = csr->subtree_end[i];
+        frame->path_length = RSTRING_LEN(flame_graph->path);
+
+        long long value = llround(call_tree->measurement.self_time * flame_graph->value_scale);
+        if (value > 0)
+        {
+            rb_str_buf_append(report->buffer, flame_graph->path);
+            prof_report_printf(report, " %lld\n", value);
+            prof_report_check_flush(report);
+        }
+    }
+    prof_report_flush(report);
+    return Qnil;
+}
+
+static VALUE prof_flame_graph_free(VALUE data)
+{
+    prof_flame_graph_t* flame_graph = (prof_flame_graph_t*)data;
+    prof_report_release(flame_graph->report);
+    xfree(flame_graph->frames);
+    return Qnil;
+}
+
+/* ======  Dot  ====== */
+#define DOT_CLASS_COLOR "\"#666666\""
+#define DOT_EDGE_COLOR "\"#666666\""
+
+typedef struct prof_dot_t
+{
+    prof_report_t* report;
+    thread_data_t* thread_data;
+    double min_percent;
+    double edge_percent;
+    size_t max_nodes;
+    bool clusters;
+    double total_time;
+    st_table* nodes;                // Index of each node's row, by method key
+    prof_measurement_t* to_other;   // Calls from each node to pruned methods
+    prof_measurement_t* from_other; // Calls to each node from pruned methods
+    bool has_other;
+} prof_dot_t;
+
+static double prof_dot_percent(prof_dot_t* dot, double value)
+{
+    return dot->total_time > 0 ? (value / dot->total_time) * 100 : 0;
+}
+
+static void prof_dot_node_id(prof_dot_t* dot, size_t index)
+{
+    rb_str_catf(dot->report->buffer, "n%" PRIsVALUE "_%zu", dot->thread_data->fiber_id, index);
+}
+
+static void prof_dot_other_id(prof_dot_t* dot)
+{
+    rb_str_catf(dot->report->buffer, "other%" PRIsVALUE, dot->thread_data->fiber_id);
+}
+
+/* Appends a string as a quoted dot string */
+static void prof_dot_string(prof_report_t* report, VALUE string)
+{
+    rb_str_cat(report->buffer, "\"", 1);
+    rb_str_buf_append(report->buffer, rb_funcall(string, rb_intern("gsub"), 2, rb_str_new_cstr("\""), rb_str_new_cstr("\\\"")));
+    rb_str_cat(report->buffer, "\"", 1);
+}
+
+static void prof_dot_edge_attributes(prof_dot_t* dot, int called, int total_called)
+{
+    if (total_called > 0)
+        prof_report_printf(dot->report, " [label=\"%d/%d\" fontsize=10 fontcolor=%s];\n", called, total_called, DOT_EDGE_COLOR);
+    else
+        prof_report_printf(dot->report, " [label=\"%d\" fontsize=10 fontcolor=%s style=dashed];\n", called, DOT_EDGE_COLOR);
+}
+
+static void prof_dot_add(prof_measurement_t* measurement, prof_measurement_t* other)
+{
+    measurement->total_time += other->total_time;
+    measurement->called += other->called;
+}
+
+/* Edges between kept methods are written as they are, edges to or from pruned methods are
+   combined into edges to or from a single node that stands for all of them */
+static void prof_dot_edges(prof_dot_t* dot, prof_method_t* method, bool kept, size_t index)
+{
+    prof_report_t* report = dot->report;
+    prof_call_trees_t* call_trees = method->call_trees;
+    prof_call_trees_build_aggregates(call_trees);
+
+    for (size_t i = 0; i < call_trees->callees_count; i++)
+    {
+        prof_call_tree_t* callee = call_trees->callees[i];
+
+        st_data_t callee_index;
+        bool callee_kept = rb_st_lookup(dot->nodes, callee->method->key, &callee_index);
+
+        if (kept && callee_kept)
+        {
+            if (prof_dot_percent(dot, callee->measurement.total_time) < dot->edge_percent)
+                continue;
+
+            prof_dot_node_id(dot, index);
+            prof_report_cat(report, " -> ");
+            prof_dot_node_id(dot, (size_t)callee_index);
+            prof_dot_edge_attributes(dot, callee->measurement.called, callee->method->measurement.called);
+        }
+        else if (kept)
+        {
+            prof_dot_add(&dot->to_other[index], &callee->measurement);
+        }
+        else if (callee_kept)
+        {
+            prof_dot_add(&dot->from_other[callee_index], &callee->measurement);
+        }
+    }
+}
+
+static int prof_dot_pruned_edges(st_data_t key, st_data_t value, st_data_t data)
+{
+    prof_dot_t* dot = (prof_dot_t*)data;
+    if (!rb_st_lookup(dot->nodes, key, NULL))
+        prof_dot_edges(dot, (prof_method_t*)value, false, 0);
+    return ST_CONTINUE;
+}
+
+static void prof_dot_other_edges(prof_dot_t* dot)
+{
+    prof_report_t* report = dot->report;
+    for (size_t i = 0; i < report->rows_count; i++)
+    {
+        if (dot->to_other[i].called > 0 && prof_dot_percent(dot, dot->to_other[i].total_time) >= dot->edge_percent)
+        {
+            prof_dot_node_id(dot, i);
+            prof_report_cat(report, " -> ");
+            prof_dot_other_id(dot);
+            prof_dot_edge_attributes(dot, dot->to_other[i].called, 0);
+            dot->has_other = true;
+        }
+
+        if (dot->from_other[i].called > 0 && prof_dot_percent(dot, dot->from_other[i].total_time) >= dot->edge_percent)
+        {
+            prof_dot_other_id(dot);
+            prof_report_cat(report, " -> ");
+            prof_dot_node_id(dot, i);
+            prof_dot_edge_attributes(dot, dot->from_other[i].called, 0);
+            dot->has_other = true;
+        }
+    }
+}
+
+static void prof_dot_clusters(prof_dot_t* dot)
+{
+    prof_report_t* report = dot->report;
+
+    // Nodes are grouped by the class of their method
+    VALUE classes = rb_hash_new();
+    for (size_t i = 0; i < report->rows_count; i++)
+    {
+        VALUE klass_name = rb_obj_as_string(report->rows[i].method->klass_name);
+        VALUE indexes = rb_hash_aref(classes, klass_name);
+        if (indexes == Qnil)
+        {
+            indexes = rb_ary_new();
+            rb_hash_aset(classes, klass_name, indexes);
+        }
+        rb_ary_push(indexes, SIZET2NUM(i));
+    }
+
+    VALUE klass_names = rb_funcall(classes, rb_intern("keys"), 0);
+    for (long i = 0; i < RARRAY_LEN(klass_names); i++)
+    {
+        VALUE klass_name = rb_ary_entry(klass_names, i);
+        VALUE indexes = rb_hash_aref(classes, klass_name);
+
+        rb_str_catf(report->buffer, "subgraph cluster_%" PRIsVALUE "_%ld {\nlabel = ", dot->thread_data->fiber_id, i);
+        prof_dot_string(report, klass_name);
+        prof_report_printf(report, ";\nfontcolor = %s;\nfontsize = 16;\ncolor = %s;\n", DOT_CLASS_COLOR, DOT_CLASS_COLOR);
+        for (long j = 0; j < RARRAY_LEN(indexes); j++)
+        {
+            prof_dot_node_id(dot, NUM2SIZET(rb_ary_entry(indexes, j)));
+            prof_report_cat(report, ";\n");
+        }
+        prof_report_cat(report, "}\n");
+        prof_report_check_flush(report);
+    }
+    RB_GC_GUARD(classes);
+}
+
+static VALUE prof_dot_write(VALUE data)
+{
+    prof_dot_t* dot = (prof_dot_t*)data;
+    prof_report_t* report = dot->report;
+    thread_data_t* thread_data = dot->thread_data;
+
+    // Nodes are the largest methods by total time
+    prof_report_rows(report, thread_data, REPORT_TOTAL_TIME, REPORT_TOTAL_TIME, dot->min_percent, INFINITY);
+    if (report->rows_count > dot->max_nodes)
+        report->rows_count = dot->max_nodes;
+
+    dot->to_other = ZALLOC_N(prof_measurement_t, report->rows_count + 1);
+    dot->from_other = ZALLOC_N(prof_measurement_t, report->rows_count + 1);
+    for (size_t i = 0; i < report->rows_count; i++)
+        rb_st_insert(dot->nodes, report->rows[i].method->key, (st_data_t)i);
+
+    rb_str_catf(report->buffer, "subgraph \"Thread %" PRIsVALUE "\" {\n", thread_data->thread_id);
+    for (size_t i = 0; i < report->rows_count; i++)
+    {
+        prof_report_row_t* row = &report->rows[i];
+        // Within a cluster the class name is left out
+        VALUE name = row->full_name;
+        if (dot->clusters)
+            name = rb_ary_entry(rb_str_split(name, "#"), -1);
+
+        prof_dot_node_id(dot, i);
+        prof_report_cat(report, " [label=");
+        prof_dot_string(report, rb_sprintf("%" PRIsVALUE "\\n(%.0f%%)", name,
+                                           round(prof_dot_percent(dot, row->value))));
+        prof_report_cat(report, "];\n");
+        prof_report_check_flush(report);
+    }
+
+    for (size_t i = 0; i < report->rows_count; i++)
+    {
+        prof_dot_edges(dot, report->rows[i].method, true, i);
+        prof_report_check_flush(report);
+    }
+
+    rb_st_foreach(thread_data->method_table, prof_dot_pruned_edges, (st_data_t)dot);
+    prof_dot_other_edges(dot);
+    if (dot->has_other)
+    {
+        prof_dot_other_id(dot);
+        prof_report_printf(report, " [label=\"%zu other methods\" shape=box style=dashed];\n",
+                           (size_t)thread_data->method_table->num_entries - report->rows_count);
+    }
+    prof_report_cat(report, "}\n");
+
+    if (dot->clusters)
+        prof_dot_clusters(dot);
+
+    prof_report_flush(report);
+    return Qnil;
+}
+
+static VALUE prof_dot_free(VALUE data)
+{
+    prof_dot_t* dot = (prof_dot_t*)data;
+    prof_report_release(dot->report);
+    rb_st_free_table(dot->nodes);
+    xfree(dot->to_other);
+    xfree(dot->from_other);
+    return Qnil;
+}
+
+/* ======  Call stack  ====== */
+typedef struct prof_call_stack_t
+{
+    prof_report_t* report;
+    thread_data_t* thread_data;
+    st_table* method_ids;           // Index of each method in the methods array, by method key
+    prof_method_t** methods;
+    size_t methods_count;
+    size_t methods_capacity;
+} prof_call_stack_t;
+
+static size_t prof_call_stack_method(prof_call_stack_t* call_stack, prof_method_t* method)
+{
+    st_data_t id;
+    if (rb_st_lookup(call_stack->method_ids, method->key, &id))
+        return (size_t)id;
+
+    if (call_stack->methods_count == call_stack->methods_capacity)
+    {
+        call_stack->methods_capacity = call_stack->methods_capacity == 0 ? 256 : call_stack->methods_capacity * 2;
+        REALLOC_N(call_stack->methods, prof_method_t*, call_stack->methods_capacity);
+    }
+
+    id = (st_data_t)call_stack->methods_count;
+    call_stack->methods[call_stack->methods_count++] = method;
+    rb_st_insert(call_stack->method_ids, method->key, id);
+    return (size_t)id;
+}
+
+/* Writes the call tree as a flat array of four numbers per call tree, in preorder: the index of
+   its method, the index one past its last descendant, its total time and its number of calls.
+   Methods are written once, after the call trees. The viewer only needs to look at the children
+   of the call trees that are expanded, so the tree is never built in the browser. */
+static VALUE prof_call_stack_write(VALUE data)
+{
+    prof_call_stack_t* call_stack = (prof_call_stack_t*)data;
+    prof_report_t* report = call_stack->report;
+    thread_data_t* thread_data = call_stack->thread_data;
+    prof_call_tree_csr_t* csr = prof_thread_csr(thread_data);
+
+    prof_report_cat(report, "{\"id\":");
+    prof_report_json(report, rb_obj_as_string(thread_data->thread_id));
+    prof_report_cat(report, ",\"fiber_id\":");
+    prof_report_json(report, rb_obj_as_string(thread_data->fiber_id));
+    prof_report_printf(report, ",\"total_time\":%.17g,\n\"nodes\":[",
+                       csr->count > 0 ? csr->nodes[0]->measurement.total_time : 0);
+
+    for (size_t i = 0; i < csr->count; i++)
+    {
+        prof_call_tree_t* call_tree = csr->nodes[i];
+        prof_report_printf(report, i == 0 ? "%zu,%zu,%.9g,%d" : ",\n%zu,%zu,%.9g,%d",
+                           prof_call_stack_method(call_stack, call_tree->method), csr->subtree_end[i],
+                           call_tree->measurement.total_time, call_tree->measurement.called);
+        prof_report_check_flush(report);
+    }
+
+    prof_report_cat(report, "],\n\"methods\":[");
+    for (size_t i = 0; i < call_stack->methods_count; i++)
+    {
+        prof_method_t* method = call_stack->methods[i];
+
+        prof_report_cat(report, i == 0 ? "[" : ",\n[");
+        prof_report_json(report, prof_report_full_name(report, method));
+        prof_report_cat(report, ",");
+        if (method->source_file == Qnil)
+            prof_report_cat(report, "null");
+        else
+            prof_report_json(report, rb_file_expand_path(method->source_file, Qnil));
+        prof_report_printf(report, ",%d,%d]", method->source_line, method->measurement.called);
+        prof_report_check_flush(report);
+    }
+    prof_report_cat(report, "]}");
+
+    prof_report_flush(report);
+    return Qnil;
+}
+
+static VALUE prof_call_stack_free(VALUE data)
+{
+    prof_call_stack_t* call_stack = (prof_call_stack_t*)data;
+    prof_report_release(call_stack->report);
+    rb_st_free_table(call_stack->method_ids);
+    xfree(call_stack->methods);
+    return Qnil;
+}
+
+/* ======  Timelines  ====== */
+typedef void (*prof_timeline_visitor)(void* data, prof_method_t* method, bool enter, double at);
+
+typedef struct prof_timeline_t
+{
+    prof_method_t** stack;          // Methods that have been entered but not exited
+    size_t depth;
+    size_t capacity;
+} prof_timeline_t;
+
+static void prof_timeline_push(prof_timeline_t* timeline, prof_method_t* method)
+{
+    if (timeline->depth == timeline->capacity)
+    {
+        timeline->capacity = timeline->capacity == 0 ? 64 : timeline->capacity * 2;
+        REALLOC_N(timeline->stack, prof_method_t*, timeline->capacity);
+    }
+    timeline->stack[timeline->depth++] = method;
+}
+
+/* Replays the recorded events of a thread. Methods that were already running when profiling
+   started only have an exit event, so they are entered at the time of the first event. */
+static void prof_timeline_events(prof_timeline_t* timeline, prof_event_log_t* event_log, double start,
+                                 prof_timeline_visitor visitor, void* data)
+{
+    size_t depth = 0;
+    for (size_t i = 0; i < event_log->count; i++)
+    {
+        prof_event_t* event = &event_log->events[i];
+        if (event->enter)
+            depth++;
+        else if (depth > 0)
+            depth--;
+        else
+            prof_timeline_push(timeline, event->method);
+    }
+
+    double first = event_log->events[0].measurement - start;
+    for (size_t i = timeline->depth; i > 0; i--)
+        visitor(data, timeline->stack[i - 1], true, first);
+
+    // The stack is now in the order the methods were entered
+    for (size_t i = 0; i < timeline->depth / 2; i++)
+    {
+        prof_method_t* method = timeline->stack[i];
+        timeline->stack[i] = timeline->stack[timeline->depth - i - 1];
+        timeline->stack[timeline->depth - i - 1] = method;
+    }
+
+    double at = first;
+    for (size_t i = 0; i < event_log->count; i++)
+    {
+        prof_event_t* event = &event_log->events[i];
+        at = event->measurement - start;
+
+        if (event->enter)
+        {
+            prof_timeline_push(timeline, event->method);
+            visitor(data, event->method, true, at);
+        }
+        else if (timeline->depth > 0)
+        {
+            visitor(data, timeline->stack[--timeline->depth], false, at);
+        }
+    }
+
+    while (timeline->depth > 0)
+        visitor(data, timeline->stack[--timeline->depth], false, at);
+}
+
+typedef struct prof_timeline_frame_t
+{
+    size_t subtree_end;
+    double end;                     // Time the call tree exits
+    double next_child;              // Time the next child of the call tree is entered
+    prof_method_t* method;
+} prof_timeline_frame_t;
+
+/* Lays out the call tree of a thread that has no recorded events. Each call tree is entered when
+   its previous sibling exits, or when its parent is entered if it is the first child, and runs for
+   its total time. Children are in the order they were first called, but calls to the same method
+   are combined so this is not the order things actually happened. */
+static void prof_timeline_call_tree(thread_data_t* thread_data, prof_timeline_visitor visitor, void* data)
+{
+    prof_call_tree_csr_t* csr = prof_thread_csr(thread_data);
+    prof_timeline_frame_t* frames = ALLOC_N(prof_timeline_frame_t, csr->count > 0 ? csr->count : 1);
+    size_t depth = 0;
+
+    for (size_t i = 0; i < csr->count; i++)
+    {
+        while (depth > 0 && frames[depth - 1].subtree_end <= i)
+        {
+            depth--;
+            visitor(data, frames[depth].method, false, frames[depth].end);
+        }
+
+        prof_call_tree_t* call_tree = csr->nodes[i];
+        double at = depth > 0 ? frames[depth - 1].next_child : 0;
+        if (depth > 0)
+            frames[depth - 1].next_child += call_tree->measurement.total_time;
+
+        prof_timeline_frame_t* frame = &frames[depth++];
+        frame->subtree_end = csr->subtree_end[i];
+        frame->end = at + call_tree->measurement.total_time;
+        frame->next_child = at;
+        frame->method = call_tree->method;
+        visitor(data, call_tree->method, true, at);
+    }
+
+    while (depth > 0)
+    {
+        depth--;
+        visitor(data, frames[depth].method, false, frames[depth].end);
+    }
+
+    xfree(frames);
+}
+
+/* Returns whether the thread has recorded events, so its timeline shows when methods actually ran */
+static bool prof_timeline_recorded(thread_data_t* thread_data)
+{
+    return thread_data->event_log && thread_data->event_log->count > 0;
+}
+
+/* Calls the visitor for every method entry and exit of the thread, in time order. Times are
+   relative to start. Recorded events are used if there are any, otherwise they are made up
+   from the call tree. */
+static void prof_timeline_walk(prof_timeline_t* timeline, thread_data_t* thread_data, double start,
+                               prof_timeline_visitor visitor, void* data)
+{
+    timeline->depth = 0;
+    if (prof_timeline_recorded(thread_data))
+        prof_timeline_events(timeline, thread_data->event_log, start, visitor, data);
+    else
+        prof_timeline_call_tree(thread_data, visitor, data);
+}
+
+/* Returns the time of the first recorded event of any of the threads, or 0 if there are none */
+static double prof_timeline_start(VALUE threads)
+{
+    double result = INFINITY;
+    for (long i = 0; i < RARRAY_LEN(threads); i++)
+    {
+        prof_event_log_t* event_log = prof_get_thread(rb_ary_entry(threads, i))->event_log;
+        if (event_log && event_log->count > 0 && event_log->events[0].measurement < result)
+            result = event_log->events[0].measurement;
+    }
+    return isinf(result) ? 0 : result;
+}
+
+/* ======  Speedscope  ====== */
+typedef struct prof_speedscope_t
+{
+    prof_report_t* report;
+    VALUE threads;
+    VALUE name;
+    const char* unit;
+    prof_timeline_t timeline;
+    st_table* frame_ids;            // Index of each method in the shared frames, by method key
+    prof_method_t** frames;
+    size_t frames_count;
+    size_t frames_capacity;
+    bool first_event;
+    double end;
+} prof_speedscope_t;
+
+static size_t prof_speedscope_frame(prof_speedscope_t* speedscope, prof_method_t* method)
+{
+    st_data_t id;
+    if (rb_st_lookup(speedscope->frame_ids, method->key, &id))
+        return (size_t)id;
+
+    if (speedscope->frames_count == speedscope->frames_capacity)
+    {
+        speedscope->frames_capacity = speedscope->frames_capacity == 0 ? 256 : speedscope->frames_capacity * 2;
+        REALLOC_N(speedscope->frames, prof_method_t*, speedscope->frames_capacity);
+    }
+
+    id = (st_data_t)speedscope->frames_count;
+    speedscope->frames[speedscope->frames_count++] = method;
+    rb_st_insert(speedscope->frame_ids, method->key, id);
+    return (size_t)id;
+}
+
+static void prof_speedscope_event(void* data, prof_method_t* method, bool enter, double at)
+{
+    prof_speedscope_t* speedscope = (prof_speedscope_t*)data;
+    prof_report_t* report = speedscope->report;
+
+    if (!speedscope->first_event)
+        prof_report_cat(report, ",");
+    speedscope->first_event = false;
+
+    prof_report_printf(report, "\n{\"type\":\"%s\",\"frame\":%zu,\"at\":%.17g}",
+                       enter ? "O" : "C", prof_speedscope_frame(speedscope, method), at);
+    prof_report_check_flush(report);
+
+    if (at > speedscope->end)
+        speedscope->end = at;
+}
+
+static VALUE prof_speedscope_write(VALUE data)
+{
+    prof_speedscope_t* speedscope = (prof_speedscope_t*)data;
+    prof_report_t* report = speedscope->report;
+    double start = prof_timeline_start(speedscope->threads);
+
+    prof_report_cat(report, "{\"$schema\":\"https://www.speedscope.app/file-format-schema.json\",\"name\":");
+    prof_report_json(report, speedscope->name);
+    prof_report_cat(report, ",\"exporter\":");
+    prof_report_json(report, rb_sprintf("ruby-prof %" PRIsVALUE, rb_const_get(mProf, rb_intern("VERSION"))));
+    prof_report_cat(report, ",\"profiles\":[");
+
+    // Each thread and fiber is its own profile, their events are written as they are replayed
+    for (long i = 0; i < RARRAY_LEN(speedscope->threads); i++)
+    {
+        thread_data_t* thread_data = prof_get_thread(rb_ary_entry(speedscope->threads, i));
+
+        prof_report_cat(report, i == 0 ? "\n{" : ",\n{");
+        // A timeline made up from the call tree must not be mistaken for when methods actually ran
+        prof_report_cat(report, "\"type\":\"evented\",\"name\":");
+        prof_report_json(report, rb_sprintf("Thread %" PRIsVALUE ", Fiber %" PRIsVALUE "%s", thread_data->thread_id, thread_data->fiber_id,
+                                            prof_timeline_recorded(thread_data) ? "" : " (synthesized from the call tree)"));
+        prof_report_printf(report, ",\"unit\":\"%s\",\"startValue\":0,\"events\":[", speedscope->unit);
+
+        speedscope->first_event = true;
+        speedscope->end = 0;
+        prof_timeline_walk(&speedscope->timeline, thread_data, start, prof_speedscope_event, speedscope);
+        prof_report_printf(report, "],\"endValue\":%.17g}", speedscope->end);
+    }
+
+    // Frames are shared by all profiles and written last, once they are all known
+    prof_report_cat(report, "],\"shared\":{\"frames\":[");
+    for (size_t i = 0; i < speedscope->frames_count; i++)
+    {
+        prof_method_t* method = speedscope->frames[i];
+
+        prof_report_cat(report, i == 0 ? "\n{\"name\":" : ",\n{\"name\":");
+        prof_report_json(report, prof_report_full_name(report, method));
+        if (method->source_file != Qnil)
+        {
+            prof_report_cat(report, ",\"file\":");
+            prof_report_json(report, rb_obj_as_string(method->source_file));
+            prof_report_printf(report, ",\"line\":%d", method->source_line);
+        }
+        prof_report_cat(report, "}");
+        prof_report_check_flush(report);
+    }
+    prof_report_cat(report, "]}}\n");
+
+    prof_report_flush(report);
+    return Qnil;
+}
+
+static VALUE prof_speedscope_free(VALUE data)
+{
+    prof_speedscope_t* speedscope = (prof_speedscope_t*)data;
+    prof_report_release(speedscope->report);
+    rb_st_free_table(speedscope->frame_ids);
+    xfree(speedscope->frames);
+    xfree(speedscope->timeline.stack);
+    return Qnil;
+}
+
+/* ======  Chrome trace  ====== */
+typedef struct prof_chrome_trace_t
+{
+    prof_report_t* report;
+    VALUE threads;
+    double value_scale;
+    double min_duration;
+    size_t max_events;
+    size_t events_count;            // Method events written so far
+    bool first;
+    int pid;
+    int tid;
+    prof_timeline_t timeline;
+    double* starts;                 // Entry times of the methods that are running
+    size_t depth;
+    size_t capacity;
+} prof_chrome_trace_t;
+
+static void prof_chrome_trace_separator(prof_chrome_trace_t* trace)
+{
+    prof_report_cat(trace->report, trace->first ? "\n" : ",\n");
+    trace->first = false;
+}
+
+/* Adds a metadata event that names a process or thread track */
+static void prof_chrome_trace_name(prof_chrome_trace_t* trace, const char* kind, VALUE name)
+{
+    prof_report_t* report = trace->report;
+    prof_chrome_trace_separator(trace);
+    prof_report_printf(report, "{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+                       kind, trace->pid, trace->tid);
+    prof_report_json(report, name);
+    prof_report_cat(report, "}}");
+}
+
+/* Methods are written as complete events when they exit, since only then is their duration known */
+static void prof_chrome_trace_event(void* data, prof_method_t* method, bool enter, double at)
+{
+    prof_chrome_trace_t* trace = (prof_chrome_trace_t*)data;
+    prof_report_t* report = trace->report;
+
+    if (enter)
+    {
+        if (trace->depth == trace->capacity)
+        {
+            trace->capacity = trace->capacity == 0 ? 64 : trace->capacity * 2;
+            REALLOC_N(trace->starts, double, trace->capacity);
+        }
+        trace->starts[trace->depth++] = at;
+        return;
+    }
+
+    double start = trace->starts[--trace->depth];
+    double duration = at - start;
+    if (duration < trace->min_duration || trace->events_count >= trace->max_events)
+        return;
+
+    prof_chrome_trace_separator(trace);
+    prof_report_cat(report, "{\"name\":");
+    prof_report_json(report, prof_report_full_name(report, method));
+    prof_report_printf(report, ",\"cat\":\"ruby\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+                       start * trace->value_scale, duration * trace->value_scale, trace->pid, trace->tid);
+    if (method->source_file != Qnil)
+    {
+        prof_report_cat(report, ",\"args\":{\"file\":");
+        prof_report_json(report, rb_obj_as_string(method->source_file));
+        prof_report_printf(report, ",\"line\":%d}", method->source_line);
+    }
+    prof_report_cat(report, "}");
+    prof_report_check_flush(report);
+    trace->events_count++;
+}
+
+static VALUE prof_chrome_trace_write(VALUE data)
+{
+    prof_chrome_trace_t* trace = (prof_chrome_trace_t*)data;
+    prof_report_t* report = trace->report;
+    double start = prof_timeline_start(trace->threads);
+
+    // Each Ruby thread is shown as a process and each of its fibers as a thread of that process
+    VALUE pids = rb_hash_new();
+
+    prof_report_cat(report, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (long i = 0; i < RARRAY_LEN(trace->threads); i++)
+    {
+        thread_data_t* thread_data = prof_get_thread(rb_ary_entry(trace->threads, i));
+        trace->tid = (int)i + 1;
+
+        // Threads are placed against each other, so only recorded timelines can be shown
+        if (!prof_timeline_recorded(thread_data))
+            continue;
+
+        VALUE pid = rb_hash_aref(pids, thread_data->thread_id);
+        if (pid == Qnil)
+        {
+            pid = INT2FIX((int)RHASH_SIZE(pids) + 1);
+            rb_hash_aset(pids, thread_data->thread_id, pid);
+            trace->pid = FIX2INT(pid);
+            prof_chrome_trace_name(trace, "process_name", rb_sprintf("Thread %" PRIsVALUE, thread_data->thread_id));
+        }
+        trace->pid = FIX2INT(pid);
+        prof_chrome_trace_name(trace, "thread_name", rb_sprintf("Fiber %" PRIsVALUE, thread_data->fiber_id));
+
+        trace->depth = 0;
+        trace->timeline.depth = 0;
+        prof_timeline_events(&trace->timeline, thread_data->event_log, start, prof_chrome_trace_event, trace);
+    }
+    prof_report_cat(report, "\n]}\n");
+
+    RB_GC_GUARD(pids);
+
+    prof_report_flush(report);
+    return Qnil;
+}
+
+static VALUE prof_chrome_trace_free(VALUE data)
+{
+    prof_chrome_trace_t* trace = (prof_chrome_trace_t*)data;
+    prof_report_release(trace->report);
+    xfree(trace->timeline.stack);
+    xfree(trace->starts);
+    return Qnil;
+}
+
+/* ======  Pprof  ====== */
+/* Messages and fields of pprof's profile.proto that are written */
+#define PPROF_PROFILE_SAMPLE_TYPE 1
+#define PPROF_PROFILE_SAMPLE 2
+#define PPROF_PROFILE_LOCATION 4
+#define PPROF_PROFILE_FUNCTION 5
+#define PPROF_PROFILE_STRING_TABLE 6
+#define PPROF_PROFILE_PERIOD_TYPE 11
+#define PPROF_PROFILE_PERIOD 12
+#define PPROF_VALUE_TYPE_TYPE 1
+#define PPROF_VALUE_TYPE_UNIT 2
+#define PPROF_SAMPLE_LOCATION_ID 1
+#define PPROF_SAMPLE_VALUE 2
+#define PPROF_LOCATION_ID 1
+#define PPROF_LOCATION_LINE 4
+#define PPROF_LINE_FUNCTION_ID 1
+#define PPROF_LINE_LINE 2
+#define PPROF_FUNCTION_ID 1
+#define PPROF_FUNCTION_NAME 2
+#define PPROF_FUNCTION_SYSTEM_NAME 3
+#define PPROF_FUNCTION_FILENAME 4
+#define PPROF_FUNCTION_START_LINE 5
+
+#define PPROF_WIRE_VARINT 0
+#define PPROF_WIRE_LENGTH 2
+
+/* A message is encoded into a byte buffer first since its length has to be written before it */
+typedef struct prof_pprof_bytes_t
+{
+    uint8_t* data;
+    size_t length;
+    size_t capacity;
+} prof_pprof_bytes_t;
+
+typedef struct prof_pprof_t
+{
+    prof_report_t* report;
+    VALUE threads;
+    VALUE sample_type;
+    VALUE sample_unit;
+    double value_scale;
+    VALUE strings;                  // Index of each string in the string table
+    st_table* functions;            // Ids of the functions written so far, by method key
+    prof_pprof_bytes_t header;
+    prof_pprof_bytes_t message;
+    prof_pprof_bytes_t nested;
+    uint64_t* stack;                // Location ids from the root to the current call tree
+    size_t* stack_ends;             // Index in the csr one past the last descendant of each frame
+    size_t stack_capacity;
+} prof_pprof_t;
+
+static void prof_pprof_bytes_reserve(prof_pprof_bytes_t* bytes, size_t size)
+{
+    if (bytes->length + size <= bytes->capacity)
+        return;
+
+    while (bytes->length + size > bytes->capacity)
+        bytes->capacity = bytes->capacity == 0 ? 256 : bytes->capacity * 2;
+    REALLOC_N(bytes->data, uint8_t, bytes->capacity);
+}
+
+static void prof_pprof_varint(prof_pprof_bytes_t* bytes, uint64_t value)
+{
+    prof_pprof_bytes_reserve(bytes, 10);
+    while (value >= 0x80)
+    {
+        bytes->data[bytes->length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    bytes->data[bytes->length++] = (uint8_t)value;
+}
+
+static void prof_pprof_tag(prof_pprof_bytes_t* bytes, int field, int wire_type)
+{
+    prof_pprof_varint(bytes, ((uint64_t)field << 3) | wire_type);
+}
+
+static void prof_pprof_int(prof_pprof_bytes_t* bytes, int field, uint64_t value)
+{
+    // Zero is the default so it is left out, like protobuf encoders do
+    if (value == 0)
+        return;
+
+    prof_pprof_tag(bytes, field, PPROF_WIRE_VARINT);
+    prof_pprof_varint(bytes, value);
+}
+
+static void prof_pprof_nested(prof_pprof_bytes_t* bytes, int field, prof_pprof_bytes_t* nested)
+{
+    prof_pprof_tag(bytes, field, PPROF_WIRE_LENGTH);
+    prof_pprof_varint(bytes, nested->length);
+    prof_pprof_bytes_reserve(bytes, nested->length);
+    memcpy(bytes->data + bytes->length, nested->data, nested->length);
+    bytes->length += nested->length;
+    nested->length = 0;
+}
+
+/* Writes the encoded message as a field of the Profile message. A profile is just a sequence of
+   its fields, so messages are written as soon as they are encoded. */
+static void prof_pprof_write(prof_pprof_t* pprof, int field)
+{
+    prof_pprof_tag(&pprof->header, field, PPROF_WIRE_LENGTH);
+    prof_pprof_varint(&pprof->header, pprof->message.length);
+    rb_str_cat(pprof->report->buffer, (const char*)pprof->header.data, pprof->header.length);
+    if (pprof->message.length > 0)
+        rb_str_cat(pprof->report->buffer, (const char*)pprof->message.data, pprof->message.length);
+
+    pprof->header.length = 0;
+    pprof->message.length = 0;
+    prof_report_check_flush(pprof->report);
+}
+
+/* Returns the index of the string in the string table, adding it if needed */
+static uint64_t prof_pprof_string(prof_pprof_t* pprof, VALUE string)
+{
+    VALUE index = rb_hash_aref(pprof->strings, string);
+    if (index != Qnil)
+        return NUM2ULL(index);
+
+    uint64_t result = RHASH_SIZE(pprof->strings);
+    rb_hash_aset(pprof->strings, rb_str_new_frozen(string), ULL2NUM(result));
+
+    if (RSTRING_LEN(string) > 0)
+    {
+        prof_pprof_bytes_reserve(&pprof->message, RSTRING_LEN(string));
+        memcpy(pprof->message.data, RSTRING_PTR(string), RSTRING_LEN(string));
+        pprof->message.length = RSTRING_LEN(string);
+    }
+    prof_pprof_write(pprof, PPROF_PROFILE_STRING_TABLE);
+    return result;
+}
+
+static void prof_pprof_value_type(prof_pprof_t* pprof, int field, VALUE type, VALUE unit)
+{
+    uint64_t type_index = prof_pprof_string(pprof, type);
+    uint64_t unit_index = prof_pprof_string(pprof, unit);
+
+    prof_pprof_int(&pprof->message, PPROF_VALUE_TYPE_TYPE, type_index);
+    prof_pprof_int(&pprof->message, PPROF_VALUE_TYPE_UNIT, unit_index);
+    prof_pprof_write(pprof, field);
+}
+
+/* Returns the id of the method's function, writing the function and its location the first
+   time the method is seen. Each function has a single location with the same id. */
+static uint64_t prof_pprof_function(prof_pprof_t* pprof, prof_method_t* method)
+{
+    st_data_t id;
+    if (rb_st_lookup(pprof->functions, method->key, &id))
+        return (uint64_t)id;
+
+    id = (st_data_t)(pprof->functions->num_entries + 1);
+    rb_st_insert(pprof->functions, method->key, id);
+
+    uint64_t name = prof_pprof_string(pprof, prof_report_full_name(pprof->report, method));
+    uint64_t filename = method->source_file == Qnil ? 0 : prof_pprof_string(pprof, rb_obj_as_string(method->source_file));
+
+    prof_pprof_int(&pprof->message, PPROF_FUNCTION_ID, id);
+    prof_pprof_int(&pprof->message, PPROF_FUNCTION_NAME, name);
+    prof_pprof_int(&pprof->message, PPROF_FUNCTION_SYSTEM_NAME, name);
+    prof_pprof_int(&pprof->message, PPROF_FUNCTION_FILENAME, filename);
+    prof_pprof_int(&pprof->message, PPROF_FUNCTION_START_LINE, method->source_line);
+    prof_pprof_write(pprof, PPROF_PROFILE_FUNCTION);
+
+    prof_pprof_int(&pprof->nested, PPROF_LINE_FUNCTION_ID, id);
+    prof_pprof_int(&pprof->nested, PPROF_LINE_LINE, method->source_line);
+    prof_pprof_int(&pprof->message, PPROF_LOCATION_ID, id);
+    prof_pprof_nested(&pprof->message, PPROF_LOCATION_LINE, &pprof->nested);
+    prof_pprof_write(pprof, PPROF_PROFILE_LOCATION);
+
+    return (uint64_t)id;
+}
+
+/* Writes a sample for the call tree at the top of the stack. pprof expects the leaf first. */
+static void prof_pprof_sample(prof_pprof_t* pprof, size_t depth, uint64_t value, uint64_t called)
+{
+    for (size_t i = depth; i > 0; i--)
+        prof_pprof_varint(&pprof->nested, pprof->stack[i - 1]);
+    prof_pprof_nested(&pprof->message, PPROF_SAMPLE_LOCATION_ID, &pprof->nested);
+
+    prof_pprof_varint(&pprof->nested, value);
+    prof_pprof_varint(&pprof->nested, called);
+    prof_pprof_nested(&pprof->message, PPROF_SAMPLE_VALUE, &pprof->nested);
+
+    prof_pprof_write(pprof, PPROF_PROFILE_SAMPLE);
+}
+
+static void prof_pprof_thread(prof_pprof_t* pprof, thread_data_t* thread_data)
+{
+    prof_call_tree_csr_t* csr = prof_thread_csr(thread_data);
+    if (csr->count > pprof->stack_capacity)
+    {
+        pprof->stack_capacity = csr->count;
+        REALLOC_N(pprof->stack, uint64_t, pprof->stack_capacity);
+        REALLOC_N(pprof->stack_ends, size_t, pprof->stack_capacity);
+    }
+
+    size_t depth = 0;
+    for (size_t i = 0; i < csr->count; i++)
+    {
+        while (depth > 0 && pprof->stack_ends[depth - 1] <= i)
+            depth--;
+
+        prof_call_tree_t* call_tree = csr->nodes[i];
+        pprof->stack[depth] = prof_pprof_function(pprof, call_tree->method);
+        pprof->stack_ends[depth] = csr->subtree_end[i];
+        depth++;
+
+        long long value = llround(call_tree->measurement.self_time * pprof->value_scale);
+        if (value > 0)
+            prof_pprof_sample(pprof, depth, (uint64_t)value, (uint64_t)call_tree->measurement.called);
+    }
+}
+
+static VALUE prof_pprof_write_profile(VALUE data)
+{
+    prof_pprof_t* pprof = (prof_pprof_t*)data;
+    prof_report_t* report = pprof->report;
+
+    // The first entry of the string table must be the empty string
+    prof_pprof_string(pprof, rb_str_new_cstr(""));
+
+    // Samples have the measured self value and the number of calls
+    prof_pprof_value_type(pprof, PPROF_PROFILE_SAMPLE_TYPE, pprof->sample_type, pprof->sample_unit);
+    prof_pprof_value_type(pprof, PPROF_PROFILE_SAMPLE_TYPE, rb_str_new_cstr("calls"), rb_str_new_cstr("count"));
+    prof_pprof_value_type(pprof, PPROF_PROFILE_PERIOD_TYPE, pprof->sample_type, pprof->sample_unit);
+    prof_pprof_int(&pprof->header, PPROF_PROFILE_PERIOD, 1);
+    rb_str_cat(report->buffer, (const char*)pprof->header.data, pprof->header.length);
+    pprof->header.length = 0;
+
+    for (long i = 0; i < RARRAY_LEN(pprof->threads); i++)
+        prof_pprof_thread(pprof, prof_get_thread(rb_ary_entry(pprof->threads, i)));
+
+    prof_report_flush(report);
+    return Qnil;
+}
+
+static VALUE prof_pprof_free(VALUE data)
+{
+    prof_pprof_t* pprof = (prof_pprof_t*)data;
+    prof_report_release(pprof->report);
+    rb_st_free_table(pprof->functions);
+    xfree(pprof->header.data);
+    xfree(pprof->message.data);
+    xfree(pprof->nested.data);
+    xfree(pprof->stack);
+    xfree(pprof->stack_ends);
+    return Qnil;
+}
+
+/* ======  Columns  ====== */
+/* Tables are written as columns of little endian values, see prof_report_print_columns */
+#define COLUMNS_MAGIC "RPCOLUMN"
+#define COLUMNS_VERSION 1
+
+typedef enum
+{
+    COLUMN_UINT64 = 1,
+    COLUMN_INT64 = 2,
+    COLUMN_FLOAT64 = 3,
+    COLUMN_STRING = 4
+} prof_columns_type_t;
+
+typedef enum
+{
+    COLUMNS_METHODS,
+    COLUMNS_EDGES,
+    COLUMNS_ALLOCATIONS
+} prof_columns_table_t;
+
+typedef struct prof_columns_column_t
+{
+    const char* name;
+    prof_columns_type_t type;
+} prof_columns_column_t;
+
+typedef union prof_columns_value_t
+{
+    uint64_t uint64;
+    int64_t int64;
+    double float64;
+    VALUE string;
+} prof_columns_value_t;
+
+/* A row points at the method, aggregated callee or allocation it was collected from */
+typedef struct prof_columns_row_t
+{
+    thread_data_t* thread_data;
+    prof_method_t* method;
+    prof_call_tree_t* callee;
+    prof_allocation_t* allocation;
+} prof_columns_row_t;
+
+typedef struct prof_columns_t
+{
+    prof_report_t* report;
+    VALUE threads;
+    prof_columns_table_t table;
+    const prof_columns_column_t* columns;
+    size_t columns_count;
+    thread_data_t* thread_data;
+    prof_method_t* method;
+    prof_columns_row_t* rows;
+    size_t rows_count;
+    size_t rows_capacity;
+    uint64_t offset;                // Bytes written so far, used to align columns
+} prof_columns_t;
+
+static const prof_columns_column_t prof_columns_methods[] =
+{
+    { "thread", COLUMN_UINT64 },
+    { "id", COLUMN_UINT64 },
+    { "class", COLUMN_STRING },
+    { "name", COLUMN_STRING },
+    { "file", COLUMN_STRING },
+    { "line", COLUMN_INT64 },
+    { "called", COLUMN_UINT64 },
+    { "total", COLUMN_FLOAT64 },
+    { "self", COLUMN_FLOAT64 },
+    { "wait", COLUMN_FLOAT64 },
+    { "children", COLUMN_FLOAT64 }
+};
+
+static const prof_columns_column_t prof_columns_edges[] =
+{
+    { "thread", COLUMN_UINT64 },
+    { "caller", COLUMN_UINT64 },
+    { "callee", COLUMN_UINT64 },
+    { "calls", COLUMN_UINT64 },
+    { "total", COLUMN_FLOAT64 },
+    { "self", COLUMN_FLOAT64 },
+    { "wait", COLUMN_FLOAT64 },
+    { "children", COLUMN_FLOAT64 }
+};
+
+static const prof_columns_column_t prof_columns_allocations[] =
+{
+    { "thread", COLUMN_UINT64 },
+    { "method", COLUMN_UINT64 },
+    { "class", COLUMN_STRING },
+    { "file", COLUMN_STRING },
+    { "line", COLUMN_INT64 },
+    { "count", COLUMN_UINT64 },
+    { "bytes", COLUMN_UINT64 }
+};
+
+static VALUE prof_columns_string(VALUE value)
+{
+    return value == Qnil ? rb_str_new_cstr("") : rb_obj_as_string(value);
+}
+
+/* Returns the class name as it appears in full names, so class and name can be joined with a # */
+static VALUE prof_columns_klass_name(VALUE klass_name, unsigned int klass_flags)
+{
+    switch (klass_flags)
+    {
+    case kClassSingleton:
+        return rb_sprintf("<Class::%" PRIsVALUE ">", klass_name);
+    case kModuleSingleton:
+        return rb_sprintf("<Module::%" PRIsVALUE ">", klass_name);
+    case kObjectSingleton:
+        return rb_sprintf("<Object::%" PRIsVALUE ">", klass_name);
+    default:
+        return prof_columns_string(klass_name);
+    }
+}
+
+static prof_columns_value_t prof_columns_value(prof_columns_t* columns, prof_columns_row_t* row, size_t column)
+{
+    prof_columns_value_t result = { 0 };
+    prof_method_t* method = row->method;
+
+    // Every table starts with the thread the row belongs to
+    if (column == 0)
+    {
+        result.uint64 = NUM2ULL(row->thread_data->fiber_id);
+        return result;
+    }
+
+    switch (columns->table)
+    {
+        case COLUMNS_METHODS:
+            switch (column)
+            {
+                case 1: result.uint64 = (uint64_t)method->key; break;
+                case 2:
+                    if (method->klass_name == Qnil)
+                        method->klass_name = resolve_klass_name(method->klass, &method->klass_flags);
+                    result.string = prof_columns_klass_name(method->klass_name, method->klass_flags);
+                    break;
+                case 3: result.string = prof_columns_string(method->method_name); break;
+                case 4: result.string = prof_columns_string(method->source_file); break;
+                case 5: result.int64 = method->source_line; break;
+                case 6: result.uint64 = (uint64_t)method->measurement.called; break;
+                case 7: result.float64 = method->measurement.total_time; break;
+                case 8: result.float64 = method->measurement.self_time; break;
+                case 9: result.float64 = method->measurement.wait_time; break;
+                default: result.float64 = prof_report_children_time(&method->measurement); break;
+            }
+            break;
+
+        case COLUMNS_EDGES:
+        {
+            prof_measurement_t* measurement = &row->callee->measurement;
+            switch (column)
+            {
+                case 1: result.uint64 = (uint64_t)method->key; break;
+                case 2: result.uint64 = (uint64_t)row->callee->method->key; break;
+                case 3: result.uint64 = (uint64_t)measurement->called; break;
+                case 4: result.float64 = measurement->total_time; break;
+                case 5: result.float64 = measurement->self_time; break;
+                case 6: result.float64 = measurement->wait_time; break;
+                default: result.float64 = prof_report_children_time(measurement); break;
+            }
+            break;
+        }
+
+        case COLUMNS_ALLOCATIONS:
+        {
+            prof_allocation_t* allocation = row->allocation;
+            switch (column)
+            {
+                case 1: result.uint64 = (uint64_t)method->key; break;
+                case 2:
+                    if (allocation->klass_name == Qnil)
+                        allocation->klass_name = resolve_klass_name(allocation->klass, &allocation->klass_flags);
+                    result.string = prof_columns_klass_name(allocation->klass_name, allocation->klass_flags);
+                    break;
+                case 3: result.string = prof_columns_string(allocation->source_file); break;
+                case 4: result.int64 = allocation->source_line; break;
+                case 5: result.uint64 = (uint64_t)allocation->count; break;
+                default: result.uint64 = (uint64_t)allocation->memory; break;
+            }
+            break;
+        }
+    }
+    return result;
+}
+
+static void prof_columns_add_row(prof_columns_t* columns, prof_call_tree_t* callee, prof_allocation_t* allocation)
+{
+    if (columns->rows_count == columns->rows_capacity)
+    {
+        columns->rows_capacity = columns->rows_capacity == 0 ? 256 : columns->rows_capacity * 2;
+        REALLOC_N(columns->rows, prof_columns_row_t, columns->rows_capacity);
+    }
+
+    prof_columns_row_t* row = &columns->rows[columns->rows_count++];
+    row->thread_data = columns->thread_data;
+    row->method = columns->method;
+    row->callee = callee;
+    row->allocation = allocation;
+}
+
+static int prof_columns_collect_allocations(st_data_t key, st_data_t value, st_data_t data)
+{
+    prof_columns_add_row((prof_columns_t*)data, NULL, (prof_allocation_t*)value);
+    return ST_CONTINUE;
+}
+
+static int prof_columns_collect_rows(st_data_t key, st_data_t value, st_data_t data)
+{
+    prof_columns_t* columns = (prof_columns_t*)data;
+    prof_method_t* method = (prof_method_t*)value;
+    columns->method = method;
+
+    switch (columns->table)
+    {
+        case COLUMNS_METHODS:
+            prof_columns_add_row(columns, NULL, NULL);
+            break;
+
+        case COLUMNS_EDGES:
+            prof_call_trees_build_aggregates(method->call_trees);
+            for (size_t i = 0; i < method->call_trees->callees_count; i++)
+                prof_columns_add_row(columns, method->call_trees->callees[i], NULL);
+            break;
+
+        case COLUMNS_ALLOCATIONS:
+            rb_st_foreach(method->allocations_table, prof_columns_collect_allocations, data);
+            break;
+    }
+    return ST_CONTINUE;
+}
+
+static void prof_columns_bytes(prof_columns_t* columns, const void* data, size_t length)
+{
+    rb_str_cat(columns->report->buffer, (const char*)data, length);
+    columns->offset += length;
+    prof_report_check_flush(columns->report);
+}
+
+static void prof_columns_uint64(prof_columns_t* columns, uint64_t value)
+{
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; i++)
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    prof_columns_bytes(columns, bytes, sizeof(bytes));
+}
+
+static void prof_columns_uint32(prof_columns_t* columns, uint32_t value)
+{
+    uint8_t bytes[4];
+    for (int i = 0; i < 4; i++)
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    prof_columns_bytes(columns, bytes, sizeof(bytes));
+}
+
+/* Pads the output with zeros so the next column starts at a multiple of 8 bytes */
+static void prof_columns_align(prof_columns_t* columns)
+{
+    static const uint8_t zeros[8] = { 0 };
+    if (columns->offset % 8 != 0)
+        prof_columns_bytes(columns, zeros, 8 - columns->offset % 8);
+}
+
+static void prof_columns_header(prof_columns_t* columns)
+{
+    prof_columns_bytes(columns, COLUMNS_MAGIC, strlen(COLUMNS_MAGIC));
+    prof_columns_uint32(columns, COLUMNS_VERSION);
+    prof_columns_uint32(columns, (uint32_t)columns->columns_count);
+    prof_columns_uint64(columns, columns->rows_count);
+
+    for (size_t i = 0; i < columns->columns_count; i++)
+    {
+        uint8_t type_and_length[2] = { (uint8_t)columns->columns[i].type, (uint8_t)strlen(columns->columns[i].name) };
+        prof_columns_bytes(columns, type_and_length, sizeof(type_and_length));
+        prof_columns_bytes(columns, columns->columns[i].name, type_and_length[1]);
+    }
+    prof_columns_align(columns);
+}
+
+/* Strings are written as rows + 1 offsets followed by the concatenated bytes */
+static void prof_columns_strings(prof_columns_t* columns, size_t column)
+{
+    uint64_t offset = 0;
+    prof_columns_uint64(columns, offset);
+    for (size_t i = 0; i < columns->rows_count; i++)
+    {
+        offset += RSTRING_LEN(prof_columns_value(columns, &columns->rows[i], column).string);
+        prof_columns_uint64(columns, offset);
+    }
+
+    for (size_t i = 0; i < columns->rows_count; i++)
+    {
+        VALUE string = prof_columns_value(columns, &columns->rows[i], column).string;
+        prof_columns_bytes(columns, RSTRING_PTR(string), RSTRING_LEN(string));
+        RB_GC_GUARD(string);
+    }
+    prof_columns_align(columns);
+}
+
+static VALUE prof_columns_write(VALUE data)
+{
+    prof_columns_t* columns = (prof_columns_t*)data;
+
+    for (long i = 0; i < RARRAY_LEN(columns->threads); i++)
+    {
+        columns->thread_data = prof_get_thread(rb_ary_entry(columns->threads, i));
+        rb_st_foreach(columns->thread_data->method_table, prof_columns_collect_rows, (st_data_t)columns);
+    }
+
+    prof_columns_header(columns);
+
+    for (size_t column = 0; column < columns->columns_count; column++)
+    {
+        if (columns->columns[column].type == COLUMN_STRING)
+        {
+            prof_columns_strings(columns, column);
+            continue;
+        }
+
+        for (size_t i = 0; i < columns->rows_count; i++)
+        {
+            prof_columns_value_t value = prof_columns_value(columns, &columns->rows[i], column);
+            if (columns->columns[column].type == COLUMN_FLOAT64)
+            {
+                uint64_t bits;
+                memcpy(&bits, &value.float64, sizeof(bits));
+                prof_columns_uint64(columns, bits);
+            }
+            else
+            {
+                // int64 values are written as their two's complement bits
+                prof_columns_uint64(columns, value.uint64);
+            }
+        }
+    }
+
+    prof_report_flush(columns->report);
+    return Qnil;
+}
+
+static VALUE prof_columns_free(VALUE data)
+{
+    prof_columns_t* columns = (prof_columns_t*)data;
+    prof_report_release(columns->report);
+    xfree(columns->rows);
+    return Qnil;
+}
+
+/* ======  RubyProf::Report  ====== */
+typedef void (*prof_report_row_writer)(prof_report_t* report, prof_report_row_t* row, double total_time);
+
+typedef struct prof_report_args_t
+{
+    prof_report_t* report;
+    prof_report_row_writer writer;
+    thread_data_t* thread_data;
+    prof_report_field_t sort_field;
+    prof_report_field_t filter_field;
+    double min_percent;
+    double max_percent;
+} prof_report_args_t;
+
+static VALUE prof_report_write(VALUE data)
+{
+    prof_report_args_t* args = (prof_report_args_t*)data;
+    prof_report_t* report = args->report;
+    thread_data_t* thread_data = args->thread_data;
+    double total_time = thread_data->call_tree ? thread_data->call_tree->measurement.total_time : 0;
+
+    prof_report_rows(report, thread_data, args->sort_field, args->filter_field, args->min_percent, args->max_percent);
+
+    for (size_t i = 0; i < report->rows_count; i++)
+    {
+        args->writer(report, &report->rows[i], total_time);
+        prof_report_check_flush(report);
+    }
+    prof_report_flush(report);
+    return Qnil;
+}
+
+static VALUE prof_report_free(VALUE data)
+{
+    prof_report_args_t* args = (prof_report_args_t*)data;
+    prof_report_release(args->report);
+    return Qnil;
+}
+
+static VALUE prof_report_print(VALUE thread, VALUE output, VALUE options, prof_report_row_writer writer,
+                               prof_report_field_t default_sort_field, prof_report_field_t default_filter_field,
+                               bool filter_max_percent)
+{
+    thread_data_t* thread_data = prof_get_thread(thread);
+
+    prof_report_field_t sort_field = default_sort_field;
+    prof_report_field_t filter_field = default_filter_field;
+    double min_percent = 0;
+    double max_percent = 100;
+
+    if (options != Qnil)
+    {
+        Check_Type(options, T_HASH);
+        sort_field = prof_report_field(rb_hash_aref(options, ID2SYM(rb_intern("sort_method"))), default_sort_field);
+        if (filter_max_percent)
+            filter_field = prof_report_field(rb_hash_aref(options, ID2SYM(rb_intern("filter_by"))), default_filter_field);
+
+        VALUE value = rb_hash_aref(options, ID2SYM(rb_intern("min_percent")));
+        if (value != Qnil)
+            min_percent = NUM2DBL(value);
+
+        value = rb_hash_aref(options, ID2SYM(rb_intern("max_percent")));
+        if (value != Qnil && filter_max_percent)
+            max_percent = NUM2DBL(value);
+    }
+
+    // The graph report only filters by min_percent
+    if (!filter_max_percent)
+        max_percent = INFINITY;
+
+    prof_report_t report;
+    prof_report_init(&report, output);
+
+    prof_report_args_t args;
+    args.report = &report;
+    args.writer = writer;
+    args.thread_data = thread_data;
+    args.sort_field = sort_field;
+    args.filter_field = filter_field;
+    args.min_percent = min_percent;
+    args.max_percent = max_percent;
+
+    rb_ensure(prof_report_write, (VALUE)&args, prof_report_free, (VALUE)&args);
+
+    RB_GC_GUARD(report.names);
+    RB_GC_GUARD(report.buffer);
+    return output;
+}
+
+/* call-seq:
+   print_flat(thread, output, options = {}) -> output
+
+Writes the rows of a flat report for the thread to output. Options are the same as the
+FlatPrinter's, :sort_method and :filter_by can be :total_time, :self_time, :wait_time,
+:children_time or :called. */
+static VALUE prof_report_print_flat(int argc, VALUE* argv, VALUE self)
+{
+    VALUE thread, output, options;
+    rb_scan_args(argc, argv, "21", &thread, &output, &options);
+    return prof_report_print(thread, output, options, prof_report_flat_row, REPORT_SELF_TIME, REPORT_SELF_TIME, true);
+}
+
+/* call-seq:
+   print_graph(thread, output, options = {}) -> output
+
+Writes the rows of a graph report for the thread to output. Each method is printed with its
+callers and callees. Methods whose total time is less than :min_percent of the thread's total
+time are skipped. */
+static VALUE prof_report_print_graph(int argc, VALUE* argv, VALUE self)
+{
+    VALUE thread, output, options;
+    rb_scan_args(argc, argv, "21", &thread, &output, &options);
+    return prof_report_print(thread, output, options, prof_report_graph_row, REPORT_TOTAL_TIME, REPORT_TOTAL_TIME, false);
+}
+
+/* call-seq:
+   print_callgrind(thread, output, value_scale) -> output
+
+Writes the methods of the thread to output in callgrind format, without the header. Measurements
+are multiplied by value_scale and rounded. File and function names are compressed and positions
+are lines, so the header must include "positions: line". */
+static VALUE prof_report_print_callgrind(VALUE self, VALUE thread, VALUE output, VALUE value_scale)
+{
+    prof_report_t report;
+    prof_report_init(&report, output);
+
+    prof_callgrind_t callgrind;
+    callgrind.report = &report;
+    callgrind.thread_data = prof_get_thread(thread);
+    callgrind.value_scale = NUM2DBL(value_scale);
+    callgrind.files = rb_hash_new();
+    callgrind.method_files = rb_st_init_numtable();
+    callgrind.functions = rb_st_init_numtable();
+    callgrind.last_line = 0;
+    callgrind.has_last_line = false;
+
+    rb_ensure(prof_callgrind_write, (VALUE)&callgrind, prof_callgrind_free, (VALUE)&callgrind);
+
+    RB_GC_GUARD(callgrind.files);
+    RB_GC_GUARD(report.names);
+    RB_GC_GUARD(report.buffer);
+    return output;
+}
+
+/* call-seq:
+   print_flame_graph(thread, output, value_scale) -> output
+
+Writes the call tree of the thread to output as collapsed stacks, one line per call tree with
+its semicolon separated path from the root followed by its self value. Values are multiplied
+by value_scale and rounded, lines with a value of zero are skipped. */
+static VALUE prof_report_print_flame_graph(VALUE self, VALUE thread, VALUE output, VALUE value_scale)
+{
+    prof_report_t report;
+    prof_report_init(&report, output);
+
+    prof_flame_graph_t flame_graph;
+    flame_graph.report = &report;
+    flame_graph.csr = prof_thread_csr(prof_get_thread(thread));
+    flame_graph.value_scale = NUM2DBL(value_scale);
+    flame_graph.path = rb_str_buf_new(1024);
+    flame_graph.frames = ALLOC_N(prof_flame_graph_frame_t, flame_graph.csr->count > 0 ? flame_graph.csr->count : 1);
+
+    rb_ensure(prof_flame_graph_write, (VALUE)&flame_graph, prof_flame_graph_free, (VALUE)&flame_graph);
+
+    RB_GC_GUARD(flame_graph.path);
+    RB_GC_GUARD(report.names);
+    RB_GC_GUARD(report.buffer);
+    return output;
+}
+
+/* call-seq:
+   print_dot(thread, output, options = {}) -> output
+
+Writes the methods of the thread to output as a dot subgraph, followed by a cluster for each
+class unless :clusters is false. Nodes are the methods whose total time is at least :min_percent
+of the thread's total time, at most :max_nodes of them. Edges whose total time is less than
+:edge_percent are left out, and calls to or from the methods that are not nodes are combined
+into edges to or from a single node. */
+static VALUE prof_report_print_dot(int argc, VALUE* argv, VALUE self)
+{
+    VALUE thread, output, options;
+    rb_scan_args(argc, argv, "21", &thread, &output, &options);
+
+    prof_report_t report;
+    prof_report_init(&report, output);
+
+    prof_dot_t dot;
+    memset(&dot, 0, sizeof(dot));
+    dot.report = &report;
+    dot.thread_data = prof_get_thread(thread);
+    dot.max_nodes = SIZE_MAX;
+    dot.clusters = true;
+    dot.total_time = dot.thread_data->call_tree ? dot.thread_data->call_tree->measurement.total_time : 0;
+    dot.nodes = rb_st_init_numtable();
+
+    if (options != Qnil)
+    {
+        Check_Type(options, T_HASH);
+
+        VALUE value = rb_hash_aref(options, ID2SYM(rb_intern("min_percent")));
+        if (value != Qnil)
+            dot.min_percent = NUM2DBL(value);
+
+        value = rb_hash_aref(options, ID2SYM(rb_intern("edge_percent")));
+        if (value != Qnil)
+            dot.edge_percent = NUM2DBL(value);
+
+        value = rb_hash_aref(options, ID2SYM(rb_intern("max_nodes")));
+        if (value != Qnil)
+            dot.max_nodes = NUM2SIZET(value);
+
+        value = rb_hash_aref(options, ID2SYM(rb_intern("clusters")));
+        if (value != Qnil)
+            dot.clusters = RTEST(value);
+    }
+
+    rb_ensure(prof_dot_write, (VALUE)&dot, prof_dot_free, (VALUE)&dot);
+
+    RB_GC_GUARD(report.names);
+    RB_GC_GUARD(report.buffer);
+    return output;
+}
+
+/* call-seq:
+   print_call_stack(thread, output) -> output
+
+Writes the call tree of the thread to output as JSON for the call stack viewer. The call trees
+are written in a single pass as a flat array with their method, the end of their subtree, total
+time and calls, followed by the name, file, line and total calls of their methods. */
+static VALUE prof_report_print_call_stack(VALUE self, VALUE thread, VALUE output)
+{
+    prof_report_t report;
+    prof_report_init(&report, output);
+
+    prof_call_stack_t call_stack;
+    memset(&call_stack, 0, sizeof(call_stack));
+    call_stack.report = &report;
+    call_stack.thread_data = prof_get_thread(thread);
+    call_stack.method_ids = rb_st_init_numtable();
+
+    rb_ensure(prof_call_stack_write, (VALUE)&call_stack, prof_call_stack_free, (VALUE)&call_stack);
+
+    RB_GC_GUARD(report.names);
+    RB_GC_GUARD(report.buffer);
+    return output;
+}
+
+/* call-seq:
+   print_speedscope(threads, output, name, unit) -> output
+
+Writes the threads to output as a speedscope evented profile, with one profile per thread and
+fiber. Events are replayed from the events recorded by a profile created with record_events,
+otherwise they are laid out from the call tree and the name of the profile says they were
+synthesized. Frames are shared by all profiles and unit is the speedscope unit of the
+measurements, such as "seconds". */
+static VALUE prof_report_print_speedscope(VALUE self, VALUE threads, VALUE output, VALUE name, VALUE unit)
+{
+    Check_Type(threads, T_ARRAY);
+
+    prof_report_t report;
+    prof_report_init(&report, output);
+
+    prof_speedscope_t speedscope;
+    memset(&speedscope, 0, sizeof(speedscope));
+    speedscope.report = &report;
+    speedscope.threads = threads;
+    speedscope.name = StringValue(name);
+    speedscope.unit = StringValueCStr(unit);
+    speedscope.frame_ids = rb_st_init_numtable();
+
+    rb_ensure(prof_speedscope_write, (VALUE)&speedscope, prof_speedscope_free, (VALUE)&speedscope);
+
+    RB_GC_GUARD(unit);
+    RB_GC_GUARD(report.names);
+    RB_GC_GUARD(report.buffer);
+    return output;
+}
+
+/* call-seq:
+   print_chrome_trace(threads, output, options = {}) -> output
+
+Writes the threads to output in the Chrome trace event format, which can be viewed with
+Perfetto or chrome://tracing. Each Ruby thread is a process and each of its fibers a thread,
+and every method call is a complete event. Events are replayed from the events recorded by a
+profile created with record_events. Threads without recorded events are left out, since laying
+them out from the call tree would show threads interleaving in ways they never did. Options are:
+
+  :value_scale  - Number that measurements are multiplied by to get microseconds, defaults to 1.
+  :min_duration - Calls shorter than this, before scaling, are left out. Defaults to 0.
+  :max_events   - Maximum number of calls to write. */
+static VALUE prof_report_print_chrome_trace(int argc, VALUE* argv, VALUE self)
+{
+    VALUE threads, output, options;
+    rb_scan_args(argc, argv, "21", &threads, &output, &options);
+    Check_Type(threads, T_ARRAY);
+
+    prof_report_t report;
+    prof_report_init(&report, output);
+
+    prof_chrome_trace_t trace;
+    memset(&trace, 0, sizeof(trace));
+    trace.report = &report;
+    trace.threads = threads;
+    trace.value_scale = 1;
+    trace.max_events = SIZE_MAX;
+    trace.first = true;
+
+    if (options != Qnil)
+    {
+        Check_Type(options, T_HASH);
+
+        VALUE value = rb_hash_aref(options, ID2SYM(rb_intern("value_scale")));
+        if (value != Qnil)
+            trace.value_scale = NUM2DBL(value);
+
+        value = rb_hash_aref(options, ID2SYM(rb_intern("min_duration")));
+        if (value != Qnil)
+            trace.min_duration = NUM2DBL(value);
+
+        value = rb_hash_aref(options, ID2SYM(rb_intern("max_events")));
+        if (value != Qnil)
+            trace.max_events = NUM2SIZET(value);
+    }
+
+    rb_ensure(prof_chrome_trace_write, (VALUE)&trace, prof_chrome_trace_free, (VALUE)&trace);
+
+    RB_GC_GUARD(report.names);
+    RB_GC_GUARD(report.buffer);
+    return output;
+}
+
+/* call-seq:
+   print_pprof(threads, output, sample_type, sample_unit, value_scale) -> output
+
+Writes the call trees of the threads to output as an uncompressed pprof profile.proto message.
+Each call tree with a self value is a sample whose locations are its path from the root, with
+the self value multiplied by value_scale and rounded, and the number of calls as its values.
+The message is written in chunks so output can compress it as it goes, for example a
+RubyProf::CompressedWriter. */
+static VALUE prof_report_print_pprof(VALUE self, VALUE threads, VALUE output, VALUE sample_type, VALUE sample_unit,
+                                     VALUE value_scale)
+{
+    Check_Type(threads, T_ARRAY);
+
+    prof_report_t report;
+    prof_report_init(&report, output);
+
+    prof_pprof_t pprof;
+    memset(&pprof, 0, sizeof(pprof));
+    pprof.report = &report;
+    pprof.threads = threads;
+    pprof.sample_type = StringValue(sample_type);
+    pprof.sample_unit = StringValue(sample_unit);
+    pprof.value_scale = NUM2DBL(value_scale);
+    pprof.strings = rb_hash_new();
+    pprof.functions = rb_st_init_numtable();
+
+    rb_ensure(prof_pprof_write_profile, (VALUE)&pprof, prof_pprof_free, (VALUE)&pprof);
+
+    RB_GC_GUARD(pprof.strings);
+    RB_GC_GUARD(report.names);
+    RB_GC_GUARD(report.buffer);
+    return output;
+}
+
+/* call-seq:
+   print_columns(threads, output, table) -> output
+
+Writes a table of the threads' aggregated call graph to output in a columnar binary
+format. Table is :methods, :edges (one row per caller and callee) or :allocations.
+
+All numbers are little endian. The file starts with the magic bytes "RPCOLUMN", a uint32
+version, a uint32 column count and a uint64 row count, followed by each column's uint8 type
+(1 uint64, 2 int64, 3 float64, 4 string), uint8 name length and name. Then comes the data of
+each column in turn, starting at a multiple of 8 bytes: rows values of 8 bytes, or for strings
+rows + 1 uint64 offsets followed by the bytes of the strings. Methods are identified by the
+same id in all three tables. */
+static VALUE prof_report_print_columns(VALUE self, VALUE threads, VALUE output, VALUE table)
+{
+    Check_Type(threads, T_ARRAY);
+
+    prof_report_t report;
+    prof_report_init(&report, output);
+
+    prof_columns_t columns;
+    memset(&columns, 0, sizeof(columns));
+    columns.report = &report;
+    columns.threads = threads;
+
+    if (table == ID2SYM(rb_intern("methods")))
+    {
+        columns.table = COLUMNS_METHODS;
+        columns.columns = prof_columns_methods;
+        columns.columns_count = sizeof(prof_columns_methods) / sizeof(prof_columns_column_t);
+    }
+    else if (table == ID2SYM(rb_intern("edges")))
+    {
+        columns.table = COLUMNS_EDGES;
+        columns.columns = prof_columns_edges;
+        columns.columns_count = sizeof(prof_columns_edges) / sizeof(prof_columns_column_t);
+    }
+    else if (table == ID2SYM(rb_intern("allocations")))
+    {
+        columns.table = COLUMNS_ALLOCATIONS;
+        columns.columns = prof_columns_allocations;
+        columns.columns_count = sizeof(prof_columns_allocations) / sizeof(prof_columns_column_t);
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "Unsupported table: %" PRIsVALUE, rb_inspect(table));
+    }
+
+    rb_ensure(prof_columns_write, (VALUE)&columns, prof_columns_free, (VALUE)&columns);
+
+    RB_GC_GUARD(report.names);
+    RB_GC_GUARD(report.buffer);
+    return output;
+}
+
+void rp_init_report(void)
+{
+    id_append = rb_intern("<<");
+    id_total_time = rb_intern("total_time");
+    id_self_time = rb_intern("self_time");
+    id_wait_time = rb_intern("wait_time");
+    id_children_time = rb_intern("children_time");
+    id_called = rb_intern("called");
+
+    mRpReport = rb_define_module_under(mProf, "Report");
+    rb_define_module_function(mRpReport, "print_flat", prof_report_print_flat, -1);
+    rb_define_module_function(mRpReport, "print_graph", prof_report_print_graph, -1);
+    rb_define_module_function(mRpReport, "print_callgrind", prof_report_print_callgrind, 3);
+    rb_define_module_function(mRpReport, "print_flame_graph", prof_report_print_flame_graph, 3);
+    rb_define_module_function(mRpReport, "print_dot", prof_report_print_dot, -1);
+    rb_define_module_function(mRpReport, "print_call_stack", prof_report_print_call_stack, 2);
+    rb_define_module_function(mRpReport, "print_speedscope", prof_report_print_speedscope, 4);
+    rb_define_module_function(mRpReport, "print_chrome_trace", prof_report_print_chrome_trace, -1);
+    rb_define_module_function(mRpReport, "print_pprof", prof_report_print_pprof, 5);
+    rb_define_module_function(mRpReport, "print_columns", prof_report_print_columns, 3);
+
+    /* Fields that reports can be sorted and filtered by */
+    VALUE fields = rb_ary_new_from_args(5, ID2SYM(id_total_time), ID2SYM(id_self_time), ID2SYM(id_wait_time),
+                                        ID2SYM(id_children_time), ID2SYM(id_called));
+    rb_define_const(mRpReport, "FIELDS", rb_obj_freeze(fields));
+}
@@ -0,0 +1,13 @@
+/* Copyright (C) 2005-2019 Shugo Maeda <shugo@ruby-lang.org> and Charlie Savage <cfis@savagexi.com>
+   Please see the LICENSE file for copyright and distribution information */
+
+#ifndef __RP_REPORT_H__
+#define __RP_REPORT_H__
+
+#include "ruby_prof.h"
+
+extern VALUE mRpReport;
+
+void rp_init_report(void);
+
+#endif //__RP_REPORT_H__
@@ -105,17 +105,18 @@ prof_frame_t* prof_frame_push(prof_stack_t* stack, prof_call_tree_t* call_tree,
     result->wait_time = 0;
     result->child_time = 0;
     result->dead_time = 0;
+    result->wait_reason = 0;
     result->source_file = Qnil;
     result->source_line = 0;
 
-    call_tree->measurement->called++;
+    call_tree->measurement.called++;
     call_tree->visits++;
 
     if (call_tree->method->visits > 0)
     {
         call_tree->method->recursive = true;
     }
-    call_tree->method->measurement->called++;
+    call_tree->method->measurement.called++;
     call_tree->method->visits++;
 
     // Unpause the parent frame, if it exists.
@@ -139,12 +140,12 @@ prof_frame_t* prof_frame_unshift(prof_stack_t* stack, prof_call_tree_t* parent_c
     if (prof_stack_last(stack))
         rb_raise(rb_eRuntimeError, "Stack unshift can only be called with an empty stack");
 
-    parent_call_tree->measurement->total_time = call_tree->measurement->total_time;
-    parent_call_tree->measurement->self_time = 0;
-    parent_call_tree->measurement->wait_time = call_tree->measurement->wait_time;
+    parent_call_tree->measurement.total_time = call_tree->measurement.total_time;
+    parent_call_tree->measurement.self_time = 0;
+    parent_call_tree->measurement.wait_time = call_tree->measurement.wait_time;
 
-    parent_call_tree->method->measurement->total_time += call_tree->measurement->total_time;
-    parent_call_tree->method->measurement->wait_time += call_tree->measurement->wait_time;
+    parent_call_tree->method->measurement.total_time += call_tree->measurement.total_time;
+    parent_call_tree->method->measurement.wait_time += call_tree->measurement.wait_time;
 
     return prof_frame_push(stack, parent_call_tree, measurement, false);
 }
@@ -166,18 +167,18 @@ prof_frame_t* prof_frame_pop(prof_stack_t* stack, double measurement)
     prof_call_tree_t* call_tree = frame->call_tree;
 
     // Update method measurement
-    call_tree->method->measurement->self_time += self_time;
-    call_tree->method->measurement->wait_time += frame->wait_time;
+    call_tree->method->measurement.self_time += self_time;
+    call_tree->method->measurement.wait_time += frame->wait_time;
     if (call_tree->method->visits == 1)
-        call_tree->method->measurement->total_time += total_time;
+        call_tree->method->measurement.total_time += total_time;
 
     call_tree->method->visits--;
 
     // Update method measurement
-    call_tree->measurement->self_time += self_time;
-    call_tree->measurement->wait_time += frame->wait_time;
+    call_tree->measurement.self_time += self_time;
+    call_tree->measurement.wait_time += frame->wait_time;
     if (call_tree->visits == 1)
-        call_tree->measurement->total_time += total_time;
+        call_tree->measurement.total_time += total_time;
 
     call_tree->visits--;
 
@@ -25,6 +25,7 @@ typedef struct prof_frame_t
     double child_time;
     double pause_time; // Time pause() was initiated
     double dead_time; // Time to ignore (i.e. total amount of time between pause/resume blocks)
+    ID wait_reason; // Fiber scheduler hook this frame is running (io_wait, kernel_sleep, block), or 0
 } prof_frame_t;
 
 #define prof_frame_is_paused(f) (f->pause_time >= 0)
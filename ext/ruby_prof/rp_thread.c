@@ -16,9 +16,17 @@ You cannot create an instance of RubyProf::Thread, instead you access it from a
     end
   end */
 
+#include "rp_call_trees.h"
 #include "rp_thread.h"
 #include "rp_profile.h"
 
+#include <ruby/thread.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#define POST_PROCESS_WORKERS 4
+
 VALUE cRpThread;
 
 // ======   thread_data_t  ======
@@ -34,6 +42,12 @@ thread_data_t* thread_data_create(void)
     result->thread_id = Qnil;
     result->trace = true;
     result->fiber = Qnil;
+    result->merge_target = NULL;
+    result->merge_call_tree = NULL;
+    result->merge_sources = 0;
+    result->in_wait_hook = false;
+    result->csr = NULL;
+    result->event_log = NULL;
     return result;
 }
 
@@ -100,7 +114,18 @@ static void prof_thread_free(thread_data_t* thread_data)
     if (thread_data->call_tree)
         prof_call_tree_free(thread_data->call_tree);
 
-    prof_stack_free(thread_data->stack);
+    // Finished fibers have already freed their stack
+    if (thread_data->stack)
+        prof_stack_free(thread_data->stack);
+
+    if (thread_data->csr)
+        prof_call_tree_csr_free(thread_data->csr);
+
+    if (thread_data->event_log)
+    {
+        xfree(thread_data->event_log->events);
+        xfree(thread_data->event_log);
+    }
 
     xfree(thread_data);
 }
@@ -191,6 +216,9 @@ thread_data_t* threads_table_insert(void* prof, VALUE fiber)
     result->thread_id = rb_obj_id(thread);
     rb_st_insert(profile->threads_tbl, (st_data_t)result->fiber_id, (st_data_t)result);
 
+    if (profile->record_events)
+        result->event_log = ZALLOC(prof_event_log_t);
+
     // Are we tracing this thread?
     if (profile->include_threads_tbl && !rb_st_lookup(profile->include_threads_tbl, thread, 0))
     {
@@ -205,16 +233,57 @@ thread_data_t* threads_table_insert(void* prof, VALUE fiber)
         result->trace = true;
     }
 
+    // Are we merging this fiber into the fiber that resumed it? This requires the resuming fiber
+    // to run on the same thread and to have a frame to attach the new fiber's call tree to.
+    if (profile->merge_fibers && profile->last_thread_data &&
+        profile->last_thread_data->thread_id == result->thread_id)
+    {
+        prof_frame_t* frame = prof_frame_current(profile->last_thread_data->stack);
+        if (frame)
+        {
+            result->merge_target = profile->last_thread_data;
+            result->merge_target->merge_sources++;
+            result->merge_call_tree = frame->call_tree;
+        }
+    }
+
     return result;
 }
 
 // ======   Profiling Methods  ======
+void prof_thread_record_event(thread_data_t* thread_data, prof_method_t* method, bool enter, double measurement)
+{
+    prof_event_log_t* event_log = thread_data->event_log;
+    if (!event_log)
+        return;
+
+    if (event_log->count == event_log->capacity)
+    {
+        event_log->capacity = event_log->capacity == 0 ? 1024 : event_log->capacity * 2;
+        REALLOC_N(event_log->events, prof_event_t, event_log->capacity);
+    }
+
+    prof_event_t* event = &event_log->events[event_log->count++];
+    event->method = method;
+    event->measurement = measurement;
+    event->enter = enter;
+}
+
+/* Pops all frames off the thread's stack, for example because profiling stopped */
+void prof_thread_pop_frames(thread_data_t* thread_data, double measurement)
+{
+    prof_frame_t* frame;
+    while ((frame = prof_frame_pop(thread_data->stack, measurement)))
+        prof_thread_record_event(thread_data, frame->call_tree->method, false, measurement);
+    thread_data->in_wait_hook = false;
+}
+
 void switch_thread(void* prof, thread_data_t* thread_data, double measurement)
 {
     prof_profile_t* profile = prof;
 
     /* Get current frame for this thread */
-    prof_frame_t* frame = prof_frame_current(thread_data->stack);
+    prof_frame_t* frame = thread_data->stack ? prof_frame_current(thread_data->stack) : NULL;
     if (frame)
     {
         frame->wait_time += measurement - frame->switch_time;
@@ -223,7 +292,7 @@ void switch_thread(void* prof, thread_data_t* thread_data, double measurement)
 
     /* Save on the last thread the time of the context switch
        and reset this thread's last context switch to 0.*/
-    if (profile->last_thread_data)
+    if (profile->last_thread_data && profile->last_thread_data->stack)
     {
         prof_frame_t* last_frame = prof_frame_current(profile->last_thread_data->stack);
         if (last_frame)
@@ -233,11 +302,282 @@ void switch_thread(void* prof, thread_data_t* thread_data, double measurement)
     profile->last_thread_data = thread_data;
 }
 
+static int merge_fiber_methods(st_data_t key, st_data_t value, st_data_t data)
+{
+    prof_method_t* method = (prof_method_t*)value;
+    thread_data_t* target = (thread_data_t*)data;
+
+    prof_method_t* target_method = method_table_lookup(target->method_table, key);
+    if (target_method)
+    {
+        prof_method_merge_internal(target_method, method);
+        return ST_CONTINUE;
+    }
+    else
+    {
+        // Move the method to the target. Its call trees are rebuilt when the fiber's call tree is merged.
+        prof_call_trees_clear(method->call_trees);
+        method_table_insert(target->method_table, key, method);
+        return ST_DELETE;
+    }
+}
+
+static void merge_fiber(thread_data_t* fiber)
+{
+    thread_data_t* target = fiber->merge_target;
+
+    // First merge methods so the merged call trees reference the target's methods
+    rb_st_foreach(fiber->method_table, merge_fiber_methods, (st_data_t)target);
+
+    if (fiber->call_tree)
+        prof_call_tree_merge_child(fiber->merge_call_tree, fiber->call_tree, target->method_table);
+}
+
+static int collect_fibers(st_data_t key, st_data_t value, st_data_t data)
+{
+    thread_data_t*** fibers = (thread_data_t***)data;
+    **fibers = (thread_data_t*)value;
+    (*fibers)++;
+    return ST_CONTINUE;
+}
+
+static void remove_fiber(prof_profile_t* profile, thread_data_t* fiber)
+{
+    st_data_t key = fiber->fiber_id;
+    rb_st_delete(profile->threads_tbl, &key, NULL);
+    prof_thread_free(fiber);
+}
+
+/* Merges a finished fiber into the first finished fiber that has the same root method. */
+static void merge_dead_fiber(prof_profile_t* profile, thread_data_t* fiber)
+{
+    if (!fiber->call_tree)
+    {
+        remove_fiber(profile, fiber);
+        return;
+    }
+
+    st_data_t key = fiber->call_tree->method->key;
+    st_data_t value;
+    if (!rb_st_lookup(profile->dead_fibers_tbl, key, &value))
+    {
+        rb_st_insert(profile->dead_fibers_tbl, key, (st_data_t)fiber);
+        return;
+    }
+
+    thread_data_t* aggregate = (thread_data_t*)value;
+    rb_st_foreach(fiber->method_table, merge_fiber_methods, (st_data_t)aggregate);
+    prof_call_tree_merge_thread(aggregate->call_tree, fiber->call_tree, aggregate->method_table);
+    remove_fiber(profile, fiber);
+}
+
+/* Called when a fiber has finished running. Its stack is no longer needed, and if its results are being
+   merged that is done now instead of when the profile stops. A fiber that other fibers will be merged into
+   has to wait for them to finish first. */
+void reclaim_fiber(void* prof, thread_data_t* thread_data, double measurement)
+{
+    prof_profile_t* profile = prof;
+
+    prof_thread_pop_frames(thread_data, measurement);
+    prof_stack_free(thread_data->stack);
+    thread_data->stack = NULL;
+
+    // The fiber is not needed anymore, so let it be garbage collected
+    thread_data->fiber = Qnil;
+
+    thread_data_t* fiber = thread_data;
+    while (fiber && !fiber->stack && fiber->merge_sources == 0)
+    {
+        thread_data_t* target = fiber->merge_target;
+
+        if (target)
+        {
+            merge_fiber(fiber);
+            target->merge_sources--;
+            remove_fiber(profile, fiber);
+        }
+        else if (profile->merge_dead_fibers)
+        {
+            merge_dead_fiber(profile, fiber);
+        }
+
+        fiber = target;
+    }
+}
+
+/* Merges fibers into the fiber that resumed them, and then removes them from the threads table. Fibers
+   are always created after the fiber that resumed them, so walking the table backwards merges nested
+   fibers before their own target is merged. */
+void merge_fibers(void* prof)
+{
+    prof_profile_t* profile = prof;
+
+    size_t count = profile->threads_tbl->num_entries;
+    thread_data_t** fibers = ALLOC_N(thread_data_t*, count);
+    thread_data_t** fibers_end = fibers;
+    rb_st_foreach(profile->threads_tbl, collect_fibers, (st_data_t)&fibers_end);
+
+    for (size_t i = count; i > 0; i--)
+    {
+        thread_data_t* fiber = fibers[i - 1];
+        if (!fiber->merge_target)
+            continue;
+
+        merge_fiber(fiber);
+        remove_fiber(profile, fiber);
+    }
+
+    xfree(fibers);
+}
+
+typedef struct post_process_work_t
+{
+    thread_data_t** threads;
+    size_t count;
+    size_t start;
+    size_t step;
+    unsigned int version;
+    bool failed;
+} post_process_work_t;
+
+typedef struct post_process_t
+{
+    post_process_work_t work[POST_PROCESS_WORKERS];
+    size_t workers;
+} post_process_t;
+
+/* The nogvl functions are called without the GVL - they must not allocate Ruby memory, call Ruby
+   methods or touch VALUEs */
+static void* build_csrs_nogvl(void* data)
+{
+    post_process_work_t* work = (post_process_work_t*)data;
+
+    for (size_t i = work->start; i < work->count; i += work->step)
+    {
+        thread_data_t* thread_data = work->threads[i];
+        if (!prof_call_tree_csr_build(thread_data->csr, thread_data->call_tree, work->version))
+            work->failed = true;
+    }
+
+    return NULL;
+}
+
+/* Shares the work between native threads and waits for all of them. The calling thread takes the first
+   share. Without pthreads, or if a thread cannot be started, the shares are processed one after another. */
+static void* post_process_nogvl(void* data)
+{
+    post_process_t* process = (post_process_t*)data;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_t threads[POST_PROCESS_WORKERS];
+    bool started[POST_PROCESS_WORKERS] = { false };
+
+    for (size_t i = 1; i < process->workers; i++)
+        started[i] = pthread_create(&threads[i], NULL, build_csrs_nogvl, &process->work[i]) == 0;
+
+    build_csrs_nogvl(&process->work[0]);
+
+    for (size_t i = 1; i < process->workers; i++)
+    {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            build_csrs_nogvl(&process->work[i]);
+    }
+#else
+    for (size_t i = 0; i < process->workers; i++)
+        build_csrs_nogvl(&process->work[i]);
+#endif
+
+    return NULL;
+}
+
+/* Returns the flattened call tree of a thread, rebuilding it if the call tree has changed
+   since profiling stopped. */
+prof_call_tree_csr_t* prof_thread_csr(thread_data_t* thread_data)
+{
+    if (thread_data->call_tree)
+        prof_call_tree_check_post_processed(thread_data->call_tree);
+
+    if (!thread_data->csr)
+        thread_data->csr = prof_call_tree_csr_create();
+
+    unsigned int version = thread_data->call_tree ? prof_call_tree_version(thread_data->call_tree) : 0;
+    if (!prof_call_tree_csr_is_current(thread_data->csr, thread_data->call_tree, version) &&
+        !prof_call_tree_csr_build(thread_data->csr, thread_data->call_tree, version))
+        rb_memerror();
+
+    return thread_data->csr;
+}
+
+/* Calculates values derived from each thread's call tree once profiling has stopped. The work
+   does not need the GVL, so other Ruby threads keep running while it happens, and when more than
+   one thread was profiled the threads are processed in parallel. Aggregated callers and callees are
+   not built here, since they are wrapped in Ruby objects. They are built, and sorted by the reports,
+   under the GVL when first used. */
+void post_process_threads(void* prof)
+{
+    prof_profile_t* profile = prof;
+
+    /* Allocated as a temporary Ruby object, so it is not leaked if an interrupt is raised once the
+       work is done */
+    size_t count = profile->threads_tbl->num_entries;
+    VALUE threads_buffer;
+    thread_data_t** threads = ALLOCV_N(thread_data_t*, threads_buffer, count);
+    thread_data_t** threads_end = threads;
+    rb_st_foreach(profile->threads_tbl, collect_fibers, (st_data_t)&threads_end);
+
+    // Skip threads that never called a method
+    count = 0;
+    for (thread_data_t** thread_data = threads; thread_data < threads_end; thread_data++)
+    {
+        if (!(*thread_data)->call_tree)
+            continue;
+
+        if (!(*thread_data)->csr)
+            (*thread_data)->csr = prof_call_tree_csr_create();
+        threads[count++] = *thread_data;
+    }
+
+    if (count == 0)
+    {
+        ALLOCV_END(threads_buffer);
+        return;
+    }
+
+    post_process_t process;
+    process.workers = count < POST_PROCESS_WORKERS ? count : POST_PROCESS_WORKERS;
+    for (size_t i = 0; i < process.workers; i++)
+    {
+        process.work[i].threads = threads;
+        process.work[i].count = count;
+        process.work[i].start = i;
+        process.work[i].step = process.workers;
+        process.work[i].version = profile->call_tree_version;
+        process.work[i].failed = false;
+    }
+
+    /* There is no unblocking function, so interrupts such as Thread#raise or a signal are only handled
+       after every worker has finished and the work arrays are no longer used */
+    rb_thread_call_without_gvl(post_process_nogvl, &process, NULL, NULL);
+
+    ALLOCV_END(threads_buffer);
+
+    for (size_t i = 0; i < process.workers; i++)
+    {
+        if (process.work[i].failed)
+            rb_memerror();
+    }
+}
+
 int pause_thread(st_data_t key, st_data_t value, st_data_t data)
 {
     thread_data_t* thread_data = (thread_data_t*)value;
     prof_profile_t* profile = (prof_profile_t*)data;
 
+    if (!thread_data->stack)
+        return ST_CONTINUE;
+
     prof_frame_t* frame = prof_frame_current(thread_data->stack);
     prof_frame_pause(frame, profile->measurement_at_pause_resume);
 
@@ -249,8 +589,12 @@ int unpause_thread(st_data_t key, st_data_t value, st_data_t data)
     thread_data_t* thread_data = (thread_data_t*)value;
     prof_profile_t* profile = (prof_profile_t*)data;
 
+    if (!thread_data->stack)
+        return ST_CONTINUE;
+
     prof_frame_t* frame = prof_frame_current(thread_data->stack);
-    prof_frame_unpause(frame, profile->measurement_at_pause_resume);
+    if (frame)
+        prof_frame_unpause(frame, profile->measurement_at_pause_resume);
 
     return ST_CONTINUE;
 }
@@ -314,6 +658,24 @@ static VALUE prof_call_tree(VALUE self)
     return prof_call_tree_wrap(thread->call_tree);
 }
 
+/* call-seq:
+   wait_time -> float
+
+Returns the amount of time this thread waited while other threads executed. */
+static VALUE prof_thread_wait_time(VALUE self)
+{
+    thread_data_t* thread_data = prof_get_thread(self);
+    prof_call_tree_csr_t* csr = prof_thread_csr(thread_data);
+
+    // Wait time is method local, so sum it over every call tree. The root is skipped since it
+    // has no caller.
+    double result = 0;
+    for (size_t i = 1; i < csr->count; i++)
+        result += csr->nodes[i]->measurement.wait_time;
+
+    return rb_float_new(result);
+}
+
 /* call-seq:
    methods -> [RubyProf::MethodInfo]
 
@@ -383,6 +745,7 @@ void rp_init_thread(void)
     rb_define_method(cRpThread, "call_tree", prof_call_tree, 0);
     rb_define_method(cRpThread, "fiber_id", prof_fiber_id, 0);
     rb_define_method(cRpThread, "methods", prof_thread_methods, 0);
+    rb_define_method(cRpThread, "wait_time", prof_thread_wait_time, 0);
     rb_define_method(cRpThread, "merge!", prof_thread_merge, 1);
     rb_define_method(cRpThread, "_dump_data", prof_thread_dump, 0);
     rb_define_method(cRpThread, "_load_data", prof_thread_load, 1);
@@ -6,6 +6,22 @@
 
 #include "ruby_prof.h"
 #include "rp_stack.h"
+#include "rp_call_tree_csr.h"
+
+/* A method entry or exit, recorded in order when profiling with record_events */
+typedef struct prof_event_t
+{
+    prof_method_t* method;
+    double measurement;
+    bool enter;
+} prof_event_t;
+
+typedef struct prof_event_log_t
+{
+    prof_event_t* events;
+    size_t count;
+    size_t capacity;
+} prof_event_log_t;
 
 /* Profiling information for a thread. */
 typedef struct thread_data_t
@@ -20,9 +36,16 @@ typedef struct thread_data_t
     VALUE fiber_id;                   /* Fiber id */
     VALUE methods;                    /* Array of RubyProf::MethodInfo */
     st_table* method_table;           /* Methods called in the thread */
+    struct thread_data_t* merge_target;   /* Fiber that resumed this fiber when merging fibers */
+    prof_call_tree_t* merge_call_tree;    /* Call tree in merge_target that this fiber is merged under */
+    int merge_sources;                    /* Number of fibers waiting to be merged into this fiber */
+    bool in_wait_hook;                    /* Is the fiber running a fiber scheduler hook */
+    prof_call_tree_csr_t* csr;            /* Flattened call tree, built when profiling stops */
+    prof_event_log_t* event_log;          /* Method entries and exits, NULL unless recording events */
 } thread_data_t;
 
 void rp_init_thread(void);
+thread_data_t* thread_data_create(void);
 st_table* threads_table_create(void);
 thread_data_t* threads_table_lookup(void* profile, VALUE fiber);
 thread_data_t* threads_table_insert(void* profile, VALUE fiber);
@@ -33,6 +56,12 @@ VALUE prof_thread_wrap(thread_data_t* thread);
 void prof_thread_mark(void* data);
 
 void switch_thread(void* profile, thread_data_t* thread_data, double measurement);
+void merge_fibers(void* profile);
+void post_process_threads(void* profile);
+prof_call_tree_csr_t* prof_thread_csr(thread_data_t* thread_data);
+void prof_thread_record_event(thread_data_t* thread_data, prof_method_t* method, bool enter, double measurement);
+void prof_thread_pop_frames(thread_data_t* thread_data, double measurement);
+void reclaim_fiber(void* profile, thread_data_t* thread_data, double measurement);
 int pause_thread(st_data_t key, st_data_t value, st_data_t data);
 int unpause_thread(st_data_t key, st_data_t value, st_data_t data);
 
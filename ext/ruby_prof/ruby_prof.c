@@ -31,7 +31,9 @@
 #include "rp_call_tree.h"
 #include "rp_aggregate_call_tree.h"
 #include "rp_call_trees.h"
+#include "rp_compress.h"
 #include "rp_profile.h"
+#include "rp_report.h"
 #include "rp_stack.h"
 #include "rp_thread.h"
 
@@ -45,8 +47,10 @@ void Init_ruby_prof()
     rp_init_call_tree();
     rp_init_aggregate_call_tree();
     rp_init_call_trees();
+    rp_init_compress();
     rp_init_measure();
     rp_init_method_info();
     rp_init_profile();
+    rp_init_report();
     rp_init_thread();
 }
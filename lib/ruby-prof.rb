@@ -24,11 +24,16 @@ module RubyProf
   autoload :CallInfoPrinter, 'ruby-prof/printers/call_info_printer'
   autoload :CallStackPrinter, 'ruby-prof/printers/call_stack_printer'
   autoload :CallTreePrinter, 'ruby-prof/printers/call_tree_printer'
+  autoload :ChromeTracePrinter, 'ruby-prof/printers/chrome_trace_printer'
+  autoload :ColumnarPrinter, 'ruby-prof/printers/columnar_printer'
   autoload :DotPrinter, 'ruby-prof/printers/dot_printer'
+  autoload :FlameGraphPrinter, 'ruby-prof/printers/flame_graph_printer'
   autoload :FlatPrinter, 'ruby-prof/printers/flat_printer'
   autoload :GraphHtmlPrinter, 'ruby-prof/printers/graph_html_printer'
   autoload :GraphPrinter, 'ruby-prof/printers/graph_printer'
   autoload :MultiPrinter, 'ruby-prof/printers/multi_printer'
+  autoload :PprofPrinter, 'ruby-prof/printers/pprof_printer'
+  autoload :SpeedscopePrinter, 'ruby-prof/printers/speedscope_printer'
 
   # :nodoc:
   # Checks if the user specified the clock mode via
@@ -14,23 +14,16 @@ module RubyProf
   #   end
   #
   #   puts method_names
+  #
+  # The traversal is done by CallTree#walk, which can also be called directly
+  # to skip cold or deep subtrees.
   class CallTreeVisitor
     def initialize(call_tree)
       @call_tree = call_tree
     end
 
     def visit(&block)
-      visit_call_tree(@call_tree, &block)
-    end
-
-    private
-
-    def visit_call_tree(call_tree, &block)
-      yield call_tree, :enter
-      call_tree.children.each do |child|
-        visit_call_tree(child, &block)
-      end
-      yield call_tree, :exit
+      @call_tree.walk(&block)
     end
   end
 end
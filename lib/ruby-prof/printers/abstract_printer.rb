@@ -32,6 +32,12 @@ module RubyProf
       @options[:filter_by] || :self_time
     end
 
+    # Returns whether the report rows can be written by RubyProf::Report, which is much faster
+    # than formatting them in Ruby. This is only possible when sorting and filtering by measurements.
+    def native_report?
+      Report::FIELDS.include?(sort_method) && Report::FIELDS.include?(filter_by)
+    end
+
     # Returns the time format used to show when a profile was run
     def time_format
       '%A, %B %-d at %l:%M:%S %p (%Z)'
@@ -60,10 +66,37 @@ module RubyProf
     #                  Available values are :total_time, :self_time,
     #                  :wait_time, :children_time
     #                  Default value is :total_time
+    #
+    #   :compress - Compresses the report as it is written, either
+    #               :gzip or :zstd. :compress_level sets the
+    #               compression level. See CompressedWriter.
     def print(output = STDOUT, options = {})
-      @output = output
       setup_options(options)
-      print_threads
+      compressed_output(output) do |output|
+        @output = output
+        print_threads
+      end
+    end
+
+    # Returns the file name extension of the :compress option, or an empty string
+    def compression_extension
+      CompressedWriter::EXTENSIONS[@options[:compress]].to_s
+    end
+
+    # Yields the output a report is written to. When the :compress option is set
+    # the output is wrapped in a CompressedWriter, which is finished once the
+    # block returns.
+    def compressed_output(output)
+      if @options[:compress]
+        writer = CompressedWriter.new(output, @options[:compress], @options[:compress_level])
+        begin
+          yield writer
+        ensure
+          writer.finish
+        end
+      else
+        yield output
+      end
     end
 
     # :nodoc:
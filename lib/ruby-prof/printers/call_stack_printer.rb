@@ -1,13 +1,12 @@
 # encoding: utf-8
 
 require 'erb'
-require 'fileutils'
 require 'base64'
-require 'set'
-require 'stringio'
 
 module RubyProf
-  # Prints a HTML visualization of the call tree.
+  # Prints a HTML visualization of the call tree. The call trees are embedded in the page as
+  # compact JSON and only rendered by the browser as they are expanded, so the page stays small
+  # and responsive for large profiles.
   #
   # To use the printer:
   #
@@ -46,104 +45,26 @@ module RubyProf
     #                  as it appears on the report.
     def print(output = STDOUT, options = {})
       setup_options(options)
-      output << @erb.result(binding)
-    end
-
-    # :enddoc:
-    def setup_options(options)
-      super(options)
-      @erb = ERB.new(self.template)
-    end
-
-    def print_stack(output, visited, call_tree, parent_time)
-      total_time = call_tree.total_time
-      percent_parent = (total_time/parent_time)*100
-      percent_total = (total_time/@overall_time)*100
-      return unless percent_total > min_percent
-      color = self.color(percent_total)
-      visible = percent_total >= threshold
-      expanded = percent_total >= expansion
-      display = visible ? "block" : "none"
 
-      output << "<li class=\"color#{color}\" style=\"display:#{display}\">" << "\n"
-
-      if visited.include?(call_tree)
-        output << "<a href=\"#\" class=\"toggle empty\" ></a>" << "\n"
-        output << "<span>%s %s</span>" % [link(call_tree.target, true), graph_link(call_tree)] << "\n"
-      else
-        visited << call_tree
-
-        if call_tree.children.empty?
-          output << "<a href=\"#\" class=\"toggle empty\" ></a>" << "\n"
-        else
-          visible_children = call_tree.children.any?{|ci| (ci.total_time/@overall_time)*100 >= threshold}
-          image = visible_children ? (expanded ? "minus" : "plus") : "empty"
-          output << "<a href=\"#\" class=\"toggle #{image}\" ></a>" << "\n"
-        end
-        output << "<span>%4.2f%% (%4.2f%%) %s %s</span>" % [percent_total, percent_parent,
-                                                            link(call_tree.target, false), graph_link(call_tree)] << "\n"
-
-        unless call_tree.children.empty?
-          output <<  (expanded ? '<ul>' : '<ul style="display:none">')  << "\n"
-          call_tree.children.sort_by{|c| -c.total_time}.each do |child_call_tree|
-            print_stack(output, visited, child_call_tree, total_time)
-          end
-          output << '</ul>' << "\n"
+      # The call trees are written between the head and the tail of the page, straight to the output
+      head, tail = @erb.result(binding).split(THREADS_MARKER)
+      compressed_output(output) do |output|
+        output << head
+        @result.threads.each do |thread|
+          output << '<script type="application/json" class="call-stack-thread">'
+          Report.print_call_stack(thread, output)
+          output << "</script>\n"
         end
-
-        visited.delete(call_tree)
-      end
-      output << '</li>' << "\n"
-    end
-
-    def name(call_tree)
-      method = call_tree.target
-      method.full_name
-    end
-
-    def link(method, recursive)
-      method_name = "#{recursive ? '*' : ''}#{method.full_name}"
-      if method.source_file.nil?
-        h method_name
-      else
-        file = File.expand_path(method.source_file)
-       "<a href=\"file://#{file}##{method.line}\">#{h method_name}</a>"
+        output << tail
       end
     end
 
-    def graph_link(call_tree)
-      total_calls = call_tree.target.called
-      totals = total_calls.to_s
-      "[#{call_tree.called} calls, #{totals} total]"
-    end
-
-    def method_href(method)
-      h(method.full_name.gsub(/[><#\.\?=:]/,"_"))
-    end
-
-    def total_time(call_trees)
-      sum(call_trees.map{|ci| ci.total_time})
-    end
-
-    def sum(a)
-      a.inject(0.0){|s,t| s+=t}
-    end
-
-    def dump(ci)
-      $stderr.printf "%s/%d t:%f s:%f w:%f  \n", ci, ci.object_id, ci.total_time, ci.self_time, ci.wait_time
-    end
+    # :enddoc:
+    THREADS_MARKER = "<!-- threads -->"
 
-    def color(p)
-      case i = p.to_i
-      when 0..5
-        "01"
-      when 5..10
-        "05"
-      when 100
-        "9"
-      else
-        "#{i/10}"
-      end
+    def setup_options(options)
+      super(options)
+      @erb = ERB.new(self.template)
     end
 
     def application
@@ -6,7 +6,8 @@ require 'fileutils'
 
 module RubyProf
   # Generates profiling information in callgrind format for use by
-  # kcachegrind and similar tools.
+  # kcachegrind and similar tools. The files are written by RubyProf::Report,
+  # using name compression and relative line positions to keep them small.
 
   class CallTreePrinter < AbstractPrinter
     def calltree_name(method_info)
@@ -58,6 +59,14 @@ module RubyProf
       print_threads
     end
 
+    # Writes the callgrind profile of a single thread, by default the first one, to
+    # output instead of writing a file per thread.
+    def print_thread_to(output, thread = nil, options = {})
+      setup_options(options)
+      determine_event_specification_and_value_scale
+      write_thread(output, thread || @result.threads.first)
+    end
+
     def validate_print_params(options)
       if options.is_a?(IO)
         raise ArgumentError, "#{self.class.name}#print cannot print to IO objects"
@@ -73,23 +82,19 @@ module RubyProf
       end
     end
 
-    def convert(value)
-      (value * @value_scale).round
-    end
-
-    def file(method)
-      method.source_file ? File.expand_path(method.source_file) : ''
-    end
-
     def print_thread(thread)
-      File.open(file_path_for_thread(thread), "w") do |f|
-        print_headers(f, thread)
-        thread.methods.reverse_each do |method|
-          print_method(f, method)
+      File.open(file_path_for_thread(thread), "wb") do |file|
+        compressed_output(file) do |f|
+          write_thread(f, thread)
         end
       end
     end
 
+    def write_thread(output, thread)
+      print_headers(output, thread)
+      Report.print_callgrind(thread, output, @value_scale)
+    end
+
     def path
       @options[:path] || "."
     end
@@ -98,17 +103,23 @@ module RubyProf
       true
     end
 
+    # The process id used in file names. MultiPrinter passes the parent's id
+    # when it renders this report in a forked child.
+    def process_id
+      @options[:pid] || $$
+    end
+
     def remove_subsidiary_files_from_previous_profile_runs
-      pattern = ["callgrind.out", $$, "*"].join(".")
+      pattern = ["callgrind.out", process_id, "*"].join(".")
       files = Dir.glob(File.join(path, pattern))
       FileUtils.rm_f(files)
     end
 
     def file_name_for_thread(thread)
       if thread.fiber_id == Fiber.current.object_id
-        ["callgrind.out", $$].join(".")
+        ["callgrind.out", process_id].join(".") + compression_extension
       else
-        ["callgrind.out", $$, thread.fiber_id].join(".")
+        ["callgrind.out", process_id, thread.fiber_id].join(".") + compression_extension
       end
     end
 
@@ -117,29 +128,10 @@ module RubyProf
     end
 
     def print_headers(output, thread)
+      output << "positions: line\n"
       output << "#{@event_specification}\n\n"
       # this doesn't work. kcachegrind does not fully support the spec.
       # output << "thread: #{thread.id}\n\n"
     end
-
-    def print_method(output, method)
-      # Print out the file and method name
-      output << "fl=#{file(method)}\n"
-      output << "fn=#{self.calltree_name(method)}\n"
-
-      # Now print out the function line number and its self time
-      output << "#{method.line} #{convert(method.self_time)}\n"
-
-      # Now print out all the children methods
-      method.call_trees.callees.each do |callee|
-        output << "cfl=#{file(callee.target)}\n"
-        output << "cfn=#{self.calltree_name(callee.target)}\n"
-        output << "calls=#{callee.called} #{callee.line}\n"
-
-        # Print out total times here!
-        output << "#{callee.line} #{convert(callee.total_time)}\n"
-      end
-      output << "\n"
-    end
   end
 end
@@ -0,0 +1,52 @@
+# encoding: utf-8
+
+module RubyProf
+  # Generates a timeline in the Chrome trace event format, which can be opened with
+  # Perfetto (https://ui.perfetto.dev) or chrome://tracing. Each Ruby thread is shown
+  # as a process with a track for each of its fibers, so threads can be compared side
+  # by side.
+  #
+  # The profile must record events, since threads can only be compared side by side
+  # when it is known when their methods ran:
+  #
+  #   result = RubyProf.profile(:record_events => true) do
+  #     [code to profile]
+  #   end
+  #
+  #   printer = RubyProf::ChromeTracePrinter.new(result)
+  #   File.open("profile.trace.json", "w") do |file|
+  #     printer.print(file, :min_duration => 0.001)
+  #   end
+  #
+  # Options are:
+  #
+  #   :min_duration - Calls that take less than this are left out, in the units of the
+  #                   measure mode (seconds for time). Defaults to 0.
+  #   :max_events   - Maximum number of calls to write. Defaults to no limit.
+  class ChromeTracePrinter < AbstractPrinter
+    # Returns the number measurements are multiplied by, the trace format expects microseconds
+    def value_scale
+      case @result.measure_mode
+        when RubyProf::WALL_TIME, RubyProf::PROCESS_TIME
+          1_000_000
+        else
+          1
+      end
+    end
+
+    def print(output = STDOUT, options = {})
+      unless @result.record_events?
+        raise(ArgumentError, "ChromeTracePrinter requires a profile created with :record_events => true")
+      end
+
+      setup_options(options)
+      compressed_output(output) do |output|
+        @output = output
+        Report.print_chrome_trace(@result.threads, output,
+                                  :value_scale => value_scale,
+                                  :min_duration => @options[:min_duration],
+                                  :max_events => @options[:max_events])
+      end
+    end
+  end
+end
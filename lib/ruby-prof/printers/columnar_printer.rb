@@ -0,0 +1,70 @@
+# encoding: utf-8
+
+module RubyProf
+  # Writes the aggregated call graph as three tables in a columnar binary format, which
+  # can be loaded in bulk without parsing text reports:
+  #
+  #   profile.methods.col     - thread, id, class, name, file, line, called, total, self, wait, children
+  #   profile.edges.col       - thread, caller, callee, calls, total, self, wait, children
+  #   profile.allocations.col - thread, method, class, file, line, count, bytes
+  #
+  # Each column is an array of little endian values that starts at a multiple of 8 bytes,
+  # so it can be memory mapped as is. See RubyProf::Report.print_columns for the layout.
+  #
+  # To use the columnar printer:
+  #
+  #   result = RubyProf.profile do
+  #     [code to profile]
+  #   end
+  #
+  #   printer = RubyProf::ColumnarPrinter.new(result)
+  #   printer.print(:path => "profiles", :profile => "run_1")
+  #
+  # Options are:
+  #
+  #   :path    - Directory the files are written to. Defaults to the current directory.
+  #   :profile - Base name of the files. Defaults to "profile".
+  class ColumnarPrinter < AbstractPrinter
+    TABLES = [:methods, :edges, :allocations]
+
+    def self.needs_dir?
+      true
+    end
+
+    def print(options = {})
+      validate_print_params(options)
+      setup_options(options)
+
+      TABLES.each do |table|
+        File.open(file_path(table), "wb") do |file|
+          compressed_output(file) do |output|
+            Report.print_columns(@result.threads, output, table)
+          end
+        end
+      end
+    end
+
+    def path
+      @options[:path] || "."
+    end
+
+    def profile
+      @options[:profile] || "profile"
+    end
+
+    # Returns the path of the file the table is written to
+    def file_path(table)
+      File.join(path, "#{profile}.#{table}.col#{compression_extension}")
+    end
+
+    private
+
+    def validate_print_params(options)
+      if options.is_a?(IO)
+        raise ArgumentError, "#{self.class.name}#print cannot print to IO objects"
+      elsif !options.is_a?(Hash)
+        raise ArgumentError, "#{self.class.name}#print requires an options hash"
+      end
+    end
+  end
+end
@@ -0,0 +1,44 @@
+# encoding: utf-8
+
+module RubyProf
+  # Generates collapsed stacks, the input format of Brendan Gregg's flamegraph.pl
+  # and of tools such as speedscope and inferno. Each line is a semicolon separated
+  # stack of methods followed by the self value of the last method:
+  #
+  #   Object#run_primes;Object#find_primes;Array#select 796
+  #
+  # To use the flame graph printer:
+  #
+  #   result = RubyProf.profile do
+  #     [code to profile]
+  #   end
+  #
+  #   printer = RubyProf::FlameGraphPrinter.new(result)
+  #   printer.print(STDOUT, {})
+  #
+  # Options are:
+  #
+  #   :value_scale - Number that values are multiplied by before they are rounded
+  #                  to integers. Defaults to 1_000_000 (microseconds) for time
+  #                  measure modes and 1 for allocations and memory.
+  class FlameGraphPrinter < AbstractPrinter
+    def value_scale
+      @options[:value_scale] || default_value_scale
+    end
+
+    private
+
+    def default_value_scale
+      case @result.measure_mode
+        when RubyProf::WALL_TIME, RubyProf::PROCESS_TIME
+          1_000_000
+        else
+          1
+      end
+    end
+
+    def print_thread(thread)
+      Report.print_flame_graph(thread, @output, value_scale)
+    end
+  end
+end
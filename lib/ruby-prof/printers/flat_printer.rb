@@ -24,6 +24,12 @@ module RubyProf
     end
 
     def print_methods(thread)
+      if native_report?
+        Report.print_flat(thread, @output, sort_method: sort_method, filter_by: filter_by,
+                          min_percent: min_percent, max_percent: max_percent)
+        return
+      end
+
       total_time = thread.total_time
       methods = thread.methods.sort_by(&sort_method).reverse
 
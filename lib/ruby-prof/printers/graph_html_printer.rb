@@ -25,7 +25,9 @@ module RubyProf
 
     def print(output = STDOUT, options = {})
       setup_options(options)
-      output << @erb.result(binding)
+      compressed_output(output) do |output|
+        output << @erb.result(binding)
+      end
     end
 
     # Creates a link to a method.  Note that we do not create
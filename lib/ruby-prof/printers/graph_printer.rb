@@ -46,6 +46,11 @@ module RubyProf
     end
 
     def print_methods(thread)
+      if native_report?
+        Report.print_graph(thread, @output, sort_method: sort_method, min_percent: min_percent)
+        return
+      end
+
       total_time = thread.total_time
       # Sort methods from longest to shortest total time
       methods = thread.methods.sort_by(&sort_method)
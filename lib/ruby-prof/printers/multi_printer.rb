@@ -4,6 +4,13 @@ module RubyProf
   # Helper class to simplify printing profiles of several types from
   # one profiling run. Currently prints a flat profile, a callgrind
   # profile, a call stack profile and a graph profile.
+  #
+  # On platforms that support fork each report is rendered by its own
+  # child process, so printing takes as long as the slowest report
+  # rather than the sum of all of them. Pass :parallel => false to
+  # print the reports one after another in the current process.
+  # With the :compress option every report is compressed and its
+  # file name gets the extension of the compression format.
   class MultiPrinter
     def initialize(result, printers = [:flat, :graph_html])
       @flat_printer = FlatPrinter.new(result) if printers.include?(:flat)
@@ -22,6 +29,47 @@ module RubyProf
       true
     end
 
+    # Yields each item, in a forked child process per item when parallel
+    # is true and the platform supports fork. Waits for all children and
+    # raises an error if any of them failed.
+    def self.each_in_parallel(items, parallel = true)
+      unless parallel && items.size > 1 && Process.respond_to?(:fork)
+        return items.each { |item| yield item }
+      end
+
+      children = items.map do |item|
+        reader, writer = IO.pipe
+        pid = Process.fork do
+          reader.close
+          status = 0
+          begin
+            yield item
+          rescue Exception => e
+            writer.write("#{e.class}: #{e.message}")
+            status = 1
+          ensure
+            writer.close
+            # Skip at_exit handlers and finalizers inherited from the parent
+            exit!(status)
+          end
+        end
+        writer.close
+        [pid, reader]
+      end
+
+      errors = children.map do |pid, reader|
+        message = reader.read
+        reader.close
+        Process.wait(pid)
+        unless $?.success?
+          message.empty? ? "Report process #{pid} failed with #{$?}" : message
+        end
+      end.compact
+
+      raise(RuntimeError, errors.join("\n")) unless errors.empty?
+      items
+    end
+
     # create profile files under options[:path] or the current
     # directory. options[:profile] is used as the base name for the
     # profile file, defaults to "profile".
@@ -30,50 +78,58 @@ module RubyProf
 
       @profile = options.delete(:profile) || "profile"
       @directory = options.delete(:path) || File.expand_path(".")
+      parallel = options.delete(:parallel) != false
+      @extension = CompressedWriter::EXTENSIONS[options[:compress]].to_s
+      @pid = $$
 
-      print_to_flat(options) if @flat_printer
+      reports = []
+      reports << :print_to_flat if @flat_printer
 
-      print_to_graph(options) if @graph_printer
-      print_to_graph_html(options) if @graph_html_printer
+      reports << :print_to_graph if @graph_printer
+      reports << :print_to_graph_html if @graph_html_printer
 
-      print_to_stack(options) if @stack_printer
-      print_to_call_info(options) if @call_info_printer
-      print_to_tree(options) if @tree_printer
-      print_to_dot(options) if @dot_printer
+      reports << :print_to_stack if @stack_printer
+      reports << :print_to_call_info if @call_info_printer
+      reports << :print_to_tree if @tree_printer
+      reports << :print_to_dot if @dot_printer
+
+      self.class.each_in_parallel(reports, parallel) do |report|
+        send(report, options)
+      end
     end
 
     # the name of the flat profile file
     def flat_report
-      "#{@directory}/#{@profile}.flat.txt"
+      "#{@directory}/#{@profile}.flat.txt#{@extension}"
     end
 
     # the name of the graph profile file
     def graph_report
-      "#{@directory}/#{@profile}.graph.txt"
+      "#{@directory}/#{@profile}.graph.txt#{@extension}"
     end
 
     def graph_html_report
-      "#{@directory}/#{@profile}.graph.html"
+      "#{@directory}/#{@profile}.graph.html#{@extension}"
     end
 
     # the name of the callinfo profile file
     def call_info_report
-      "#{@directory}/#{@profile}.call_tree.txt"
+      "#{@directory}/#{@profile}.call_tree.txt#{@extension}"
     end
 
     # the name of the callgrind profile file
     def tree_report
-      "#{@directory}/#{@profile}.callgrind.out.#{$$}"
+      "#{@directory}/#{@profile}.callgrind.out.#{$$}#{@extension}"
     end
 
     # the name of the call stack profile file
     def stack_report
-      "#{@directory}/#{@profile}.stack.html"
+      "#{@directory}/#{@profile}.stack.html#{@extension}"
     end
 
     # the name of the call stack profile file
     def dot_report
-      "#{@directory}/#{@profile}.dot"
+      "#{@directory}/#{@profile}.dot#{@extension}"
     end
 
     def print_to_flat(options)
@@ -101,12 +157,12 @@ module RubyProf
     end
 
     def print_to_tree(options)
-      @tree_printer.print(options.merge(:path => @directory, :profile => @profile))
+      @tree_printer.print(options.merge(:path => @directory, :profile => @profile, :pid => @pid))
     end
 
     def print_to_stack(options)
       File.open(stack_report, "wb") do |file|
-        @stack_printer.print(file, options.merge(:graph => "#{@profile}.graph.html"))
+        @stack_printer.print(file, options.merge(:graph => "#{@profile}.graph.html#{@extension}"))
       end
     end
 
@@ -0,0 +1,84 @@
+# encoding: utf-8
+
+module RubyProf
+  # Generates a gzip compressed profile in the protocol buffer format used by Google's pprof
+  # (https://github.com/google/pprof). Each call tree becomes a sample whose stack is its path
+  # from the root, so the profile can be explored and diffed with pprof and the tools that
+  # read its format.
+  #
+  # To use the pprof printer:
+  #
+  #   result = RubyProf.profile do
+  #     [code to profile]
+  #   end
+  #
+  #   printer = RubyProf::PprofPrinter.new(result)
+  #   File.open("profile.pb.gz", "wb") do |file|
+  #     printer.print(file)
+  #   end
+  #
+  # Options are:
+  #
+  #   :value_scale - Number that values are multiplied by before they are rounded
+  #                  to integers. Defaults to 1_000_000_000 (nanoseconds) for time
+  #                  measure modes and 1 for allocations and memory.
+  #
+  #   :compress_level - The gzip compression level. pprof profiles are gzip
+  #                     compressed, so the :compress option is ignored. When
+  #                     ruby-prof was built without zlib they are written
+  #                     uncompressed, which pprof reads as well.
+  class PprofPrinter < AbstractPrinter
+    def value_scale
+      @options[:value_scale] || default_value_scale
+    end
+
+    # Returns the type and unit of the sample values, as shown by pprof
+    def sample_type
+      case @result.measure_mode
+        when RubyProf::WALL_TIME
+          ["wall", time_unit]
+        when RubyProf::PROCESS_TIME
+          ["cpu", time_unit]
+        when RubyProf::ALLOCATIONS
+          ["allocations", "count"]
+        when RubyProf::MEMORY
+          ["memory", "bytes"]
+      end
+    end
+
+    def print(output = STDOUT, options = {})
+      @output = output
+      setup_options(options)
+
+      unless CompressedWriter.formats.include?(:gzip)
+        return Report.print_pprof(@result.threads, output, *sample_type, value_scale)
+      end
+
+      # The profile is compressed as it is written so it never has to be held in memory
+      gzip = CompressedWriter.new(output, :gzip, @options[:compress_level])
+      begin
+        Report.print_pprof(@result.threads, gzip, *sample_type, value_scale)
+      ensure
+        gzip.finish
+      end
+      output
+    end
+
+    private
+
+    TIME_UNITS = {1 => "seconds", 1_000 => "milliseconds", 1_000_000 => "microseconds", 1_000_000_000 => "nanoseconds"}
+
+    def time_unit
+      TIME_UNITS.fetch(value_scale, "count")
+    end
+
+    def default_value_scale
+      case @result.measure_mode
+        when RubyProf::WALL_TIME, RubyProf::PROCESS_TIME
+          1_000_000_000
+        else
+          1
+      end
+    end
+  end
+end
@@ -0,0 +1,50 @@
+# encoding: utf-8
+
+module RubyProf
+  # Generates a speedscope (https://www.speedscope.app) evented profile. Each thread and fiber is
+  # shown as its own profile, with methods on a timeline in the order they ran.
+  #
+  # The timeline is exact when the profile recorded events:
+  #
+  #   result = RubyProf.profile(:record_events => true) do
+  #     [code to profile]
+  #   end
+  #
+  #   printer = RubyProf::SpeedscopePrinter.new(result)
+  #   File.open("profile.speedscope.json", "w") do |file|
+  #     printer.print(file)
+  #   end
+  #
+  # Without recorded events the timeline is laid out from the call tree, with each method's
+  # calls combined and its children shown one after another. This is not when methods ran,
+  # so a warning is printed and the profiles are named as synthesized.
+  #
+  # Options are:
+  #
+  #   :name - Name of the profile shown by speedscope. Defaults to "ruby-prof".
+  class SpeedscopePrinter < AbstractPrinter
+    # Returns the speedscope unit of the measurements
+    def unit
+      case @result.measure_mode
+        when RubyProf::WALL_TIME, RubyProf::PROCESS_TIME
+          "seconds"
+        when RubyProf::MEMORY
+          "bytes"
+        else
+          "none"
+      end
+    end
+
+    def print(output = STDOUT, options = {})
+      unless @result.record_events?
+        warn("RubyProf::SpeedscopePrinter: the profile did not record events, so the timeline is synthesized from the call tree. Use :record_events => true")
+      end
+
+      setup_options(options)
+      compressed_output(output) do |output|
+        @output = output
+        Report.print_speedscope(@result.threads, output, @options[:name] || "ruby-prof", unit)
+      end
+    end
+  end
+end
@@ -33,7 +33,10 @@ module RubyProf
       exclude_methods!(mod.singleton_class, *method_or_methods)
     end
 
-    def merge!
+    def merge!(other = nil)
+      # A profile given as an argument is added to this one, see merge_profile
+      return merge_profile(other) if other
+
       # First group threads by their root call tree methods. If the methods are
       # different than there is nothing to merge
       grouped = threads.group_by do |thread|
@@ -42,6 +45,7 @@ module RubyProf
 
       # call-seq:
       # merge! -> self
+      # merge!(other) -> self
       #
       # Merges RubyProf threads whose root call_trees reference the same target method. This is useful
       # when profiling code that uses a main thread/fiber to distribute work to multiple workers.
@@ -51,6 +55,9 @@ module RubyProf
       # Note the reported time will be much greater than the actual wall time. For example, if there
       # are 10 workers that each run for 5 seconds, merged results will show one thread that
       # ran for 50 seconds.
+      #
+      # When another profile is passed its threads are added to this profile instead, for example
+      # to aggregate the profiles of many requests to the same page. See merge_profile.
 
       merged_threads = grouped.map do |call_tree, threads|
         thread = threads.shift
@@ -1,8 +1,95 @@
 # encoding: utf-8
+require 'digest'
+require 'json'
+require 'stringio'
 require 'tmpdir'
+require 'uri'
 
 module Rack
+  # Profiles requests and writes reports for each of them to :path. Since profiling
+  # slows requests down, how many are profiled can be limited so the middleware can
+  # stay mounted in production:
+  #
+  #   :sample_rate    - Profile 1 in every sample_rate requests. Defaults to 1.
+  #   :max_concurrent - Maximum number of requests profiled at the same time.
+  #                     Defaults to no limit.
+  #   :path_rate      - Number of requests per second that can be profiled for each
+  #                     path, enforced by a token bucket per path. Defaults to no limit.
+  #   :path_burst     - Number of requests of a path that can be profiled at once
+  #                     before path_rate applies. Defaults to 1.
+  #
+  # Requests that are not profiled are passed straight to the application.
+  #
+  # Reports are rendered one after another. Rendering them concurrently, in a forked
+  # process per printer, is opt-in since forking a server process is not always safe:
+  #
+  #   :parallel - Render each report in its own forked process. Defaults to false.
+  #
+  # To only keep profiles of slow or failed requests:
+  #
+  #   :keep_if_slower_than - Keep the profile of requests that take longer than this
+  #                          many seconds.
+  #   :keep_if_status      - Keep the profile of requests whose response status matches,
+  #                          either a callable such as ->(status) { status >= 500 } or
+  #                          a pattern such as 500..599.
+  #
+  # When either is given, other profiles are discarded without writing reports.
+  #
+  # Reports are written before the response is returned unless :async is true. Then
+  # profiles are queued and their reports are written by a background thread, so
+  # writing them does not add to the request's latency:
+  #
+  #   :async      - Write reports on a background thread. Defaults to false.
+  #   :queue_size - Maximum number of profiles, or flushes of aggregated profiles,
+  #                 waiting to be written. They are dropped, rather than blocking
+  #                 requests, once the queue is full. Defaults to 16.
+  #
+  # Call #close to wait for queued reports to be written.
+  #
+  # Instead of writing reports for every request, the profiles of requests to the same
+  # route can be added together and written periodically. Reports of a thousand requests
+  # to /api/orders then show where those requests spend their time in a single set of files:
+  #
+  #   :aggregate      - Merge the profiles of requests to the same route. Defaults to false.
+  #   :route          - A callable that is passed the Rack env and returns the route's name.
+  #                     Defaults to the request's path. Each route keeps a full profile in
+  #                     memory, so paths with ids such as /orders/1 should be mapped to a
+  #                     single route such as /orders/id.
+  #   :max_routes     - Maximum number of routes that are aggregated. Once reached, the
+  #                     reports of the route that was least recently profiled are written
+  #                     by the background writer to make room. Defaults to 100.
+  #   :flush_interval - Write reports of the aggregated profiles every flush_interval seconds.
+  #                     They are written by the background writer, even without :async,
+  #                     so the request that is due to flush is not delayed. Defaults to
+  #                     only writing them when #flush or #close is called.
+  #
+  # Reports of aggregated profiles are named after the route.
+  #
+  # Profiling can be controlled at runtime by mounting a control endpoint:
+  #
+  #   :control_path   - Path of the control endpoint, for example '/__ruby_prof'.
+  #   :control_secret - Secret that requests to the endpoint must send in the
+  #                     X-RubyProf-Secret header. Required with :control_path.
+  #   :enabled        - Whether requests are profiled until the endpoint changes it.
+  #                     Defaults to true.
+  #
+  # The endpoint responds to:
+  #
+  #   GET  /__ruby_prof          - Settings and aggregated routes as JSON
+  #   POST /__ruby_prof/start    - Start profiling requests and aggregating them per route
+  #   POST /__ruby_prof/stop     - Stop profiling requests, keeping the aggregated profiles
+  #   POST /__ruby_prof/config   - Change the sample_rate, max_concurrent or path_rate
+  #                                given as query parameters
+  #   GET  /__ruby_prof/snapshot - Download the aggregated profile of the route query
+  #                                parameter. The format parameter is binary (Marshal,
+  #                                the default), flamegraph or callgrind
   class RubyProf
+    # Maximum number of paths that have a token bucket, the least recently added are dropped first
+    MAX_PATH_BUCKETS = 10_000
+
+    # Default maximum number of routes whose profiles are aggregated, see :max_routes
+    MAX_AGGREGATED_ROUTES = 100
+
     def initialize(app, options = {})
       @app = app
       @options = options
@@ -18,32 +105,114 @@ module Rack
 
       @skip_paths = options[:skip_paths] || [%r{^/assets}, %r{\.(css|js|png|jpeg|jpg|gif)$}]
       @only_paths = options[:only_paths]
+
+      @sample_rate = options[:sample_rate] || 1
+      @max_concurrent = options[:max_concurrent]
+      @path_rate = options[:path_rate]
+      @path_burst = options[:path_burst] || 1
+
+      @mutex = Mutex.new
+      @requests = 0
+      @profiling = 0
+      @path_buckets = Hash.new
+
+      @async = options[:async]
+      @queue_size = options[:queue_size] || 16
+      @queue = Queue.new
+      @writer = nil
+      @dropped_profiles = 0
+
+      @keep_if_slower_than = options[:keep_if_slower_than]
+      @keep_if_status = options[:keep_if_status]
+      @discarded_profiles = 0
+
+      @aggregate = options[:aggregate]
+      @route = options[:route]
+      @flush_interval = options[:flush_interval]
+      @max_routes = options[:max_routes] || MAX_AGGREGATED_ROUTES
+      @aggregates = Hash.new
+      @flushed_at = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+      @enabled = options.fetch(:enabled, true)
+      @control_path = options[:control_path]
+      @control_secret = options[:control_secret]
+      if @control_path && (@control_secret.nil? || @control_secret.empty?)
+        raise(ArgumentError, "Rack::RubyProf requires a :control_secret with :control_path")
+      end
     end
 
+    # Number of profiles that were dropped because the queue of the background writer was full
+    attr_reader :dropped_profiles
+
+    # Number of profiles that were discarded because the request was neither slow nor matched :keep_if_status
+    attr_reader :discarded_profiles
+
     def call(env)
       request = Rack::Request.new(env)
 
-      if should_profile?(request.path)
+      if @control_path && control_request?(request.path)
+        return control(env, request.path)
+      end
+
+      if should_profile?(request.path) && start_profiling(request.path)
         begin
           result = nil
+          started_at = Process.clock_gettime(Process::CLOCK_MONOTONIC)
           data = ::RubyProf::Profile.profile(profiling_options) do
             result = @app.call(env)
           end
+          duration = Process.clock_gettime(Process::CLOCK_MONOTONIC) - started_at
 
-          path = request.path.gsub('/', '-')
-          path.slice!(0)
+          unless keep_profile?(duration, result)
+            @mutex.synchronize { @discarded_profiles += 1 }
+            return result
+          end
+
+          if @aggregate
+            aggregate(data, @route ? @route.call(env).to_s : request.path)
+            return result
+          end
+
+          path = report_path(request.path)
 
-          print(data, path)
+          if @async
+            enqueue([[data, path]])
+          else
+            print(data, path)
+          end
           result
+        ensure
+          stop_profiling
         end
       else
         @app.call(env)
       end
     end
 
+    # Writes reports of the profiles aggregated since the last flush and starts new ones.
+    def flush
+      write_aggregates(take_aggregates, @async)
+      self
+    end
+
+    # Writes reports of aggregated profiles, then waits until the background writer has
+    # written the queued reports and stops it. The writer is started again by the next
+    # profiled request.
+    def close
+      flush if @aggregate
+      writer = @mutex.synchronize do
+        # The writer finishes the profiles already queued. A new writer gets its own queue
+        @queue.close
+        @writer.tap { @writer = nil }
+      end
+      writer&.join
+      self
+    end
+
     private
 
     def should_profile?(path)
+      return false unless @enabled
       return false if paths_match?(path, @skip_paths)
 
       @only_paths ? paths_match?(path, @only_paths) : true
@@ -53,6 +222,242 @@ module Rack
       paths.any? { |skip_path| skip_path =~ path }
     end
 
+    # Returns whether the profile of a request that took duration seconds and returned result should be written
+    def keep_profile?(duration, result)
+      return true unless @keep_if_slower_than || @keep_if_status
+      return true if @keep_if_slower_than && duration > @keep_if_slower_than
+
+      status = result.first.to_i if result.is_a?(Array)
+      if @keep_if_status.respond_to?(:call)
+        @keep_if_status.call(status) ? true : false
+      elsif @keep_if_status
+        @keep_if_status === status
+      else
+        false
+      end
+    end
+
+    # Returns whether the request should be profiled given the sample rate, the number of
+    # requests being profiled and the path's token bucket. Must be followed by stop_profiling.
+    def start_profiling(path)
+      @mutex.synchronize do
+        @requests += 1
+        return false unless @requests % @sample_rate == 0
+        return false if @max_concurrent && @profiling >= @max_concurrent
+        return false if @path_rate && !take_path_token(path)
+
+        @profiling += 1
+        true
+      end
+    end
+
+    def stop_profiling
+      @mutex.synchronize do
+        @profiling -= 1
+      end
+    end
+
+    # Refills the path's bucket for the time passed since it was last used and takes a token from it
+    def take_path_token(path)
+      now = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      tokens, updated_at = @path_buckets.delete(path) || [@path_burst, now]
+      tokens = [tokens + (now - updated_at) * @path_rate, @path_burst].min
+
+      @path_buckets.shift while @path_buckets.size >= MAX_PATH_BUCKETS
+      if tokens >= 1
+        @path_buckets[path] = [tokens - 1, now]
+        true
+      else
+        @path_buckets[path] = [tokens, now]
+        false
+      end
+    end
+
+    def control_request?(path)
+      path == @control_path || path.start_with?("#{@control_path}/")
+    end
+
+    # Handles a request to the control endpoint and returns its response
+    def control(env, path)
+      return control_response(403, 'Forbidden') unless secure_compare(env['HTTP_X_RUBYPROF_SECRET'].to_s, @control_secret)
+
+      params = URI.decode_www_form(env['QUERY_STRING'].to_s).to_h
+      action = path.delete_prefix(@control_path).delete_prefix('/')
+      method = env['REQUEST_METHOD'] || 'GET'
+
+      case [method, action]
+        when ['GET', '']
+          control_response(200, JSON.generate(control_status), 'application/json')
+        when ['POST', 'start']
+          @mutex.synchronize do
+            @enabled = true
+            @aggregate = true
+          end
+          control_response(200, 'Started')
+        when ['POST', 'stop']
+          @mutex.synchronize { @enabled = false }
+          control_response(200, 'Stopped')
+        when ['POST', 'config']
+          control_config(params)
+        when ['GET', 'snapshot']
+          control_snapshot(params['route'], params['format'] || 'binary')
+        else
+          control_response(404, 'Not Found')
+      end
+    end
+
+    def control_status
+      @mutex.synchronize do
+        {:enabled => @enabled, :aggregate => @aggregate ? true : false, :sample_rate => @sample_rate,
+         :max_concurrent => @max_concurrent, :path_rate => @path_rate, :routes => @aggregates.keys,
+         :dropped_profiles => @dropped_profiles, :discarded_profiles => @discarded_profiles}
+      end
+    end
+
+    def control_config(params)
+      settings = {'sample_rate' => :@sample_rate, 'max_concurrent' => :@max_concurrent, 'path_rate' => :@path_rate}
+      values = params.slice(*settings.keys).transform_values { |value| Float(value, exception: false) }
+      if values.empty? || values.any? { |_, value| value.nil? || value <= 0 }
+        return control_response(400, "Expected positive sample_rate, max_concurrent or path_rate")
+      end
+
+      @mutex.synchronize do
+        values.each do |name, value|
+          value = value.ceil unless name == 'path_rate'
+          instance_variable_set(settings[name], value)
+        end
+      end
+      control_response(200, JSON.generate(control_status), 'application/json')
+    end
+
+    # Renders the route's aggregated profile. It is taken out of the aggregates while it is
+    # rendered so requests are not blocked, and profiles aggregated meanwhile are merged into it.
+    def control_snapshot(route, format)
+      unless %w(binary flamegraph callgrind).include?(format)
+        return control_response(400, "Unknown format #{format}")
+      end
+
+      data = @mutex.synchronize { @aggregates.delete(route) }
+      return control_response(404, "No profile for route #{route}") unless data
+
+      begin
+        body = case format
+                 when 'binary'
+                   Marshal.dump(data)
+                 when 'flamegraph'
+                   output = StringIO.new
+                   ::RubyProf::FlameGraphPrinter.new(data).print(output)
+                   output.string
+                 when 'callgrind'
+                   output = StringIO.new
+                   ::RubyProf::CallTreePrinter.new(data).print_thread_to(output)
+                   output.string
+               end
+      ensure
+        store_aggregate(route, data)
+      end
+      control_response(200, body, format == 'binary' ? 'application/octet-stream' : 'text/plain')
+    end
+
+    def control_response(status, body, content_type = 'text/plain')
+      [status, {'content-type' => content_type, 'content-length' => body.bytesize.to_s}, [body]]
+    end
+
+    # Compares strings in constant time so the secret cannot be guessed from response times.
+    # Their digests are compared so the time does not depend on the secret's length either.
+    def secure_compare(a, b)
+      a = Digest::SHA256.digest(a)
+      b = Digest::SHA256.digest(b)
+      a.bytes.zip(b.bytes).reduce(0) { |result, (x, y)| result | (x ^ y) } == 0
+    end
+
+    # Converts a request path or route to the prefix of its report files
+    def report_path(path)
+      path = path.gsub('/', '-')
+      path.slice!(0)
+      path
+    end
+
+    # Merges the profile into the route's aggregated profile. When flush_interval has passed the
+    # aggregated profiles are handed to the background writer, so this request is not delayed.
+    def aggregate(data, route)
+      store_aggregate(route, data)
+      flush_due = @mutex.synchronize do
+        @flush_interval && Process.clock_gettime(Process::CLOCK_MONOTONIC) - @flushed_at >= @flush_interval
+      end
+      write_aggregates(take_aggregates, true) if flush_due
+    end
+
+    # Returns the aggregated profiles and starts new ones
+    def take_aggregates
+      @mutex.synchronize do
+        @flushed_at = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        @aggregates.tap { @aggregates = Hash.new }
+      end
+    end
+
+    # Writes reports of the aggregated profiles, queueing them for the background writer when async is true
+    def write_aggregates(aggregates, async)
+      reports = aggregates.map { |route, data| [data, report_path(route)] }
+      if async
+        enqueue(reports) unless reports.empty?
+      else
+        reports.each { |data, path| print(data, path) }
+      end
+    end
+
+    # Stores the route's aggregated profile. Merging takes a while, so the route's current profile
+    # is taken out of the aggregates and merged without holding the lock, until none is left.
+    # Routes are kept in the order they were last stored, so the least recently profiled are
+    # written first when there are too many.
+    def store_aggregate(route, data)
+      evicted = Array.new
+      loop do
+        aggregated = @mutex.synchronize do
+          @aggregates.delete(route).tap do |existing|
+            unless existing
+              evicted << @aggregates.shift while @aggregates.size >= @max_routes
+              @aggregates[route] = data
+            end
+          end
+        end
+        break unless aggregated
+
+        data = aggregated.merge!(data)
+      end
+      write_aggregates(evicted, true)
+    end
+
+    # Queues profiles and the paths of their reports for the background writer, or drops them
+    # if the queue is full
+    def enqueue(reports)
+      @mutex.synchronize do
+        # Threads do not survive a fork, so the writer is started by the process that uses it
+        unless @writer&.alive?
+          queue = @queue = Queue.new
+          @writer = Thread.new { write_queued(queue) }
+        end
+
+        if @queue.size < @queue_size
+          @queue << reports
+        else
+          @dropped_profiles += reports.size
+        end
+      end
+    end
+
+    def write_queued(queue)
+      while (reports = queue.pop)
+        reports.each do |data, path|
+          begin
+            print(data, path)
+          rescue => e
+            warn("Rack::RubyProf could not write reports for #{path}: #{e.message}")
+          end
+        end
+      end
+    end
+
     def profiling_options
       options = {}
       options[:measure_mode] = ::RubyProf.measure_mode
@@ -62,6 +467,8 @@ module Rack
         else
           ::RubyProf.exclude_threads
         end
+      # Writing reports of other requests is not part of this one
+      options[:exclude_threads] += [@writer] if @writer
       if @options[:request_thread_only]
         options[:include_threads] = [Thread.current]
       end
@@ -71,20 +478,23 @@ module Rack
       options
     end
 
+    # Reports are rendered concurrently, one forked process per printer, when
+    # the :parallel option is true.
     def print(data, path)
-      @printer_klasses.each do |printer_klass, base_name|
-        printer = printer_klass.new(data)
+      reports = @printer_klasses.map do |printer_klass, base_name|
+        base_name = base_name.call if base_name.respond_to?(:call)
+        [printer_klass, "#{path}-#{base_name}"]
+      end
 
-        if base_name.respond_to?(:call)
-          base_name = base_name.call
-        end
+      ::RubyProf::MultiPrinter.each_in_parallel(reports, @options[:parallel]) do |printer_klass, profile|
+        printer = printer_klass.new(data)
 
         if printer_klass == ::RubyProf::MultiPrinter
-          printer.print(@options.merge(:profile => "#{path}-#{base_name}"))
+          printer.print(@options.merge(:profile => profile))
         elsif printer_klass == ::RubyProf::CallTreePrinter
-          printer.print(@options.merge(:profile => "#{path}-#{base_name}"))
+          printer.print(@options.merge(:profile => profile))
         else
-          file_name = ::File.join(@tmpdir, "#{path}-#{base_name}")
+          file_name = ::File.join(@tmpdir, profile + ::RubyProf::CompressedWriter::EXTENSIONS[@options[:compress]].to_s)
           ::File.open(file_name, 'wb') do |file|
             printer.print(file, @options)
           end
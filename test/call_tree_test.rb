@@ -67,6 +67,22 @@ class CallTreeTest < Minitest::Test
     assert_equal(call_tree_parent, call_tree_child.parent)
   end
 
+  def test_depth
+    call_tree_root = RubyProf::CallTree.new(RubyProf::MethodInfo.new(Base64, :encode64))
+    call_tree_parent = RubyProf::CallTree.new(RubyProf::MethodInfo.new(Array, :pack))
+    call_tree_child = RubyProf::CallTree.new(RubyProf::MethodInfo.new(String, :to_s))
+
+    call_tree_parent.add_child(call_tree_child)
+    assert_equal(0, call_tree_parent.depth)
+    assert_equal(1, call_tree_child.depth)
+
+    # Attaching a call tree to a new parent moves its whole subtree down
+    call_tree_root.add_child(call_tree_parent)
+    assert_equal(0, call_tree_root.depth)
+    assert_equal(1, call_tree_parent.depth)
+    assert_equal(2, call_tree_child.depth)
+  end
+
   def test_merge
     call_tree_1 = create_call_tree_1
     call_tree_2 = create_call_tree_2
@@ -28,5 +28,73 @@ class CallTreeVisitorTest < TestCase
     assert_equal("<Class::RubyProf::C1>#sleep_wait", method_names[1])
     assert_equal("Kernel#sleep", method_names[2])
   end
-end
 
+  def test_walk_events
+    result = RubyProf.profile do
+      RubyProf::C1.sleep_wait
+    end
+
+    events = Array.new
+    result.threads.first.call_tree.walk do |call_tree, event|
+      events << [call_tree.target.full_name, event]
+    end
+
+    assert_equal([["CallTreeVisitorTest#test_walk_events", :enter],
+                  ["<Class::RubyProf::C1>#sleep_wait", :enter],
+                  ["Kernel#sleep", :enter],
+                  ["Kernel#sleep", :exit],
+                  ["<Class::RubyProf::C1>#sleep_wait", :exit],
+                  ["CallTreeVisitorTest#test_walk_events", :exit]], events)
+  end
+
+  def test_each_preorder
+    result = RubyProf.profile do
+      RubyProf::C1.sleep_wait
+      RubyProf::C1.new.sleep_wait
+    end
+
+    call_tree = result.threads.first.call_tree
+    expected = Array.new
+    RubyProf::CallTreeVisitor.new(call_tree).visit do |node, event|
+      expected << node if event == :enter
+    end
+
+    assert_equal(expected, call_tree.each_preorder.to_a)
+  end
+
+  def test_walk_max_depth
+    result = RubyProf.profile do
+      RubyProf::C1.sleep_wait
+    end
+
+    call_tree = result.threads.first.call_tree
+    assert_equal([call_tree], call_tree.each_preorder(max_depth: 0).to_a)
+    assert_equal(["CallTreeVisitorTest#test_walk_max_depth", "<Class::RubyProf::C1>#sleep_wait"],
+                 call_tree.each_preorder(max_depth: 1).map {|node| node.target.full_name})
+  end
+
+  def test_walk_threshold
+    result = RubyProf.profile do
+      RubyProf::C1.sleep_wait
+      RubyProf::C2.new.sleep_wait
+    end
+
+    call_tree = result.threads.first.call_tree
+    method_names = call_tree.each_preorder(threshold: 0.2).map {|node| node.target.full_name}
+    assert_equal(["CallTreeVisitorTest#test_walk_threshold", "RubyProf::M1#sleep_wait", "Kernel#sleep"], method_names)
+  end
+
+  def test_walk_deep
+    depth = 5000
+    root = RubyProf::CallTree.new(RubyProf::MethodInfo.new(Array, :size))
+    parent = root
+    depth.times do |i|
+      child = RubyProf::CallTree.new(RubyProf::MethodInfo.new(i.even? ? String : Array, :size))
+      parent.add_child(child)
+      parent = child
+    end
+
+    assert_equal(depth + 1, root.each_preorder.count)
+    assert_equal(depth, root.each_preorder.max_by(&:depth).depth)
+  end
+end
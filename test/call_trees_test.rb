@@ -63,4 +63,56 @@ class CallTreesTest < TestCase
     end
     assert(true)
   end
+
+  def test_aggregates_cached
+    result = RubyProf.profile do
+      some_method_1
+    end
+
+    call_trees = result.threads.first.methods[1].call_trees
+    callers = call_trees.callers
+    assert_same(callers[0], call_trees.callers[0])
+    assert_same(call_trees.callees[0], call_trees.callees[0])
+
+    # Changing a measurement updates the aggregates
+    call_trees.call_trees[0].measurement.total_time = 5.0
+    assert_in_delta(5.0, call_trees.callers[0].total_time)
+
+    call_trees.call_trees[0].children[0].measurement.total_time = 3.0
+    assert_in_delta(3.0, call_trees.callees[0].total_time)
+  end
+
+  def test_aggregates_cached_per_profile
+    result = RubyProf.profile do
+      some_method_1
+    end
+
+    call_trees = result.threads.first.methods[1].call_trees
+    callers = call_trees.callers
+
+    # Profiling again does not change the call trees of the first profile
+    RubyProf.profile do
+      some_method_1
+    end
+    assert_same(callers[0], call_trees.callers[0])
+    assert_equal(1, call_trees.min_depth)
+  end
+
+  def test_hold_onto_aggregates
+    result = RubyProf.profile do
+      some_method_1
+    end
+
+    call_trees = result.threads.first.methods[1].call_trees
+    callers = call_trees.callers
+
+    # Rebuilding the aggregates does not free the ones already handed out
+    call_trees.call_trees[0].measurement.total_time = 5.0
+    call_trees.callees
+    GC.start
+
+    assert_equal('CallTreesTest#test_hold_onto_aggregates', callers[0].parent.target.full_name)
+    refute_in_delta(5.0, callers[0].total_time)
+    assert_in_delta(5.0, call_trees.callers[0].total_time)
+  end
 end
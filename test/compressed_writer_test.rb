@@ -0,0 +1,95 @@
+#!/usr/bin/env ruby
+# encoding: UTF-8
+
+require File.expand_path('../test_helper', __FILE__)
+require 'stringio'
+require 'zlib'
+require_relative 'prime'
+
+class CompressedWriterTest < TestCase
+  def setup
+    # WALL_TIME so we can use sleep in our test and get same measurements on linux and windows
+    RubyProf::measure_mode = RubyProf::WALL_TIME
+  end
+
+  def test_gzip
+    output = StringIO.new(String.new)
+    writer = RubyProf::CompressedWriter.new(output, :gzip)
+    writer << "a" * 100_000
+    writer.puts("b", 1)
+    writer.print("c")
+    writer.printf("%d\n", 2)
+    assert_equal(3, writer.write("d", "ef"))
+    refute(writer.finished?)
+
+    assert_equal(output, writer.finish)
+    assert(writer.finished?)
+    assert_operator(output.string.bytesize, :<, 1000)
+    assert_equal("a" * 100_000 + "b\n1\nc2\ndef", Zlib.gunzip(output.string))
+
+    # Finishing again leaves the output alone
+    assert_equal(output, writer.finish)
+    assert_equal("a" * 100_000 + "b\n1\nc2\ndef", Zlib.gunzip(output.string))
+
+    error = assert_raises(IOError) do
+      writer << "g"
+    end
+    assert_equal("compressed stream is finished", error.message)
+  end
+
+  def test_chunks
+    chunks = Array.new
+    writer = RubyProf::CompressedWriter.new(chunks, :gzip, 0)
+    writer << Random.new(1).bytes(200_000)
+    writer.finish
+
+    assert_operator(chunks.size, :>, 1)
+    assert(chunks.all? { |chunk| chunk.bytesize <= 65536 })
+    assert_equal(Random.new(1).bytes(200_000), Zlib.gunzip(chunks.join))
+  end
+
+  def test_zstd
+    skip("ruby-prof was built without zstd") unless RubyProf::CompressedWriter.formats.include?(:zstd)
+
+    output = StringIO.new(String.new)
+    writer = RubyProf::CompressedWriter.new(output, :zstd)
+    writer << "a" * 100_000
+    writer.finish
+
+    # Zstandard frame magic number
+    assert_equal("\x28\xB5\x2F\xFD".b, output.string[0, 4])
+    assert_operator(output.string.bytesize, :<, 1000)
+  end
+
+  def test_invalid_format
+    error = assert_raises(ArgumentError) do
+      RubyProf::CompressedWriter.new(StringIO.new, :bzip2)
+    end
+    assert_equal("Unsupported compression format: :bzip2", error.message)
+  end
+
+  def test_printer
+    result = RubyProf.profile do
+      run_primes(200)
+    end
+
+    output = StringIO.new
+    RubyProf::GraphHtmlPrinter.new(result).print(output)
+
+    compressed = StringIO.new(String.new)
+    RubyProf::GraphHtmlPrinter.new(result).print(compressed, :compress => :gzip)
+    assert_equal(output.string, Zlib.gunzip(compressed.string))
+  end
+
+  def test_call_tree_printer
+    result = RubyProf.profile do
+      run_primes(200)
+    end
+
+    Dir.mktmpdir do |path|
+      RubyProf::CallTreePrinter.new(result).print(:path => path, :compress => :gzip)
+      file = File.join(path, "callgrind.out.#{$$}.gz")
+      assert_match(/\Apositions: line\nevents: wall_time\n/, Zlib.gunzip(File.binread(file)))
+    end
+  end
+end
@@ -7,6 +7,18 @@ require 'timeout'
 require 'set'
 require_relative './scheduler'
 
+# Scheduler whose kernel_sleep calls block through a helper that yields
+class YieldingScheduler < Scheduler
+  def kernel_sleep(duration = nil)
+    wait_for { self.block(:sleep, duration) }
+    true
+  end
+
+  def wait_for
+    yield
+  end
+end
+
 # --  Tests ----
 class FiberTest < TestCase
   def worker
@@ -215,7 +227,61 @@ class FiberTest < TestCase
     assert_in_delta(0, method.children_time)
   end
 
+  def test_fibers_merge_fibers
+    result = RubyProf.profile(:merge_fibers => true) { enumerator_with_fibers }
+
+    assert_equal(1, result.threads.size)
+
+    thread = result.threads[0]
+    methods = thread.methods.sort.reverse
+    assert_equal(9, methods.count)
+
+    method = methods.detect {|m| m.full_name == 'Enumerator::Yielder#yield'}
+    assert_equal(2, method.called)
+
+    call_tree = thread.call_tree.children[0].children.detect {|c| c.target.full_name == 'Enumerator#next'}
+    assert_equal(2, call_tree.called)
+    assert_equal(1, call_tree.children.size)
+
+    call_tree = call_tree.children[0]
+    assert_equal('Enumerator#each', call_tree.target.full_name)
+    assert_equal(1, call_tree.called)
+    assert_equal('Enumerator#next', call_tree.parent.target.full_name)
+  end
+
+  def test_fiber_resume_merge_fibers
+    result = RubyProf.profile(:merge_fibers => true) { fiber_yield_resume }
+
+    assert_equal(1, result.threads.size)
+
+    thread = result.threads[0]
+    methods = thread.methods.sort.reverse
+    assert_equal(6, methods.count)
+
+    method = methods.detect {|m| m.full_name == 'FiberTest#fiber_yield_resume'}
+    assert_equal(2, method.called)
+    assert_equal(2, method.call_trees.call_trees.size)
+
+    method = methods.detect {|m| m.full_name == '<Class::Fiber>#yield'}
+    assert_equal(2, method.called)
+
+    call_tree = method.call_trees.call_trees[0]
+    assert_equal('FiberTest#fiber_yield_resume', call_tree.parent.target.full_name)
+    assert_equal('Fiber#resume', call_tree.parent.parent.target.full_name)
+  end
+
   if Gem::Version.new(RUBY_VERSION) >= Gem::Version.new('3.1.0')
+    def test_times_merge_fibers
+      result  = RubyProf.profile(:merge_fibers => true) { concurrency }
+
+      assert_equal(1, result.threads.size)
+
+      method = result.threads[0].methods.detect {|m| m.full_name == 'FiberTest#worker'}
+      assert_equal(3, method.called)
+      assert_in_delta(1.5, method.total_time, 0.2)
+      assert_equal(1, method.call_trees.call_trees.size)
+    end
+
     def test_times_no_merge
       result  = RubyProf.profile { concurrency }
 
@@ -247,5 +313,136 @@ class FiberTest < TestCase
       assert_in_delta(0.0, thread.call_tree.target.wait_time)
       assert_in_delta(1.5, thread.call_tree.target.children_time, 0.2)
     end
+
+    def test_times_merge_dead_fibers
+      result  = RubyProf.profile(:merge_dead_fibers => true) { concurrency }
+
+      assert_equal(2, result.threads.size)
+
+      thread = result.threads[1]
+      assert_in_delta(1.5, thread.call_tree.target.total_time, 0.2)
+      assert_in_delta(0.0, thread.call_tree.target.self_time)
+      assert_in_delta(1.5, thread.call_tree.target.children_time, 0.2)
+
+      method = thread.methods.detect {|m| m.full_name == 'FiberTest#worker'}
+      assert_equal(3, method.called)
+      assert_equal(1, method.call_trees.call_trees.size)
+    end
+
+    def test_scheduler_waits
+      result = RubyProf.profile { concurrency }
+
+      sleeps = result.threads.map do |thread|
+        thread.methods.detect {|m| m.full_name == 'Kernel#sleep'}
+      end.compact
+      assert_equal(3, sleeps.size)
+
+      sleeps.each do |method|
+        call_tree = method.call_trees.call_trees.first
+        assert_equal([:kernel_sleep], call_tree.waits.keys)
+
+        wait = call_tree.waits[:kernel_sleep]
+        assert_equal(1, wait.called)
+        assert_in_delta(0.5, wait.wait_time, 0.2)
+      end
+
+      # Nested hooks, the test scheduler's kernel_sleep calls block, are not counted twice
+      result.threads.each do |thread|
+        thread.methods.each do |method|
+          next if method.full_name == 'Kernel#sleep'
+          method.call_trees.call_trees.each do |call_tree|
+            assert_empty(call_tree.waits)
+          end
+        end
+      end
+    end
+
+    def test_scheduler_waits_nested_in_blocks
+      result = RubyProf.profile do
+        Fiber.set_scheduler(YieldingScheduler.new)
+        Fiber.schedule { sleep(0.1) }
+        Fiber.scheduler.close
+      end
+
+      sleep = result.threads.map do |thread|
+        thread.methods.detect {|m| m.full_name == 'Kernel#sleep'}
+      end.compact.first
+      assert_equal([:kernel_sleep], sleep.call_trees.call_trees.first.waits.keys)
+
+      wait_for = result.threads.map do |thread|
+        thread.methods.detect {|m| m.full_name == 'YieldingScheduler#wait_for'}
+      end.compact.first
+      assert_empty(wait_for.call_trees.call_trees.first.waits)
+    end
+
+    def test_scheduler_io_wait
+      result = RubyProf.profile do
+        Fiber.set_scheduler(Scheduler.new)
+        reader, writer = IO.pipe
+        Fiber.schedule { reader.read(5) }
+        Fiber.schedule do
+          sleep(0.1)
+          writer.write('hello')
+        end
+        Fiber.scheduler.close
+      end
+
+      read = result.threads.map do |thread|
+        thread.methods.detect {|m| m.full_name == 'IO#read'}
+      end.compact.first
+
+      wait = read.call_trees.call_trees.first.waits[:io_wait]
+      assert_equal(1, wait.called)
+      assert_in_delta(0.1, wait.wait_time, 0.05)
+    end
+
+    def test_scheduler_waits_merge_fibers
+      result = RubyProf.profile(:merge_fibers => true) { concurrency }
+
+      method = result.threads[0].methods.detect {|m| m.full_name == 'Kernel#sleep'}
+      wait = method.call_trees.call_trees.first.waits[:kernel_sleep]
+      assert_equal(3, wait.called)
+      assert_in_delta(1.5, wait.wait_time, 0.2)
+    end
+  end
+
+  def test_many_fibers_merge_dead_fibers
+    result = RubyProf.profile(:merge_dead_fibers => true) do
+      100.times do
+        Fiber.new { Array.new(10) }.resume
+      end
+    end
+
+    # Finished fibers are merged into one result as they finish
+    assert_equal(2, result.threads.size)
+
+    thread = result.threads[1]
+    assert_equal(100, thread.call_tree.target.called)
+    method = thread.methods.detect {|m| m.full_name == 'Array#initialize'}
+    assert_equal(100, method.called)
+  end
+
+  def test_threads_merge_dead_fibers
+    result = RubyProf.profile(:merge_dead_fibers => true) do
+      3.times.map do
+        Thread.new { Array.new(10) }
+      end.each(&:join)
+    end
+
+    # The root fibers of threads finish with their thread and are not merged
+    assert_equal(4, result.threads.size)
+    assert_equal(4, result.threads.map(&:id).uniq.size)
+  end
+
+  def test_many_fibers_merge_fibers
+    result = RubyProf.profile(:merge_fibers => true) do
+      100.times do
+        Fiber.new { Array.new(10) }.resume
+      end
+    end
+
+    assert_equal(1, result.threads.size)
+    method = result.threads[0].methods.detect {|m| m.full_name == 'Array#initialize'}
+    assert_equal(100, method.called)
   end
 end
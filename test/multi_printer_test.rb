@@ -54,6 +54,55 @@ class MultiPrinterTest < TestCase
     end
   end
 
+  def test_print
+    result = RubyProf.profile do
+      MSTPT.new.a
+    end
+
+    Dir.mktmpdir do |path|
+      printer = RubyProf::MultiPrinter.new(result, [:flat, :graph, :graph_html, :tree, :stack, :dot])
+      printer.print(:path => path, :profile => "multi", :min_percent => 0)
+
+      [printer.flat_report, printer.graph_report, printer.graph_html_report,
+       printer.stack_report, printer.dot_report].each do |report|
+        assert(File.size?(report), report)
+      end
+      # Callgrind files are named after the parent process even when written by a child
+      assert(File.size?(File.join(path, "callgrind.out.#{Process.pid}")))
+      assert_match(/MSTPT#a/, File.read(printer.flat_report))
+      assert_match(/label = "MSTPT"/, File.read(printer.dot_report))
+    end
+  end
+
+  def test_each_in_parallel
+    skip("fork is not supported") unless Process.respond_to?(:fork)
+
+    Dir.mktmpdir do |path|
+      RubyProf::MultiPrinter.each_in_parallel([1, 2, 3]) do |item|
+        File.write(File.join(path, item.to_s), Process.pid.to_s)
+      end
+      pids = (1..3).map { |item| File.read(File.join(path, item.to_s)).to_i }
+      assert_equal(3, pids.uniq.size)
+      refute_includes(pids, Process.pid)
+
+      RubyProf::MultiPrinter.each_in_parallel([4, 5], false) do |item|
+        File.write(File.join(path, item.to_s), Process.pid.to_s)
+      end
+      assert_equal(Process.pid, File.read(File.join(path, "4")).to_i)
+    end
+  end
+
+  def test_each_in_parallel_error
+    skip("fork is not supported") unless Process.respond_to?(:fork)
+
+    error = assert_raises(RuntimeError) do
+      RubyProf::MultiPrinter.each_in_parallel([1, 2]) do |item|
+        raise(ArgumentError, "bad report #{item}") if item == 2
+      end
+    end
+    assert_equal("ArgumentError: bad report 2", error.message)
+  end
+
   private
 
   def print(result)
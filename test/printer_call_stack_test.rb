@@ -4,6 +4,7 @@
 require File.expand_path('../test_helper', __FILE__)
 require 'fileutils'
 require 'tmpdir'
+require 'json'
 require_relative 'prime'
 
 # --  Tests ----
@@ -24,4 +25,31 @@ class PrinterCallStackTest < TestCase
     assert_match(/<!DOCTYPE html>/i, output)
     assert_match(/Object#run_primes/i, output)
   end
+
+  def test_call_stack_data
+    output = ''
+    RubyProf::CallStackPrinter.new(@result).print(output)
+
+    threads = output.scan(/<script type="application\/json" class="call-stack-thread">(.*?)<\/script>/m).map do |match|
+      JSON.parse(match.first)
+    end
+    assert_equal(@result.threads.size, threads.size)
+
+    thread = threads.first
+    call_trees = @result.threads.first.call_tree.each_preorder.to_a
+    nodes = thread["nodes"].each_slice(4).to_a
+    assert_equal(call_trees.size, nodes.size)
+    assert_in_delta(call_trees.first.total_time, thread["total_time"], 0.000001)
+
+    call_trees.zip(nodes).each do |call_tree, (method_index, _, total_time, called)|
+      method = thread["methods"][method_index]
+      assert_equal(call_tree.target.full_name, method[0])
+      assert_equal(call_tree.target.called, method[3])
+      assert_in_delta(call_tree.total_time, total_time, 0.000001)
+      assert_equal(call_tree.called, called)
+    end
+
+    # The end of each subtree is the start of the next sibling
+    assert_equal(nodes.size, nodes.first[1])
+  end
 end
@@ -23,8 +23,62 @@ class PrinterCallTreeTest < TestCase
     main_output_file_name = File.join(Dir.tmpdir, "callgrind.out.#{$$}")
     assert(File.exist?(main_output_file_name))
     output = File.read(main_output_file_name)
-    assert_match(/fn=Object::find_primes/i, output)
+    assert_match(/fn=\(\d+\) Object::find_primes/i, output)
     assert_match(/events: wall_time/i, output)
     refute_match(/d\d\d\d\d\d/, output) # old bug looked [in error] like Object::run_primes(d5833116)
   end
+
+  def test_call_tree_compression
+    printer = RubyProf::CallTreePrinter.new(@result)
+    printer.print(:path => Dir.tmpdir)
+    output = File.read(File.join(Dir.tmpdir, "callgrind.out.#{$$}"))
+    assert_match(/\Apositions: line\nevents: wall_time\n/, output)
+
+    files = Hash.new
+    functions = Hash.new
+    function = nil
+    costs = Hash.new { |hash, key| hash[key] = Array.new }
+    line = nil
+
+    output.each_line do |text|
+      case text
+      when /^c?fl=\((\d+)\)(?: (.*))?$/
+        if $2
+          refute(files.key?($1), "File #{$1} defined twice")
+          files[$1] = $2
+        else
+          assert(files.key?($1), "File #{$1} used before it was defined")
+        end
+      when /^(c?)fn=\((\d+)\)(?: (.*))?$/
+        if $3
+          refute(functions.key?($2), "Function #{$2} defined twice")
+          functions[$2] = $3
+        else
+          assert(functions.key?($2), "Function #{$2} used before it was defined")
+        end
+        if $1.empty?
+          function = functions[$2]
+          line = nil
+        end
+      when /^(\d+|[+-]\d+|\*) (\d+)$/
+        position, cost = $1, $2.to_i
+        line = if position == "*"
+                 line
+               elsif position.start_with?("+", "-")
+                 line + position.to_i
+               else
+                 position.to_i
+               end
+        costs[function] << [line, cost]
+      end
+    end
+
+    method = @result.threads.first.methods.detect { |m| m.full_name == "Object#run_primes" }
+    expected = [[method.line, (method.self_time * 1_000_000).round]]
+    method.call_trees.callees.each do |callee|
+      expected << [callee.line, (callee.total_time * 1_000_000).round]
+    end
+    assert_equal(expected, costs["Object::run_primes"])
+    assert_includes(files.values, File.expand_path("prime.rb", __dir__))
+  end
 end
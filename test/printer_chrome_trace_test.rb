@@ -0,0 +1,107 @@
+#!/usr/bin/env ruby
+# encoding: UTF-8
+
+require File.expand_path('../test_helper', __FILE__)
+require 'stringio'
+require 'json'
+require_relative 'prime'
+
+# --  Tests ----
+class PrinterChromeTraceTest < TestCase
+  def setup
+    # WALL_TIME so we can use sleep in our test and get same measurements on linux and windows
+    RubyProf::measure_mode = RubyProf::WALL_TIME
+  end
+
+  def a
+    sleep(0.01)
+  end
+
+  def b
+    sleep(0.02)
+  end
+
+  def run_threads
+    threads = [Thread.new { a }, Thread.new { b }]
+    threads.each(&:join)
+  end
+
+  def print(result, options = {})
+    output = StringIO.new
+    RubyProf::ChromeTracePrinter.new(result).print(output, options)
+    JSON.parse(output.string)
+  end
+
+  def calls(document)
+    document["traceEvents"].select { |event| event["ph"] == "X" }
+  end
+
+  def test_chrome_trace
+    result = RubyProf.profile(:record_events => true) do
+      run_threads
+    end
+
+    document = print(result)
+    assert_equal("ms", document["displayTimeUnit"])
+
+    # Each Ruby thread is a process with a named track
+    names = document["traceEvents"].select { |event| event["ph"] == "M" }
+    assert_equal(result.threads.map { |thread| "Thread #{thread.id}" }.uniq.sort,
+                 names.select { |event| event["name"] == "process_name" }.map { |event| event["args"]["name"] }.sort)
+    assert_equal(result.threads.map { |thread| "Fiber #{thread.fiber_id}" }.sort,
+                 names.select { |event| event["name"] == "thread_name" }.map { |event| event["args"]["name"] }.sort)
+
+    a = calls(document).detect { |event| event["name"] == "PrinterChromeTraceTest#a" }
+    b = calls(document).detect { |event| event["name"] == "PrinterChromeTraceTest#b" }
+    refute_equal(a["pid"], b["pid"])
+    assert_in_delta(10_000, a["dur"], 10_000)
+    assert_in_delta(20_000, b["dur"], 10_000)
+    assert_equal("ruby", a["cat"])
+    assert_equal(File.expand_path(__FILE__), File.expand_path(a["args"]["file"]))
+    assert_equal(method(:a).source_location[1], a["args"]["line"])
+
+    # The threads ran at the same time
+    assert_operator(a["ts"], :<, b["ts"] + b["dur"])
+    assert_operator(b["ts"], :<, a["ts"] + a["dur"])
+  end
+
+  def test_chrome_trace_requires_events
+    result = RubyProf.profile do
+      run_primes(200, 1000)
+    end
+
+    error = assert_raises(ArgumentError) do
+      print(result)
+    end
+    assert_match(/record_events/, error.message)
+  end
+
+  def test_chrome_trace_skips_threads_without_events
+    result = RubyProf.profile(:record_events => true) do
+      run_threads
+    end
+
+    # A thread added without recorded events is not laid out against the recorded ones
+    method_info = RubyProf::MethodInfo.new(Array, :size)
+    result.add_thread(RubyProf::Thread.new(RubyProf::CallTree.new(method_info), Thread.current, Fiber.current))
+
+    document = print(result)
+    refute(calls(document).any? { |event| event["name"] == "Array#size" })
+    assert_equal(result.threads.size - 1, document["traceEvents"].count { |event| event["name"] == "thread_name" })
+  end
+
+  def test_chrome_trace_filters
+    result = RubyProf.profile(:record_events => true) do
+      run_primes(200, 1000)
+      b
+    end
+
+    all = calls(print(result))
+    calls = calls(print(result, :min_duration => 0.015))
+    assert_operator(calls.size, :<, all.size)
+    assert(calls.all? { |event| event["dur"] >= 15_000 })
+    assert(calls.any? { |event| event["name"] == "PrinterChromeTraceTest#b" })
+
+    assert_equal(5, calls(print(result, :max_events => 5)).size)
+  end
+end
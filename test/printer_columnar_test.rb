@@ -0,0 +1,121 @@
+#!/usr/bin/env ruby
+# encoding: UTF-8
+
+require File.expand_path('../test_helper', __FILE__)
+require 'stringio'
+require_relative 'prime'
+
+# --  Tests ----
+class PrinterColumnarTest < TestCase
+  def setup
+    # WALL_TIME so we can use sleep in our test and get same measurements on linux and windows
+    RubyProf::measure_mode = RubyProf::WALL_TIME
+    @result = RubyProf.profile(:track_allocations => true) do
+      run_primes(200, 1000)
+    end
+  end
+
+  # Reads a table into a hash of column name to values
+  def decode(data)
+    assert_equal("RPCOLUMN", data[0, 8])
+    version, columns_count, rows_count = data[8, 16].unpack("VVQ<")
+    assert_equal(1, version)
+
+    offset = 24
+    columns = Array.new(columns_count) do
+      type, length = data[offset, 2].unpack("CC")
+      name = data[offset + 2, length]
+      offset += 2 + length
+      [name, type]
+    end
+
+    columns.each_with_object(Hash.new) do |(name, type), result|
+      offset += (8 - offset % 8) % 8
+      case type
+        when 1, 2, 3
+          result[name] = data[offset, rows_count * 8].unpack({1 => "Q<", 2 => "q<", 3 => "E"}[type] + "*")
+          offset += rows_count * 8
+        when 4
+          offsets = data[offset, (rows_count + 1) * 8].unpack("Q<*")
+          offset += (rows_count + 1) * 8
+          result[name] = offsets.each_cons(2).map { |start, stop| data[offset + start, stop - start].force_encoding("UTF-8") }
+          offset += offsets.last
+      end
+    end.tap do
+      assert_equal(data.bytesize, offset + (8 - offset % 8) % 8)
+    end
+  end
+
+  def print(table)
+    output = StringIO.new(String.new)
+    RubyProf::Report.print_columns(@result.threads, output, table)
+    decode(output.string)
+  end
+
+  def test_methods
+    methods = print(:methods)
+    thread = @result.threads.first
+    assert_equal(thread.methods.size, methods["id"].size)
+    assert_equal([thread.fiber_id], methods["thread"].uniq)
+
+    index = methods["name"].index("find_primes")
+    method = thread.methods.detect { |m| m.full_name == "Object#find_primes" }
+    assert_equal("Object", methods["class"][index])
+    assert_equal(method.source_file, methods["file"][index])
+    assert_equal(method.line, methods["line"][index])
+    assert_equal(method.called, methods["called"][index])
+    assert_equal(method.total_time, methods["total"][index])
+    assert_equal(method.self_time, methods["self"][index])
+    assert_equal(method.children_time, methods["children"][index])
+
+    index = methods["name"].index("select")
+    assert_equal("", methods["file"][index])
+  end
+
+  def test_edges
+    methods = print(:methods)
+    edges = print(:edges)
+    names = methods["id"].zip(methods["class"].zip(methods["name"]).map { |klass, name| "#{klass}##{name}" }).to_h
+
+    expected = @result.threads.first.methods.flat_map do |method|
+      method.call_trees.callees.map do |callee|
+        [method.full_name, callee.target.full_name, callee.called, callee.total_time]
+      end
+    end
+    actual = edges["caller"].each_index.map do |i|
+      [names[edges["caller"][i]], names[edges["callee"][i]], edges["calls"][i], edges["total"][i]]
+    end
+    assert_equal(expected.sort, actual.sort)
+    assert_includes(actual.map { |edge| edge.first(3) }, ["Object#find_primes", "Array#select", 1])
+  end
+
+  def test_allocations
+    methods = print(:methods)
+    allocations = print(:allocations)
+
+    method = @result.threads.first.methods.detect { |m| m.full_name == "Object#make_random_array" }
+    id = methods["id"][methods["name"].index("make_random_array")]
+    rows = allocations["method"].each_index.select { |i| allocations["method"][i] == id }
+    assert_equal(method.allocations.map(&:klass_name).sort, rows.map { |i| allocations["class"][i] }.sort)
+    assert_equal(method.allocations.sum(&:count), rows.sum { |i| allocations["count"][i] })
+    assert_equal(method.allocations.sum(&:memory), rows.sum { |i| allocations["bytes"][i] })
+  end
+
+  def test_printer
+    Dir.mktmpdir do |path|
+      printer = RubyProf::ColumnarPrinter.new(@result)
+      printer.print(:path => path, :profile => "columns")
+
+      RubyProf::ColumnarPrinter::TABLES.each do |table|
+        assert_equal(File.join(path, "columns.#{table}.col"), printer.file_path(table))
+        refute_empty(decode(File.binread(printer.file_path(table))))
+      end
+    end
+  end
+
+  def test_unsupported_table
+    assert_raises(ArgumentError) do
+      RubyProf::Report.print_columns(@result.threads, StringIO.new, :calls)
+    end
+  end
+end
@@ -0,0 +1,76 @@
+#!/usr/bin/env ruby
+# encoding: UTF-8
+
+require File.expand_path('../test_helper', __FILE__)
+require 'stringio'
+require_relative 'prime'
+
+# --  Tests ----
+class PrinterDotTest < TestCase
+  def setup
+    # WALL_TIME so we can use sleep in our test and get same measurements on linux and windows
+    RubyProf::measure_mode = RubyProf::WALL_TIME
+    @result = RubyProf.profile do
+      run_primes(1000, 5000)
+    end
+  end
+
+  def print(options = {})
+    output = StringIO.new
+    RubyProf::DotPrinter.new(@result).print(output, options)
+    output.string
+  end
+
+  def nodes(dot)
+    dot.scan(/^(n\d+_\d+) \[label="(.*)\\n\(\d+%\)"\];$/).to_h
+  end
+
+  def edges(dot)
+    dot.scan(/^(\w+) -> (\w+) \[label="([\d\/]+)"/)
+  end
+
+  def test_dot
+    dot = print
+    assert_match(/\Adigraph "Profile" \{\n/, dot)
+    assert_equal(dot.count("{"), dot.count("}"))
+
+    nodes = nodes(dot)
+    assert_equal(@result.threads.first.methods.size, nodes.size)
+    assert_includes(nodes.values, "find_primes")
+    assert_match(/^subgraph cluster_\d+_\d+ \{\nlabel = "Object";/, dot)
+
+    # Callers point to their callees
+    names = nodes.invert
+    assert_includes(edges(dot), [names["find_primes"], names["select"], "1/1"])
+    refute_match(/other/, dot)
+  end
+
+  def test_dot_max_nodes
+    dot = print(:max_nodes => 3, :clusters => false)
+
+    nodes = nodes(dot)
+    assert_equal(["Object#find_primes", "Object#run_primes", "PrinterDotTest#setup"], nodes.values.sort)
+    refute_match(/cluster/, dot)
+
+    # Calls to methods that are left out go to a single node
+    other = "other#{@result.threads.first.fiber_id}"
+    assert_match(/^#{other} \[label="#{@result.threads.first.methods.size - 3} other methods"/, dot)
+    assert(edges(dot).any? { |from, to, _| from == nodes.invert["Object#find_primes"] && to == other })
+  end
+
+  def test_dot_min_percent
+    dot = print(:min_percent => 50)
+    nodes = nodes(dot)
+    assert(nodes.size < @result.threads.first.methods.size)
+
+    method = @result.threads.first.methods.detect { |m| m.full_name == "Object#run_primes" }
+    assert_includes(nodes.values, method.method_name.to_s)
+  end
+
+  def test_dot_edge_percent
+    all = edges(print)
+    some = edges(print(:edge_percent => 50))
+    assert_operator(some.size, :<, all.size)
+    refute_empty(some)
+  end
+end
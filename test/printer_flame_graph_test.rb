@@ -0,0 +1,67 @@
+#!/usr/bin/env ruby
+# encoding: UTF-8
+
+require File.expand_path('../test_helper', __FILE__)
+require 'stringio'
+require_relative 'prime'
+
+# --  Tests ----
+class PrinterFlameGraphTest < TestCase
+  def setup
+    # WALL_TIME so we can use sleep in our test and get same measurements on linux and windows
+    RubyProf::measure_mode = RubyProf::WALL_TIME
+    @result = RubyProf.profile do
+      run_primes(1000, 5000)
+    end
+  end
+
+  def expected_stacks(value_scale)
+    result = Hash.new(0)
+    path = Array.new
+    @result.threads.each do |thread|
+      thread.call_tree.walk do |call_tree, event|
+        if event == :enter
+          path << call_tree.target.full_name
+          value = (call_tree.self_time * value_scale).round
+          result[path.join(";")] += value if value > 0
+        else
+          path.pop
+        end
+      end
+    end
+    result
+  end
+
+  def parse(output)
+    output.each_line.each_with_object(Hash.new(0)) do |line, result|
+      assert_match(/\A\S.* \d+\n\z/, line)
+      stack, _, value = line.rpartition(" ")
+      result[stack] += value.to_i
+    end
+  end
+
+  def test_flame_graph
+    output = StringIO.new
+    RubyProf::FlameGraphPrinter.new(@result).print(output)
+
+    stacks = parse(output.string)
+    assert_equal(expected_stacks(1_000_000), stacks)
+    assert(stacks.keys.any? { |stack| stack.end_with?("Object#run_primes;Object#find_primes;Array#select;Object#is_prime") })
+  end
+
+  def test_flame_graph_value_scale
+    output = StringIO.new
+    RubyProf::FlameGraphPrinter.new(@result).print(output, :value_scale => 1000)
+    assert_equal(expected_stacks(1000), parse(output.string))
+  end
+
+  def test_flame_graph_allocations
+    result = RubyProf.profile(:measure_mode => RubyProf::ALLOCATIONS, :track_allocations => true) do
+      Array.new(10) { Object.new }
+    end
+
+    output = StringIO.new
+    RubyProf::FlameGraphPrinter.new(result).print(output)
+    assert_match(/<Class::Array>#new;Array#initialize;Class#new 10$/, output.string)
+  end
+end
@@ -96,4 +96,29 @@ class PrinterFlatTest < TestCase
 
     assert self_percents.min >= 0.1
   end
+
+  def test_flat_native_report
+    result = self.run_profile
+
+    [{}, {min_percent: 1}, {sort_method: :total_time, filter_by: :total_time, max_percent: 50}].each do |options|
+      native = StringIO.new
+      RubyProf::FlatPrinter.new(result).print(native, options.dup)
+
+      printer = RubyProf::FlatPrinter.new(result)
+      def printer.native_report?
+        false
+      end
+      ruby = StringIO.new
+      printer.print(ruby, options.dup)
+
+      assert_equal(ruby.string, native.string)
+    end
+  end
+
+  def test_flat_report_unsupported_field
+    thread = self.run_profile.threads.first
+    assert_raises(ArgumentError) do
+      RubyProf::Report.print_flat(thread, String.new, sort_method: :full_name)
+    end
+  end
 end
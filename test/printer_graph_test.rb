@@ -37,4 +37,20 @@ class PrinterGraphTest < TestCase
       assert_sorted times
     end
   end
+
+  def test_graph_native_report
+    [{}, {min_percent: 1}, {sort_method: :self_time}].each do |options|
+      native = String.new
+      RubyProf::GraphPrinter.new(@result).print(native, options.dup)
+
+      printer = RubyProf::GraphPrinter.new(@result)
+      def printer.native_report?
+        false
+      end
+      ruby = String.new
+      printer.print(ruby, options.dup)
+
+      assert_equal(ruby, native)
+    end
+  end
 end
@@ -0,0 +1,149 @@
+#!/usr/bin/env ruby
+# encoding: UTF-8
+
+require File.expand_path('../test_helper', __FILE__)
+require 'stringio'
+require 'zlib'
+require_relative 'prime'
+
+# --  Tests ----
+class PrinterPprofTest < TestCase
+  def setup
+    # WALL_TIME so we can use sleep in our test and get same measurements on linux and windows
+    RubyProf::measure_mode = RubyProf::WALL_TIME
+    @result = RubyProf.profile do
+      run_primes(1000, 5000)
+    end
+  end
+
+  # Minimal protocol buffer decoding, returns the fields of a message as [field, value] pairs
+  def read_varint(io)
+    result = 0
+    shift = 0
+    loop do
+      byte = io.readbyte
+      result |= (byte & 0x7f) << shift
+      return result if byte < 0x80
+      shift += 7
+    end
+  end
+
+  def decode(bytes)
+    io = StringIO.new(bytes)
+    fields = Array.new
+    until io.eof?
+      key = read_varint(io)
+      case key & 7
+        when 0
+          fields << [key >> 3, read_varint(io)]
+        when 2
+          fields << [key >> 3, io.read(read_varint(io))]
+        else
+          flunk("Unexpected wire type #{key & 7}")
+      end
+    end
+    fields
+  end
+
+  def decode_packed(bytes)
+    io = StringIO.new(bytes)
+    result = Array.new
+    result << read_varint(io) until io.eof?
+    result
+  end
+
+  def parse(output)
+    profile = decode(Zlib.gunzip(output))
+    strings = profile.select { |field, _| field == 6 }.map { |_, value| value.force_encoding("UTF-8") }
+
+    functions = Hash.new
+    profile.each do |field, value|
+      next unless field == 5
+      function = decode(value).to_h
+      functions[function[1]] = {:name => strings[function[2]], :file => strings[function[4] || 0], :line => function[5] || 0}
+    end
+
+    locations = Hash.new
+    profile.each do |field, value|
+      next unless field == 4
+      location = decode(value)
+      line = decode(location.assoc(4)[1]).to_h
+      locations[location.assoc(1)[1]] = functions[line[1]]
+    end
+
+    sample_types = profile.select { |field, _| field == 1 }.map do |_, value|
+      value_type = decode(value).to_h
+      [strings[value_type[1]], strings[value_type[2]]]
+    end
+
+    samples = Hash.new { |hash, key| hash[key] = [0, 0] }
+    profile.each do |field, value|
+      next unless field == 2
+      sample = decode(value).to_h
+      stack = decode_packed(sample[1]).reverse.map { |id| locations[id][:name] }.join(";")
+      values = decode_packed(sample[2])
+      samples[stack][0] += values[0]
+      samples[stack][1] += values[1]
+    end
+
+    {:strings => strings, :functions => functions, :sample_types => sample_types, :samples => samples}
+  end
+
+  def expected_samples(value_scale)
+    result = Hash.new { |hash, key| hash[key] = [0, 0] }
+    path = Array.new
+    @result.threads.each do |thread|
+      thread.call_tree.walk do |call_tree, event|
+        if event == :enter
+          path << call_tree.target.full_name
+          value = (call_tree.self_time * value_scale).round
+          if value > 0
+            result[path.join(";")][0] += value
+            result[path.join(";")][1] += call_tree.called
+          end
+        else
+          path.pop
+        end
+      end
+    end
+    result
+  end
+
+  def test_pprof
+    output = StringIO.new
+    RubyProf::PprofPrinter.new(@result).print(output)
+    profile = parse(output.string)
+
+    assert_equal("", profile[:strings].first)
+    assert_equal(profile[:strings].uniq, profile[:strings])
+    assert_equal([["wall", "nanoseconds"], ["calls", "count"]], profile[:sample_types])
+    assert_equal(expected_samples(1_000_000_000), profile[:samples])
+
+    function = profile[:functions].values.detect { |value| value[:name] == "Object#find_primes" }
+    assert_equal(File.expand_path('../prime.rb', __FILE__), File.expand_path(function[:file]))
+    assert_equal(method(:find_primes).source_location[1], function[:line])
+  end
+
+  def test_pprof_value_scale
+    output = StringIO.new
+    RubyProf::PprofPrinter.new(@result).print(output, :value_scale => 1000)
+    profile = parse(output.string)
+
+    assert_equal([["wall", "milliseconds"], ["calls", "count"]], profile[:sample_types])
+    assert_equal(expected_samples(1000), profile[:samples])
+  end
+
+  def test_pprof_allocations
+    result = RubyProf.profile(:measure_mode => RubyProf::ALLOCATIONS, :track_allocations => true) do
+      Array.new(10) { Object.new }
+    end
+
+    output = StringIO.new
+    RubyProf::PprofPrinter.new(result).print(output)
+    profile = parse(output.string)
+
+    assert_equal([["allocations", "count"], ["calls", "count"]], profile[:sample_types])
+    stack = profile[:samples].keys.detect { |key| key.end_with?("<Class::Array>#new;Array#initialize;Class#new") }
+    assert_equal([10, 10], profile[:samples][stack])
+  end
+end
@@ -0,0 +1,148 @@
+#!/usr/bin/env ruby
+# encoding: UTF-8
+
+require File.expand_path('../test_helper', __FILE__)
+require 'stringio'
+require 'json'
+require 'fiber'
+require_relative 'prime'
+
+# --  Tests ----
+class PrinterSpeedscopeTest < TestCase
+  def setup
+    # WALL_TIME so we can use sleep in our test and get same measurements on linux and windows
+    RubyProf::measure_mode = RubyProf::WALL_TIME
+  end
+
+  def a
+    sleep(0.01)
+  end
+
+  def b
+    sleep(0.02)
+  end
+
+  def run_a_b_a
+    a
+    b
+    a
+  end
+
+  def print(result, options = {})
+    output = StringIO.new
+    RubyProf::SpeedscopePrinter.new(result).print(output, options)
+    JSON.parse(output.string)
+  end
+
+  # Returns the frames of each call as [name, open, close], checking the events are balanced
+  def calls(document, profile)
+    frames = document["shared"]["frames"]
+    stack = Array.new
+    result = Array.new
+    last = 0
+
+    profile["events"].each do |event|
+      assert_operator(event["at"], :>=, last)
+      last = event["at"]
+
+      if event["type"] == "O"
+        call = [frames[event["frame"]]["name"], event["at"], nil]
+        stack << call
+        result << call
+      else
+        call = stack.pop
+        assert_equal(call[0], frames[event["frame"]]["name"])
+        call[2] = event["at"]
+      end
+    end
+
+    assert_empty(stack)
+    assert_in_delta(last, profile["endValue"], 0.000001)
+    result
+  end
+
+  def test_speedscope_events
+    result = RubyProf.profile(:record_events => true) do
+      run_a_b_a
+    end
+    assert(result.record_events?)
+
+    document = print(result, :name => "a b a")
+    assert_equal("https://www.speedscope.app/file-format-schema.json", document["$schema"])
+    assert_equal("a b a", document["name"])
+    assert_equal("ruby-prof #{RubyProf::VERSION}", document["exporter"])
+    assert_equal(1, document["profiles"].size)
+
+    profile = document["profiles"].first
+    assert_equal("evented", profile["type"])
+    assert_equal("Thread #{result.threads.first.id}, Fiber #{result.threads.first.fiber_id}", profile["name"])
+    assert_equal("seconds", profile["unit"])
+    assert_equal(0, profile["startValue"])
+
+    # Calls are in the order they happened, not combined like in the call tree
+    calls = calls(document, profile)
+    names = calls.map(&:first).grep(/#(run_a_b_a|a|b)$/)
+    assert_equal(["PrinterSpeedscopeTest#run_a_b_a", "PrinterSpeedscopeTest#a", "PrinterSpeedscopeTest#b", "PrinterSpeedscopeTest#a"], names)
+
+    a1, b, a2 = calls.select { |name, _, _| name =~ /#(a|b)$/ }
+    assert_operator(a1[2], :<=, b[1])
+    assert_operator(b[2], :<=, a2[1])
+    assert_in_delta(0.02, b[2] - b[1], 0.01)
+
+    # Frames are shared between calls
+    frames = document["shared"]["frames"]
+    assert_equal(frames.map { |frame| frame["name"] }.uniq, frames.map { |frame| frame["name"] })
+    frame = frames.detect { |frame| frame["name"] == "PrinterSpeedscopeTest#a" }
+    assert_equal(File.expand_path(__FILE__), File.expand_path(frame["file"]))
+    assert_equal(method(:a).source_location[1], frame["line"])
+  end
+
+  def test_speedscope_call_tree
+    result = RubyProf.profile do
+      run_primes(1000, 5000)
+    end
+    assert(!result.record_events?)
+
+    document = nil
+    verbose, $VERBOSE = $VERBOSE, false
+    assert_output(nil, /synthesized from the call tree/) do
+      document = print(result)
+    end
+    $VERBOSE = verbose
+    assert_equal("ruby-prof", document["name"])
+
+    profile = document["profiles"].first
+    assert_match(/\(synthesized from the call tree\)\z/, profile["name"])
+    calls = calls(document, profile)
+
+    # Each call tree is laid out once, for its total time
+    call_tree = result.threads.first.call_tree
+    assert_equal(call_tree.target.full_name, calls.first[0])
+    assert_in_delta(call_tree.total_time, calls.first[2] - calls.first[1], 0.000001)
+    assert_equal(call_tree.each_preorder.map { |child| child.target.full_name }, calls.map(&:first))
+  end
+
+  def test_speedscope_fibers
+    result = RubyProf.profile(:record_events => true) do
+      fiber = Fiber.new do
+        a
+        Fiber.yield
+        b
+      end
+      fiber.resume
+      fiber.resume
+    end
+
+    document = print(result)
+    assert_equal(2, document["profiles"].size)
+    document["profiles"].each do |profile|
+      calls(document, profile)
+    end
+
+    fiber_profile = document["profiles"].detect do |profile|
+      calls(document, profile).any? { |name, _, _| name == "PrinterSpeedscopeTest#b" }
+    end
+    names = calls(document, fiber_profile).map(&:first).grep(/#(a|b)$/)
+    assert_equal(["PrinterSpeedscopeTest#a", "PrinterSpeedscopeTest#b"], names)
+  end
+end
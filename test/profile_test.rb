@@ -5,6 +5,10 @@ require File.expand_path('../test_helper', __FILE__)
 require_relative './call_tree_builder'
 
 class ProfileTest < TestCase
+  def profile_sort
+    RubyProf::Profile.profile { [3, 1, 2].sort }
+  end
+
   def test_measure_mode
     profile = RubyProf::Profile.new(:measure_mode => RubyProf::PROCESS_TIME)
     assert_equal(RubyProf::PROCESS_TIME, profile.measure_mode)
@@ -98,4 +102,65 @@ class ProfileTest < TestCase
     assert_in_delta(0.0, thread_1.call_tree.wait_time, 0.00001)
     assert_in_delta(11.6, thread_1.call_tree.children_time, 0.00001)
   end
+
+  def test_merge_profile
+    profile_1 = RubyProf::Profile.profile { 2.times { [3, 1, 2].sort } }
+    profile_2 = RubyProf::Profile.profile { 3.times { [3, 1, 2].sort } }
+    total_time = profile_1.threads.first.call_tree.total_time + profile_2.threads.first.call_tree.total_time
+
+    assert_same(profile_1, profile_1.merge!(profile_2))
+    GC.start
+
+    assert_equal(1, profile_1.threads.count)
+    thread = profile_1.threads.first
+    assert_in_delta(total_time, thread.call_tree.total_time, 0.00001)
+
+    method = thread.methods.detect { |m| m.full_name == "Array#sort" }
+    assert_equal(5, method.called)
+
+    method = thread.methods.detect { |m| m.full_name == "Integer#times" }
+    assert_equal(2, method.called)
+  end
+
+  def test_merge_profile_new_thread
+    profile_1 = RubyProf::Profile.profile { [3, 1, 2].sort }
+    profile_2 = profile_sort
+    profile_1.merge!(profile_2)
+
+    # The root methods differ so the thread of profile_2 is added with its own fiber id
+    assert_equal(2, profile_1.threads.count)
+    assert_equal("ProfileTest#profile_sort", profile_1.threads.last.call_tree.target.full_name)
+    fiber_ids = profile_1.threads.map(&:fiber_id)
+    assert_equal(fiber_ids.uniq, fiber_ids)
+  end
+
+  def test_merge_profile_allocations
+    profile_1 = RubyProf::Profile.profile(:track_allocations => true) { Array.new(3) }
+    profile_2 = RubyProf::Profile.profile(:track_allocations => true) { Array.new(3) }
+    counts = profile_2.threads.first.methods.map { |method| method.allocations.sum(&:count) }
+
+    profile_1.merge!(profile_2)
+    GC.start
+
+    # Allocations are copied, so other still reports its own
+    assert_equal(counts, profile_2.threads.first.methods.map { |method| method.allocations.sum(&:count) })
+    method = profile_1.threads.first.methods.max_by { |method| method.allocations.sum(&:count) }
+    assert_equal(2 * counts.max, method.allocations.sum(&:count))
+  end
+
+  def test_merge_profile_errors
+    profile_1 = RubyProf::Profile.profile { [3, 1, 2].sort }
+    profile_2 = RubyProf::Profile.profile(:measure_mode => RubyProf::ALLOCATIONS) { [3, 1, 2].sort }
+
+    assert_raises(ArgumentError) { profile_1.merge!(profile_1) }
+    assert_raises(ArgumentError) { profile_1.merge!(profile_2) }
+
+    profile_3 = RubyProf::Profile.new
+    profile_3.start
+    begin
+      assert_raises(RuntimeError) { profile_1.merge!(profile_3) }
+    ensure
+      profile_3.stop
+    end
+  end
 end
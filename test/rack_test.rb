@@ -25,6 +25,11 @@ module Rack
 end
 
 class RackTest < TestCase
+  def control_env(action, method: 'GET', query: '', secret: 'secret')
+    {:path => "/__ruby_prof#{action}", 'REQUEST_METHOD' => method, 'QUERY_STRING' => query,
+     'HTTP_X_RUBYPROF_SECRET' => secret}
+  end
+
   def test_create_print_path
     path = Dir.mktmpdir
     Dir.delete(path)
@@ -90,4 +95,328 @@ class RackTest < TestCase
     file_path = ::File.join(path, 'path-to-resource.json-dynamic.txt')
     assert(File.exist?(file_path))
   end
+
+  def test_sequential_printing
+    path = Dir.mktmpdir
+    names = []
+
+    printer = {::RubyProf::FlatPrinter => lambda { names << 'flat.txt'; names.last },
+               ::RubyProf::GraphPrinter => lambda { names << 'graph.txt'; names.last }}
+    adapter = Rack::RubyProf.new(FakeRackApp.new, :path => path, :printers => printer)
+
+    adapter.call(:fake_env)
+
+    assert_equal(['flat.txt', 'graph.txt'], names)
+    names.each do |base_name|
+      assert(File.exist?(::File.join(path, "path-to-resource.json-#{base_name}")))
+    end
+  end
+
+  def test_parallel_printing
+    path = Dir.mktmpdir
+    adapter = Rack::RubyProf.new(FakeRackApp.new, :path => path, :parallel => true)
+
+    adapter.call(:fake_env)
+
+    ['flat.txt', 'graph.txt', 'graph.html', 'call_stack.html'].each do |base_name|
+      assert(File.exist?(::File.join(path, "path-to-resource.json-#{base_name}")))
+    end
+  end
+
+  def test_sample_rate
+    profiled = 0
+    printer = {::RubyProf::FlatPrinter => lambda { profiled += 1; 'flat.txt' }}
+    adapter = Rack::RubyProf.new(FakeRackApp.new, :path => Dir.mktmpdir, :printers => printer, :sample_rate => 3)
+
+    9.times { adapter.call(:fake_env) }
+    assert_equal(3, profiled)
+  end
+
+  def test_max_concurrent
+    profiled = Array.new
+    adapter = nil
+    app = lambda do |env|
+      # Make a nested request while this one is being profiled
+      adapter.call({path: '/nested'}) if env[:path] == '/outer'
+    end
+    printer = {::RubyProf::FlatPrinter => lambda { profiled << 'flat.txt'; 'flat.txt' }}
+    adapter = Rack::RubyProf.new(app, :path => Dir.mktmpdir, :printers => printer, :max_concurrent => 1)
+
+    adapter.call({path: '/outer'})
+    assert_equal(1, profiled.size)
+
+    adapter.call({path: '/nested'})
+    assert_equal(2, profiled.size)
+  end
+
+  def test_path_rate
+    path = Dir.mktmpdir
+    profiled = Array.new
+    printer = {::RubyProf::FlatPrinter => lambda { profiled << 'flat.txt'; 'flat.txt' }}
+    adapter = Rack::RubyProf.new(FakeRackApp.new, :path => path, :printers => printer,
+                                 :path_rate => 0.001, :path_burst => 2)
+
+    3.times { adapter.call({path: '/a'}) }
+    assert_equal(2, profiled.size)
+
+    # Each path has its own bucket
+    adapter.call({path: '/b'})
+    assert_equal(3, profiled.size)
+    assert(File.exist?(::File.join(path, 'b-flat.txt')))
+
+    # Requests that are not profiled still reach the application
+    called = 0
+    adapter = Rack::RubyProf.new(lambda { |env| called += 1 }, :path => path, :printers => printer,
+                                 :path_rate => 0.001)
+    2.times { adapter.call({path: '/a'}) }
+    assert_equal(2, called)
+    assert_equal(4, profiled.size)
+  end
+
+  def test_async
+    path = Dir.mktmpdir
+    threads = Array.new
+    printer = {::RubyProf::FlatPrinter => lambda { threads << Thread.current; 'flat.txt' }}
+    adapter = Rack::RubyProf.new(FakeRackApp.new, :path => path, :printers => printer, :async => true)
+
+    adapter.call({path: '/a'})
+    adapter.call({path: '/b'})
+    adapter.close
+
+    assert_equal(2, threads.size)
+    refute_includes(threads, Thread.current)
+    assert(File.exist?(::File.join(path, 'a-flat.txt')))
+    assert(File.exist?(::File.join(path, 'b-flat.txt')))
+    assert_equal(0, adapter.dropped_profiles)
+
+    # The writer is started again after being closed
+    adapter.call({path: '/c'})
+    adapter.close
+    assert(File.exist?(::File.join(path, 'c-flat.txt')))
+  end
+
+  def test_async_enqueue_while_closing
+    path = Dir.mktmpdir
+    started = Queue.new
+    gate = Queue.new
+    printed = 0
+    printer = {::RubyProf::FlatPrinter => lambda { started << true; gate.pop if (printed += 1) == 1; 'flat.txt' }}
+    adapter = Rack::RubyProf.new(FakeRackApp.new, :path => path, :printers => printer, :async => true)
+
+    # Close while the writer is busy, then queue another profile before it finishes
+    adapter.call({path: '/a'})
+    started.pop
+    closer = Thread.new { adapter.close }
+    Thread.pass until closer.status == 'sleep'
+    adapter.call({path: '/b'})
+    gate << true
+
+    refute_nil(closer.join(5))
+    adapter.close
+    assert(File.exist?(::File.join(path, 'a-flat.txt')))
+    assert(File.exist?(::File.join(path, 'b-flat.txt')))
+  end
+
+  def test_async_drops_profiles
+    path = Dir.mktmpdir
+    adapter = Rack::RubyProf.new(FakeRackApp.new, :path => path, :async => true, :queue_size => 0)
+
+    2.times { adapter.call(:fake_env) }
+    adapter.close
+
+    assert_equal(2, adapter.dropped_profiles)
+    refute(File.exist?(::File.join(path, 'path-to-resource.json-flat.txt')))
+  end
+
+  def test_keep_if_slower_than
+    path = Dir.mktmpdir
+    app = lambda do |env|
+      sleep(0.05) if env[:path] == '/slow'
+      [200, {}, []]
+    end
+    adapter = Rack::RubyProf.new(app, :path => path, :keep_if_slower_than => 0.02)
+
+    assert_equal([200, {}, []], adapter.call({path: '/fast'}))
+    adapter.call({path: '/slow'})
+
+    refute(File.exist?(::File.join(path, 'fast-flat.txt')))
+    assert(File.exist?(::File.join(path, 'slow-flat.txt')))
+    assert_equal(1, adapter.discarded_profiles)
+  end
+
+  def test_keep_if_status
+    path = Dir.mktmpdir
+    app = lambda do |env|
+      [env[:path] == '/error' ? 500 : 200, {}, []]
+    end
+
+    [500..599, lambda { |status| status >= 500 }].each do |keep_if_status|
+      adapter = Rack::RubyProf.new(app, :path => path, :keep_if_status => keep_if_status)
+      adapter.call({path: '/ok'})
+      adapter.call({path: '/error'})
+
+      refute(File.exist?(::File.join(path, 'ok-flat.txt')))
+      assert(File.exist?(::File.join(path, 'error-flat.txt')))
+      assert_equal(1, adapter.discarded_profiles)
+      File.delete(::File.join(path, 'error-flat.txt'))
+    end
+  end
+
+  def test_aggregate
+    path = Dir.mktmpdir
+    app = lambda do |env|
+      3.times { [3, 1, 2].sort }
+      [200, {}, []]
+    end
+    profiles = Array.new
+    printer = {::RubyProf::FlatPrinter => 'flat.txt'}
+    adapter = Rack::RubyProf.new(app, :path => path, :printers => printer, :aggregate => true,
+                                 :route => lambda { |env| env[:path].sub(/\d+/, 'id') })
+
+    adapter.define_singleton_method(:print) do |data, path|
+      profiles << [data, path]
+      super(data, path)
+    end
+
+    3.times { |i| assert_equal([200, {}, []], adapter.call({path: "/orders/#{i}"})) }
+    adapter.call({path: '/users'})
+    assert_empty(Dir.children(path))
+
+    adapter.flush
+    assert_equal(%w(orders-id users), profiles.map(&:last).sort)
+    assert(File.exist?(::File.join(path, 'orders-id-flat.txt')))
+    assert(File.exist?(::File.join(path, 'users-flat.txt')))
+
+    data = profiles.rassoc('orders-id').first
+    method = data.threads.first.methods.detect { |m| m.full_name == 'Array#sort' }
+    assert_equal(9, method.called)
+
+    # Aggregation starts over after a flush
+    profiles.clear
+    adapter.close
+    assert_empty(profiles)
+  end
+
+  def test_aggregate_flush_interval
+    path = Dir.mktmpdir
+    threads = Array.new
+    printer = {::RubyProf::FlatPrinter => lambda { threads << Thread.current; 'flat.txt' }}
+    adapter = Rack::RubyProf.new(FakeRackApp.new, :path => path, :printers => printer, :aggregate => true,
+                                 :flush_interval => 0.05)
+
+    adapter.call({path: '/a'})
+    adapter.call({path: '/b'})
+    assert_empty(threads)
+
+    sleep(0.06)
+    adapter.call({path: '/a'})
+    adapter.close
+
+    # The reports of every route are written by the background writer, not the request
+    assert_equal(2, threads.size)
+    refute_includes(threads, Thread.current)
+    assert(File.exist?(::File.join(path, 'a-flat.txt')))
+    assert(File.exist?(::File.join(path, 'b-flat.txt')))
+  end
+
+  def test_aggregate_max_routes
+    path = Dir.mktmpdir
+    adapter = Rack::RubyProf.new(FakeRackApp.new, :path => path, :aggregate => true, :max_routes => 2)
+    written = Array.new
+    adapter.define_singleton_method(:print) do |data, path|
+      written << [path, Thread.current]
+      super(data, path)
+    end
+
+    adapter.call({path: '/a'})
+    adapter.call({path: '/b'})
+    adapter.call({path: '/a'})
+    adapter.call({path: '/c'})
+    adapter.close
+
+    # b was the least recently profiled route, so the background writer wrote it to make room for c
+    evicted, remaining = written.partition { |_, thread| thread != Thread.current }
+    assert_equal(%w(b), evicted.map(&:first))
+    assert_equal(%w(a c), remaining.map(&:first).sort)
+  end
+
+  def test_aggregate_async
+    path = Dir.mktmpdir
+    adapter = Rack::RubyProf.new(FakeRackApp.new, :path => path, :aggregate => true, :async => true)
+
+    2.times { adapter.call({path: '/a'}) }
+    adapter.close
+
+    assert(File.exist?(::File.join(path, 'a-flat.txt')))
+  end
+
+  def test_control_requires_secret
+    assert_raises(ArgumentError) do
+      Rack::RubyProf.new(FakeRackApp.new, :control_path => '/__ruby_prof')
+    end
+  end
+
+  def test_control_forbidden
+    adapter = Rack::RubyProf.new(FakeRackApp.new, :path => Dir.mktmpdir, :control_path => '/__ruby_prof', :control_secret => 'secret')
+
+    assert_equal(403, adapter.call(control_env('', secret: 'wrong')).first)
+    assert_equal(403, adapter.call(control_env('', secret: 'secret2')).first)
+    assert_equal(403, adapter.call(control_env('/start', method: 'POST', secret: nil)).first)
+    assert_equal(404, adapter.call(control_env('/unknown')).first)
+  end
+
+  def test_control
+    path = Dir.mktmpdir
+    app = lambda do |env|
+      [3, 1, 2].sort
+      [200, {}, []]
+    end
+    adapter = Rack::RubyProf.new(app, :path => path, :enabled => false,
+                                 :control_path => '/__ruby_prof', :control_secret => 'secret')
+
+    adapter.call({path: '/orders'})
+    assert_empty(Dir.children(path))
+
+    assert_equal(200, adapter.call(control_env('/start', method: 'POST')).first)
+    2.times { adapter.call({path: '/orders'}) }
+    assert_empty(Dir.children(path))
+
+    status, headers, body = adapter.call(control_env(''))
+    assert_equal(200, status)
+    assert_equal('application/json', headers['content-type'])
+    settings = JSON.parse(body.first)
+    assert(settings['enabled'])
+    assert_equal(['/orders'], settings['routes'])
+
+    status, _, body = adapter.call(control_env('/config', method: 'POST', query: 'sample_rate=10&path_rate=0.5'))
+    assert_equal(200, status)
+    assert_equal(10, JSON.parse(body.first)['sample_rate'])
+    assert_equal(0.5, JSON.parse(body.first)['path_rate'])
+    assert_equal(400, adapter.call(control_env('/config', method: 'POST', query: 'sample_rate=0')).first)
+
+    status, headers, body = adapter.call(control_env('/snapshot', query: 'route=%2Forders'))
+    assert_equal(200, status)
+    assert_equal('application/octet-stream', headers['content-type'])
+    profile = Marshal.load(body.first)
+    method = profile.threads.first.methods.detect { |m| m.full_name == 'Array#sort' }
+    assert_equal(2, method.called)
+
+    status, _, body = adapter.call(control_env('/snapshot', query: 'route=%2Forders&format=flamegraph'))
+    assert_equal(200, status)
+    assert_match(/Array#sort \d+$/, body.first)
+
+    status, _, body = adapter.call(control_env('/snapshot', query: 'route=%2Forders&format=callgrind'))
+    assert_equal(200, status)
+    assert_match(/^events: /, body.first)
+
+    assert_equal(404, adapter.call(control_env('/snapshot', query: 'route=%2Fusers')).first)
+    assert_equal(400, adapter.call(control_env('/snapshot', query: 'route=%2Forders&format=pdf')).first)
+
+    assert_equal(200, adapter.call(control_env('/stop', method: 'POST')).first)
+    refute(JSON.parse(adapter.call(control_env('')).last.first)['enabled'])
+
+    # Snapshots keep the aggregated profile, which is written on close
+    adapter.close
+    assert(File.exist?(::File.join(path, 'orders-flat.txt')))
+  end
 end
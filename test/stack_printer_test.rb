@@ -2,6 +2,7 @@
 # encoding: UTF-8
 
 require File.expand_path('../test_helper', __FILE__)
+require 'json'
 
 # Test data
 #     A
@@ -42,10 +43,11 @@ class StackPrinterTest < TestCase
 
     file_contents = nil
     file_contents = print(result)
-    re = /Thread: (\d+)(, Fiber: (\d+))? \([\.0-9]+.[\.0-9]+% ~ ([\.0-9]+)\)/
+    re = /<script type="application\/json" class="call-stack-thread">(.*?)<\/script>/m
     assert_match(re, file_contents)
-    file_contents =~ re
-    actual_time = $4.to_f
+    thread = JSON.parse(file_contents[re, 1])
+    assert_equal(result.threads.first.id.to_s, thread["id"])
+    actual_time = thread["total_time"]
     assert_in_delta(expected_time, actual_time, 0.1)
   end
 
@@ -13,6 +13,10 @@ class ThreadTest < TestCase
     RubyProf::measure_mode = RubyProf::WALL_TIME
   end
 
+  def recurse(depth)
+    recurse(depth - 1) if depth > 0
+  end
+
   def test_initialize
     method_info = RubyProf::MethodInfo.new(Array, :size)
     call_tree = RubyProf::CallTree.new(method_info)
@@ -50,6 +54,94 @@ class ThreadTest < TestCase
     assert_equal(2, result.threads.length)
   end
 
+  def test_min_depth
+    result = RubyProf.profile do
+      threads = 5.times.map do
+        Thread.new do
+          [3, 1, 2].sort.each { |i| i.to_s }
+        end
+      end
+      threads.each(&:join)
+    end
+
+    assert_equal(6, result.threads.length)
+    result.threads.each do |thread|
+      thread.methods.each do |method|
+        expected = method.call_trees.call_trees.map(&:depth).min
+        assert_equal(expected, method.call_trees.min_depth)
+      end
+    end
+  end
+
+  def test_min_depth_changed_call_tree
+    result = RubyProf.profile { [3, 1, 2].sort }
+    call_tree = result.threads.first.call_tree
+    method = call_tree.children.first.target
+    assert_equal(1, method.call_trees.min_depth)
+
+    method_info = RubyProf::MethodInfo.new(Array, :size)
+    root = RubyProf::CallTree.new(method_info)
+    root.add_child(call_tree)
+    assert_equal(2, method.call_trees.min_depth)
+  end
+
+  def test_deep_call_tree
+    result = RubyProf.profile { recurse(3000) }
+    thread = result.threads.first
+
+    # Call trees are flattened without recursing, so depth is not limited by the C stack
+    method = thread.methods.detect {|m| m.full_name == 'ThreadTest#recurse'}
+    assert_equal(1, method.call_trees.min_depth)
+    assert_equal(3001, method.call_trees.call_trees.size)
+
+    output = StringIO.new
+    RubyProf::FlameGraphPrinter.new(result).print(output)
+    assert_equal(3001, output.string.lines.map {|line| line.scan('ThreadTest#recurse').size}.max)
+  end
+
+  def test_wait_time_during_stop
+    profile = RubyProf::Profile.new
+    profile.start
+    100.times { recurse(100) }
+    thread = profile.threads.detect { |t| t.id == Thread.current.object_id }
+
+    # Read the thread from another Ruby thread while stop post processes it without the GVL
+    errors = Array.new
+    stopped = false
+    reader = Thread.new do
+      until stopped
+        begin
+          thread.wait_time
+        rescue RuntimeError => e
+          errors << e.message
+        end
+      end
+    end
+    profile.stop
+    stopped = true
+    reader.join
+
+    assert_empty(errors.uniq - ["RubyProf.stop has not finished"])
+    assert_kind_of(Float, thread.wait_time)
+  end
+
+  def test_wait_time
+    result = RubyProf.profile do
+      thread = Thread.new { sleep(0.5) }
+      thread.join
+    end
+
+    result.threads.each do |thread|
+      expected = thread.methods.sum do |method|
+        method.call_trees.call_trees.select(&:parent).sum(&:wait_time)
+      end
+      assert_in_delta(expected, thread.wait_time, 0.00001)
+    end
+
+    main = result.threads.detect {|thread| thread.id == Thread.current.object_id}
+    assert_in_delta(0.5, main.wait_time, 0.1)
+  end
+
   def test_thread_identity
     RubyProf.start
     sleep_thread = Thread.new do